@@ -0,0 +1,1051 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION kmer UPDATE TO '1.1.0'" to load this file. \quit
+
+-- Packed storage
+-- From 1.1.0 on a kmer is stored 2-bit packed (at most 10 bytes), a qkmer as
+-- one IUPAC mask nibble per position, and a dna value 2-bit packed with a
+-- side list of N runs, instead of all three being ASCII. Packed dna gains
+-- nothing from pglz, and uncompressed out-of-line values can be sliced
+-- without reading the whole value, so dna switches to external storage.
+ALTER TYPE dna SET (STORAGE = external);
+
+CREATE FUNCTION kmer_upgrade_packed(kmer)
+    RETURNS kmer
+    AS 'MODULE_PATHNAME', 'kmer_upgrade_packed'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION qkmer_upgrade_packed(qkmer)
+    RETURNS qkmer
+    AS 'MODULE_PATHNAME', 'qkmer_upgrade_packed'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_upgrade_packed(dna)
+    RETURNS dna
+    AS 'MODULE_PATHNAME', 'dna_upgrade_packed'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION upgrade_packed_array(anyarray, regprocedure)
+    RETURNS anyarray
+    AS 'MODULE_PATHNAME', 'upgrade_packed_array'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Every kmer, qkmer and dna value written by 1.0.0 is rewritten here: plain
+-- columns, arrays of the three types, and domains over either. The rewrite
+-- also rebuilds the indexes on those columns and picks up the new storage.
+-- Values that cannot be rewritten in place, inside composite columns or as
+-- constants in defaults, constraints, index expressions and views, make the
+-- update fail with a list of them instead of being left unreadable, as do
+-- views on the columns to rewrite, which keep them from being altered.
+DO $$
+DECLARE
+    type_oids oid[];
+    base_oids oid[];
+    scalars name[];
+    kinds text[];
+    consts text;
+    unsupported text;
+    col record;
+BEGIN
+    -- Types holding such values. A domain inherits the base and kind of the
+    -- type it is over, so base is the type the USING expression works on.
+    WITH RECURSIVE affected(oid, base, scalar, kind) AS (
+        SELECT t.oid, t.oid, t.typname, 'scalar'
+        FROM pg_type t
+        WHERE t.oid IN ('kmer'::regtype, 'qkmer'::regtype, 'dna'::regtype)
+      UNION
+        SELECT t.oid,
+               CASE WHEN t.typtype = 'd' THEN r.base ELSE t.oid END,
+               CASE WHEN t.typtype = 'd' OR r.kind = 'scalar' AND t.typelem = r.oid
+                    THEN r.scalar END,
+               CASE WHEN t.typtype = 'd' THEN r.kind
+                    WHEN r.kind = 'scalar' AND t.typelem = r.oid THEN 'array'
+                    ELSE 'other' END
+        FROM affected r
+        JOIN pg_type t
+          ON t.typbasetype = r.oid
+          OR (t.typelem = r.oid AND t.typlen = -1)
+          OR EXISTS (SELECT 1 FROM pg_attribute a
+                     WHERE a.attrelid = t.typrelid
+                       AND a.atttypid = r.oid
+                       AND a.attnum > 0
+                       AND NOT a.attisdropped)
+    )
+    SELECT array_agg(oid), array_agg(base), array_agg(scalar), array_agg(kind)
+    INTO type_oids, base_oids, scalars, kinds
+    FROM affected;
+
+    consts := ':consttype (' || array_to_string(type_oids, '|') || ') :consttypmod -?\d+ '
+              ':constcollid \d+ :constlen -?\d+ :constbyval \w+ :constisnull false';
+
+    SELECT string_agg(obj, ', ' ORDER BY obj) INTO unsupported
+    FROM (
+        SELECT format('column %I of %s', a.attname, c.oid::regclass) AS obj
+        FROM unnest(type_oids, kinds) AS u(oid, kind)
+        JOIN pg_attribute a ON a.atttypid = u.oid
+        JOIN pg_class c ON c.oid = a.attrelid
+        WHERE u.kind = 'other'
+          AND a.attnum > 0
+          AND NOT a.attisdropped
+          AND a.attinhcount = 0
+          AND c.relkind IN ('r', 'p')
+      UNION
+        -- Views and rules using a column keep it from being altered
+        SELECT format('view %s', w.ev_class::regclass)
+        FROM pg_depend d
+        JOIN pg_rewrite w ON w.oid = d.objid
+        JOIN pg_attribute a ON a.attrelid = d.refobjid AND a.attnum = d.refobjsubid
+        JOIN pg_class c ON c.oid = a.attrelid
+        WHERE d.classid = 'pg_rewrite'::regclass
+          AND d.refclassid = 'pg_class'::regclass
+          AND a.atttypid = ANY (type_oids)
+          AND c.relkind IN ('r', 'p')
+      UNION
+        SELECT format('default of column %I of %s', a.attname, c.oid::regclass)
+        FROM pg_attrdef d
+        JOIN pg_attribute a ON a.attrelid = d.adrelid AND a.attnum = d.adnum
+        JOIN pg_class c ON c.oid = d.adrelid
+        WHERE d.adbin::text ~ consts
+          AND a.attinhcount = 0
+      UNION
+        SELECT CASE WHEN x.contypid <> 0
+                    THEN format('constraint %I of domain %s', x.conname, x.contypid::regtype)
+                    ELSE format('constraint %I of %s', x.conname, x.conrelid::regclass) END
+        FROM pg_constraint x
+        WHERE x.conbin::text ~ consts
+          AND x.coninhcount = 0
+      UNION
+        SELECT format('index %s', i.indexrelid::regclass)
+        FROM pg_index i
+        WHERE i.indexprs::text ~ consts OR i.indpred::text ~ consts
+      UNION
+        SELECT CASE WHEN w.rulename = '_RETURN'
+                    THEN format('view %s', w.ev_class::regclass)
+                    ELSE format('rule %I of %s', w.rulename, w.ev_class::regclass) END
+        FROM pg_rewrite w
+        WHERE w.ev_action::text ~ consts OR w.ev_qual::text ~ consts
+    ) AS objs;
+
+    IF unsupported IS NOT NULL THEN
+        RAISE EXCEPTION 'Cannot rewrite the kmer, qkmer and dna values stored in %', unsupported
+            USING HINT = 'Drop these objects, or the constants in them, before the update and '
+                         'recreate them afterwards.';
+    END IF;
+
+    -- Inherited columns (including those of partitions) are rewritten
+    -- through the table that defines them
+    FOR col IN
+        SELECT c.oid::regclass AS tab, a.attname, u.scalar, u.kind,
+               format_type(u.base, NULL) AS base,
+               format_type(a.atttypid, a.atttypmod) AS typ
+        FROM unnest(type_oids, base_oids, scalars, kinds) AS u(oid, base, scalar, kind)
+        JOIN pg_attribute a ON a.atttypid = u.oid
+        JOIN pg_class c ON c.oid = a.attrelid
+        WHERE u.kind IN ('scalar', 'array')
+          AND a.attnum > 0
+          AND NOT a.attisdropped
+          AND a.attinhcount = 0
+          AND c.relkind IN ('r', 'p')
+    LOOP
+        IF col.kind = 'scalar' THEN
+            EXECUTE format('ALTER TABLE %s ALTER COLUMN %I TYPE %s USING %s_upgrade_packed(%I::%s)::%s',
+                           col.tab, col.attname, col.typ, col.scalar, col.attname, col.base,
+                           col.typ);
+        ELSE
+            EXECUTE format('ALTER TABLE %s ALTER COLUMN %I TYPE %s '
+                           'USING upgrade_packed_array(%I::%s, %L)::%s',
+                           col.tab, col.attname, col.typ, col.attname, col.base,
+                           col.scalar || '_upgrade_packed(' || col.scalar || ')', col.typ);
+        END IF;
+    END LOOP;
+
+    -- Materialized views are refreshed from the rewritten tables, and their
+    -- statistics, which still hold 1.0.0 values, are gathered again
+    FOR col IN
+        SELECT DISTINCT c.oid::regclass AS tab
+        FROM pg_attribute a
+        JOIN pg_class c ON c.oid = a.attrelid
+        WHERE a.atttypid = ANY (type_oids)
+          AND c.relkind = 'm'
+          AND c.relispopulated
+    LOOP
+        EXECUTE format('REFRESH MATERIALIZED VIEW %s', col.tab);
+        EXECUTE format('ANALYZE %s', col.tab);
+    END LOOP;
+END
+$$;
+
+DROP FUNCTION kmer_upgrade_packed(kmer);
+DROP FUNCTION qkmer_upgrade_packed(qkmer);
+DROP FUNCTION dna_upgrade_packed(dna);
+DROP FUNCTION upgrade_packed_array(anyarray, regprocedure);
+
+-- Substring function. substring() is SQL syntax bound to pg_catalog, so
+-- the dna version is named substr, like substr(text, integer, integer).
+CREATE FUNCTION substr(dna, integer, integer)
+    RETURNS dna
+    AS 'MODULE_PATHNAME', 'dna_substring'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Radix SP-GiST Index Functions
+CREATE FUNCTION kmer_radix_config(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_radix_config'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_radix_choose(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_radix_choose'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_radix_picksplit(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_radix_picksplit'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_radix_inner_consistent(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_radix_inner_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Create the operator class for the 4-ary radix trie SP-GiST variant
+-- Leaves are tested exactly as in kmer_spgist_ops
+CREATE OPERATOR CLASS kmer_spgist_radix_ops
+    FOR TYPE kmer USING spgist AS
+    OPERATOR 3 = (kmer, kmer),
+    OPERATOR 7 @> (qkmer, kmer),
+    OPERATOR 8 <@ (kmer, qkmer),
+    OPERATOR 28 ^@ (kmer, kmer),
+    FUNCTION 1 kmer_radix_config(internal, internal),
+    FUNCTION 2 kmer_radix_choose(internal, internal),
+    FUNCTION 3 kmer_radix_picksplit(internal, internal),
+    FUNCTION 4 kmer_radix_inner_consistent(internal, internal),
+    FUNCTION 5 kmer_leaf_consistent(internal, internal);
+
+-- B-tree Functions
+CREATE FUNCTION kmer_cmp(kmer, kmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'kmer_cmp'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_lt(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_lt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_le(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_le'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_gt(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_gt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_ge(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_ge'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_ne(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_ne'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_sortsupport(internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_sortsupport'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Ordering operators
+CREATE OPERATOR < (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_lt,
+    COMMUTATOR = '>',
+    NEGATOR = '>=',
+    RESTRICT = scalarltsel,
+    JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_le,
+    COMMUTATOR = '>=',
+    NEGATOR = '>',
+    RESTRICT = scalarlesel,
+    JOIN = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_gt,
+    COMMUTATOR = '<',
+    NEGATOR = '<=',
+    RESTRICT = scalargtsel,
+    JOIN = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_ge,
+    COMMUTATOR = '<=',
+    NEGATOR = '<',
+    RESTRICT = scalargesel,
+    JOIN = scalargejoinsel
+);
+
+-- Not Equal Operator, also recorded as the negator of =
+CREATE OPERATOR <> (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = kmer_ne,
+    COMMUTATOR = '<>',
+    NEGATOR = '=',
+    RESTRICT = neqsel,
+    JOIN = neqjoinsel
+);
+
+-- Let = estimate joins and take part in merge and hash joins, now that kmer
+-- has both a btree and a hash operator class
+ALTER OPERATOR = (kmer, kmer) SET (JOIN = eqjoinsel);
+
+UPDATE pg_catalog.pg_operator
+   SET oprcanmerge = true, oprcanhash = true
+ WHERE oid = '=(kmer, kmer)'::pg_catalog.regoperator;
+
+-- Create the operator class for B-tree support
+-- Packed k-mers are equal only when bitwise equal, so deduplication is safe
+CREATE OPERATOR CLASS kmer_btree_ops
+    DEFAULT FOR TYPE kmer USING btree AS
+    OPERATOR 1 < (kmer, kmer),
+    OPERATOR 2 <= (kmer, kmer),
+    OPERATOR 3 = (kmer, kmer),
+    OPERATOR 4 >= (kmer, kmer),
+    OPERATOR 5 > (kmer, kmer),
+    FUNCTION 1 kmer_cmp(kmer, kmer),
+    FUNCTION 2 kmer_sortsupport(internal),
+    FUNCTION 4 btequalimage(oid);
+
+-- Planner support for prefix searches
+CREATE FUNCTION kmer_prefixsel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_prefixsel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_starts_with_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_starts_with_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_starts_with_op_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_starts_with_op_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Let ^@ and starts_with use a btree index as a range scan
+ALTER FUNCTION starts_with(kmer, kmer) SUPPORT kmer_starts_with_support;
+ALTER FUNCTION starts_with_op(kmer, kmer) SUPPORT kmer_starts_with_op_support;
+
+ALTER OPERATOR ^@ (kmer, kmer) SET (RESTRICT = kmer_prefixsel);
+
+-- Statistics for kmer columns: base frequencies by position and length
+-- frequencies, next to the standard most common values and histogram
+CREATE FUNCTION kmer_typanalyze(internal)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_typanalyze'
+    LANGUAGE C STRICT PARALLEL SAFE;
+
+ALTER TYPE kmer SET (ANALYZE = kmer_typanalyze);
+
+-- Selectivity estimators using those statistics
+CREATE FUNCTION kmer_eqsel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_eqsel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_containssel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_containssel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_containedsel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_containedsel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_prefixjoinsel(internal, oid, internal, smallint, internal)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_prefixjoinsel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+ALTER OPERATOR = (kmer, kmer) SET (RESTRICT = kmer_eqsel);
+ALTER OPERATOR @> (qkmer, kmer) SET (RESTRICT = kmer_containssel);
+ALTER OPERATOR <@ (kmer, qkmer) SET (RESTRICT = kmer_containedsel);
+ALTER OPERATOR ^@ (kmer, kmer) SET (JOIN = kmer_prefixjoinsel);
+
+-- K-mer counting
+CREATE TYPE kmer_count AS (kmer kmer, count bigint);
+
+CREATE FUNCTION kmer_spectrum(dna, integer)
+    RETURNS SETOF kmer_count
+    AS 'MODULE_PATHNAME', 'kmer_spectrum'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Counts of many sequences, sorted by k-mer and delta encoded
+CREATE TYPE kmer_spectrum;
+
+CREATE FUNCTION kmer_spectrum_in(cstring)
+    RETURNS kmer_spectrum
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_out(kmer_spectrum)
+    RETURNS cstring
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_recv(internal)
+    RETURNS kmer_spectrum
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_send(kmer_spectrum)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE kmer_spectrum (
+    INPUT = kmer_spectrum_in,
+    OUTPUT = kmer_spectrum_out,
+    RECEIVE = kmer_spectrum_recv,
+    SEND = kmer_spectrum_send,
+    INTERNALLENGTH = VARIABLE,
+    STORAGE = extended
+);
+
+-- Number of distinct k-mers
+CREATE FUNCTION cardinality(kmer_spectrum)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_cardinality'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- The counts as (kmer, count) rows, in k-mer order
+CREATE FUNCTION unnest(kmer_spectrum)
+    RETURNS SETOF kmer_count
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_unnest'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_transfn(internal, dna, integer)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_finalfn(internal)
+    RETURNS kmer_spectrum
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_finalfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_combinefn(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_combinefn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_serialfn(internal)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_serialfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_spectrum_deserialfn(bytea, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_spectrum_deserialfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Workers count their share of the rows, the leader merges the counts.
+-- Counts past work_mem are spilled to temporary files and merged at the
+-- end, which the final function does in place.
+CREATE AGGREGATE kmer_spectrum_agg(dna, integer) (
+    SFUNC = kmer_spectrum_transfn,
+    STYPE = internal,
+    FINALFUNC = kmer_spectrum_finalfn,
+    FINALFUNC_MODIFY = READ_WRITE,
+    COMBINEFUNC = kmer_spectrum_combinefn,
+    SERIALFUNC = kmer_spectrum_serialfn,
+    DESERIALFUNC = kmer_spectrum_deserialfn,
+    PARALLEL = SAFE
+);
+
+-- Reverse complements and canonical k-mers
+CREATE FUNCTION reverse_complement(dna)
+    RETURNS dna
+    AS 'MODULE_PATHNAME', 'dna_reverse_complement'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION reverse_complement(kmer)
+    RETURNS kmer
+    AS 'MODULE_PATHNAME', 'kmer_reverse_complement'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Immutable, so it can be indexed: CREATE INDEX ... (canonical(kmer))
+CREATE FUNCTION canonical(kmer)
+    RETURNS kmer
+    AS 'MODULE_PATHNAME', 'kmer_canonical'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION generate_kmers(dna, integer, canonical boolean)
+    RETURNS SETOF kmer
+    AS 'MODULE_PATHNAME', 'generate_kmers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Hamming distance searches. The ball carries the mismatch budget, so the
+-- search is a binary operator that an index can serve
+CREATE TYPE hamming_ball AS (center kmer, radius integer);
+
+CREATE FUNCTION hamming_distance(kmer, kmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'kmer_hamming_distance'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION within(kmer, hamming_ball)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_within_ball'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <-> (
+    LEFTARG = kmer,
+    RIGHTARG = kmer,
+    PROCEDURE = hamming_distance,
+    COMMUTATOR = '<->'
+);
+
+CREATE OPERATOR <@ (
+    LEFTARG = kmer,
+    RIGHTARG = hamming_ball,
+    PROCEDURE = within,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+-- Inlined into the operator, so within(k, 'ACGT', 1) can use an index
+CREATE FUNCTION within(kmer, kmer, integer)
+    RETURNS boolean
+    AS 'SELECT $1 <@ ROW($2, $3)::hamming_ball'
+    LANGUAGE SQL IMMUTABLE PARALLEL SAFE;
+
+ALTER OPERATOR FAMILY kmer_spgist_ops USING spgist ADD
+    OPERATOR 31 <@ (kmer, hamming_ball),
+    OPERATOR 15 <-> (kmer, kmer) FOR ORDER BY integer_ops;
+
+ALTER OPERATOR FAMILY kmer_spgist_radix_ops USING spgist ADD
+    OPERATOR 31 <@ (kmer, hamming_ball),
+    OPERATOR 15 <-> (kmer, kmer) FOR ORDER BY integer_ops;
+
+-- Substring searches over sequences
+CREATE FUNCTION contains(dna, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'dna_contains'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION matches(dna, qkmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'dna_matches'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+    LEFTARG = dna,
+    RIGHTARG = kmer,
+    PROCEDURE = contains,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR ~ (
+    LEFTARG = dna,
+    RIGHTARG = qkmer,
+    PROCEDURE = matches,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+-- GIN Index Functions
+CREATE FUNCTION dna_gin_extract_value(dna, internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'dna_gin_extract_value'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_gin_extract_query(dna, internal, int2, internal, internal, internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'dna_gin_extract_query'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_gin_consistent(internal, int2, dna, int4, internal, internal, internal, internal)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'dna_gin_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_gin_compare_partial(int8, int8, int2, internal)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'dna_gin_compare_partial'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_gin_triconsistent(internal, int2, dna, int4, internal, internal, internal)
+    RETURNS "char"
+    AS 'MODULE_PATHNAME', 'dna_gin_triconsistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_gin_options(internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'dna_gin_options'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- Create the operator class for GIN support, indexing the k-mers of each
+-- sequence: CREATE INDEX ... USING gin (sequence dna_gin_ops (k = 12))
+CREATE OPERATOR CLASS dna_gin_ops
+    DEFAULT FOR TYPE dna USING gin AS
+    OPERATOR 7 @> (dna, kmer),
+    OPERATOR 8 ~ (dna, qkmer),
+    FUNCTION 1 btint8cmp(int8, int8),
+    FUNCTION 2 dna_gin_extract_value(dna, internal, internal),
+    FUNCTION 3 dna_gin_extract_query(dna, internal, int2, internal, internal, internal, internal),
+    FUNCTION 4 dna_gin_consistent(internal, int2, dna, int4, internal, internal, internal, internal),
+    FUNCTION 5 dna_gin_compare_partial(int8, int8, int2, internal),
+    FUNCTION 6 dna_gin_triconsistent(internal, int2, dna, int4, internal, internal, internal),
+    FUNCTION 7 dna_gin_options(internal),
+    STORAGE int8;
+
+-- 1-based start of the first occurrence, or 0. POSITION(... IN ...) always
+-- resolves to pg_catalog, so the search is spelled strpos(dna, pattern)
+CREATE FUNCTION strpos(dna, kmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'dna_strpos'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION strpos(dna, qkmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'dna_strpos_pattern'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Binary input and output, so that COPY ... (FORMAT binary) moves the
+-- packed values as they are stored instead of parsing text
+CREATE FUNCTION dna_recv(internal)
+    RETURNS dna
+    AS 'MODULE_PATHNAME', 'dna_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_send(dna)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'dna_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_recv(internal)
+    RETURNS kmer
+    AS 'MODULE_PATHNAME', 'kmer_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_send(kmer)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION qkmer_recv(internal)
+    RETURNS qkmer
+    AS 'MODULE_PATHNAME', 'qkmer_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION qkmer_send(qkmer)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'qkmer_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+ALTER TYPE dna SET (RECEIVE = dna_recv, SEND = dna_send);
+ALTER TYPE kmer SET (RECEIVE = kmer_recv, SEND = kmer_send);
+ALTER TYPE qkmer SET (RECEIVE = qkmer_recv, SEND = qkmer_send);
+
+CREATE FUNCTION read_fasta(path text)
+    RETURNS TABLE(id text, description text, sequence dna)
+    AS 'MODULE_PATHNAME', 'read_fasta'
+    LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION read_fastq(path text)
+    RETURNS TABLE(id text, description text, sequence dna, quality text)
+    AS 'MODULE_PATHNAME', 'read_fastq'
+    LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+-- BRIN operator classes for large append-only k-mer tables. minmax keeps
+-- the least and greatest k-mer of each block range and answers =, range
+-- comparisons and, through the planner support of ^@, prefix searches; it
+-- suits tables loaded in roughly sorted order. bloom keeps a Bloom filter of
+-- the k-mers of each range and answers = whatever the load order.
+CREATE OPERATOR CLASS kmer_minmax_ops
+    DEFAULT FOR TYPE kmer USING brin AS
+    OPERATOR 1 < (kmer, kmer),
+    OPERATOR 2 <= (kmer, kmer),
+    OPERATOR 3 = (kmer, kmer),
+    OPERATOR 4 >= (kmer, kmer),
+    OPERATOR 5 > (kmer, kmer),
+    FUNCTION 1 brin_minmax_opcinfo(internal),
+    FUNCTION 2 brin_minmax_add_value(internal, internal, internal, internal),
+    FUNCTION 3 brin_minmax_consistent(internal, internal, internal),
+    FUNCTION 4 brin_minmax_union(internal, internal, internal);
+
+CREATE OPERATOR CLASS kmer_bloom_ops
+    FOR TYPE kmer USING brin AS
+    OPERATOR 1 = (kmer, kmer),
+    FUNCTION 1 brin_bloom_opcinfo(internal),
+    FUNCTION 2 brin_bloom_add_value(internal, internal, internal, internal),
+    FUNCTION 3 brin_bloom_consistent(internal, internal, internal, integer),
+    FUNCTION 4 brin_bloom_union(internal, internal, internal),
+    FUNCTION 5 brin_bloom_options(internal),
+    FUNCTION 11 hash(kmer),
+    STORAGE kmer;
+
+-- MinHash sketches of DNA sequences
+CREATE TYPE dna_sketch;
+
+CREATE FUNCTION dna_sketch_in(cstring)
+    RETURNS dna_sketch
+    AS 'MODULE_PATHNAME', 'dna_sketch_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_out(dna_sketch)
+    RETURNS cstring
+    AS 'MODULE_PATHNAME', 'dna_sketch_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_recv(internal)
+    RETURNS dna_sketch
+    AS 'MODULE_PATHNAME', 'dna_sketch_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_send(dna_sketch)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'dna_sketch_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- The hashes do not compress, so they are not tried
+CREATE TYPE dna_sketch (
+    INPUT = dna_sketch_in,
+    OUTPUT = dna_sketch_out,
+    RECEIVE = dna_sketch_recv,
+    SEND = dna_sketch_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = double,
+    STORAGE = external
+);
+
+CREATE FUNCTION sketch(dna, k integer, s integer)
+    RETURNS dna_sketch
+    AS 'MODULE_PATHNAME', 'dna_sketch'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION jaccard(dna_sketch, dna_sketch)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'dna_sketch_jaccard_index'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION containment(dna_sketch, dna_sketch)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'dna_sketch_containment'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION sketch_distance(dna_sketch, dna_sketch)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'dna_sketch_distance'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION sketch_overlaps(dna_sketch, dna_sketch)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'dna_sketch_overlaps'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <-> (
+    LEFTARG = dna_sketch,
+    RIGHTARG = dna_sketch,
+    PROCEDURE = sketch_distance,
+    COMMUTATOR = <->
+);
+
+CREATE OPERATOR && (
+    LEFTARG = dna_sketch,
+    RIGHTARG = dna_sketch,
+    PROCEDURE = sketch_overlaps,
+    COMMUTATOR = &&,
+    RESTRICT = areasel,
+    JOIN = areajoinsel
+);
+
+CREATE FUNCTION dna_sketch_gin_extract_value(dna_sketch, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'dna_sketch_gin_extract_value'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_gin_extract_query(dna_sketch, internal, int2, internal, internal, internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'dna_sketch_gin_extract_query'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_gin_consistent(internal, int2, dna_sketch, int4, internal, internal, internal, internal)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'dna_sketch_gin_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION dna_sketch_gin_triconsistent(internal, int2, dna_sketch, int4, internal, internal, internal)
+    RETURNS "char"
+    AS 'MODULE_PATHNAME', 'dna_sketch_gin_triconsistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- Candidate pairs of an all-against-all comparison are the sketches sharing
+-- a hash: a.s && b.s, ranked by a.s <-> b.s
+CREATE OPERATOR CLASS dna_sketch_gin_ops
+    DEFAULT FOR TYPE dna_sketch USING gin AS
+    OPERATOR 3 && (dna_sketch, dna_sketch),
+    FUNCTION 1 btint8cmp(int8, int8),
+    FUNCTION 2 dna_sketch_gin_extract_value(dna_sketch, internal),
+    FUNCTION 3 dna_sketch_gin_extract_query(dna_sketch, internal, int2, internal, internal, internal, internal),
+    FUNCTION 4 dna_sketch_gin_consistent(internal, int2, dna_sketch, int4, internal, internal, internal, internal),
+    FUNCTION 6 dna_sketch_gin_triconsistent(internal, int2, dna_sketch, int4, internal, internal, internal),
+    STORAGE int8;
+
+-- HyperLogLog sketches counting distinct k-mers
+CREATE TYPE kmer_hll;
+
+CREATE FUNCTION kmer_hll_in(cstring)
+    RETURNS kmer_hll
+    AS 'MODULE_PATHNAME', 'kmer_hll_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_out(kmer_hll)
+    RETURNS cstring
+    AS 'MODULE_PATHNAME', 'kmer_hll_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_recv(internal)
+    RETURNS kmer_hll
+    AS 'MODULE_PATHNAME', 'kmer_hll_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_send(kmer_hll)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_hll_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE kmer_hll (
+    INPUT = kmer_hll_in,
+    OUTPUT = kmer_hll_out,
+    RECEIVE = kmer_hll_recv,
+    SEND = kmer_hll_send,
+    INTERNALLENGTH = VARIABLE,
+    STORAGE = extended
+);
+
+CREATE FUNCTION cardinality(kmer_hll)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'kmer_hll_cardinality'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_union(kmer_hll, kmer_hll)
+    RETURNS kmer_hll
+    AS 'MODULE_PATHNAME', 'kmer_hll_union'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_transfn(kmer_hll, dna, integer)
+    RETURNS kmer_hll
+    AS 'MODULE_PATHNAME', 'kmer_hll_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_union_transfn(kmer_hll, kmer_hll)
+    RETURNS kmer_hll
+    AS 'MODULE_PATHNAME', 'kmer_hll_union_transfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_hll_count_finalfn(kmer_hll)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME', 'kmer_hll_count_finalfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- The sketch is the state, so workers hand their sketches to the leader
+-- without serialization and the leader merges them
+CREATE AGGREGATE approx_distinct_kmers(dna, integer) (
+    SFUNC = kmer_hll_transfn,
+    STYPE = kmer_hll,
+    FINALFUNC = kmer_hll_count_finalfn,
+    COMBINEFUNC = kmer_hll_union_transfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE kmer_hll_agg(dna, integer) (
+    SFUNC = kmer_hll_transfn,
+    STYPE = kmer_hll,
+    COMBINEFUNC = kmer_hll_union_transfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE kmer_hll_union_agg(kmer_hll) (
+    SFUNC = kmer_hll_union_transfn,
+    STYPE = kmer_hll,
+    COMBINEFUNC = kmer_hll_union_transfn,
+    PARALLEL = SAFE
+);
+
+-- Bloom filters of k-mers
+CREATE TYPE kmer_bloom;
+
+CREATE FUNCTION kmer_bloom_in(cstring)
+    RETURNS kmer_bloom
+    AS 'MODULE_PATHNAME', 'kmer_bloom_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_out(kmer_bloom)
+    RETURNS cstring
+    AS 'MODULE_PATHNAME', 'kmer_bloom_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_recv(internal)
+    RETURNS kmer_bloom
+    AS 'MODULE_PATHNAME', 'kmer_bloom_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_send(kmer_bloom)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_bloom_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- The bits of a filter do not compress, so they are not tried
+CREATE TYPE kmer_bloom (
+    INPUT = kmer_bloom_in,
+    OUTPUT = kmer_bloom_out,
+    RECEIVE = kmer_bloom_recv,
+    SEND = kmer_bloom_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = double,
+    STORAGE = external
+);
+
+CREATE FUNCTION within(kmer, kmer_bloom)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_bloom_within'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <@ (
+    LEFTARG = kmer,
+    RIGHTARG = kmer_bloom,
+    PROCEDURE = within,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+CREATE FUNCTION kmer_bloom_union(kmer_bloom, kmer_bloom)
+    RETURNS kmer_bloom
+    AS 'MODULE_PATHNAME', 'kmer_bloom_union'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_transfn(internal, kmer, bigint)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_bloom_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_transfn(internal, kmer, bigint, float8)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_bloom_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_finalfn(internal)
+    RETURNS kmer_bloom
+    AS 'MODULE_PATHNAME', 'kmer_bloom_finalfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_combinefn(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_bloom_combinefn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_serialfn(internal)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_bloom_serialfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_deserialfn(bytea, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_bloom_deserialfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION kmer_bloom_union_transfn(kmer_bloom, kmer_bloom)
+    RETURNS kmer_bloom
+    AS 'MODULE_PATHNAME', 'kmer_bloom_union_transfn'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+-- kmer_bloom_agg(kmer, capacity, false_positive_rate), the rate being 1%
+-- when left out. The first row sizes the filter, which is kept as internal
+-- so that the executor does not copy it.
+CREATE AGGREGATE kmer_bloom_agg(kmer, bigint) (
+    SFUNC = kmer_bloom_transfn,
+    STYPE = internal,
+    FINALFUNC = kmer_bloom_finalfn,
+    FINALFUNC_MODIFY = READ_WRITE,
+    COMBINEFUNC = kmer_bloom_combinefn,
+    SERIALFUNC = kmer_bloom_serialfn,
+    DESERIALFUNC = kmer_bloom_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE kmer_bloom_agg(kmer, bigint, float8) (
+    SFUNC = kmer_bloom_transfn,
+    STYPE = internal,
+    FINALFUNC = kmer_bloom_finalfn,
+    FINALFUNC_MODIFY = READ_WRITE,
+    COMBINEFUNC = kmer_bloom_combinefn,
+    SERIALFUNC = kmer_bloom_serialfn,
+    DESERIALFUNC = kmer_bloom_deserialfn,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE kmer_bloom_union_agg(kmer_bloom) (
+    SFUNC = kmer_bloom_union_transfn,
+    STYPE = kmer_bloom,
+    COMBINEFUNC = kmer_bloom_union_transfn,
+    PARALLEL = SAFE
+);
+
+-- Seed-and-extend search of query in subject: the diagonals holding at
+-- least min_hits shared k-mers are extended by a banded local alignment,
+-- returning its score and 1-based start in subject, or no row
+CREATE FUNCTION seed_and_extend(subject dna, query dna, k integer, min_hits integer)
+    RETURNS TABLE(score integer, "position" integer)
+    AS 'MODULE_PATHNAME', 'dna_seed_and_extend'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    ROWS 1;
+
+-- Search of query in column col of table tab, best first. The rows sharing
+-- a k-mer with the query are found through the dna_gin_ops index of the
+-- column, which works best built with the same k:
+-- SELECT * FROM dna_search('reads', 'sequence', query, 12, 2)
+CREATE FUNCTION dna_search(tab regclass, col name, query dna, k integer, min_hits integer)
+    RETURNS TABLE(ctid tid, score integer, "position" integer)
+    LANGUAGE plpgsql STABLE STRICT PARALLEL SAFE
+    AS $$
+BEGIN
+    RETURN QUERY EXECUTE format(
+        'SELECT t.ctid, m.score, m.position '
+        'FROM %s t, LATERAL seed_and_extend(t.%I, $1, $2, $3) m '
+        'WHERE t.%I @> ANY (ARRAY(SELECT DISTINCT generate_kmers($1, $2))) '
+        'ORDER BY m.score DESC, t.ctid',
+        tab, col, col)
+    USING query, k, min_hits;
+END
+$$;
+
+-- Every occurrence of the patterns of an array in one pass, as the
+-- subscript of the pattern and its 1-based start:
+-- SELECT * FROM reads, find_kmers(sequence, ARRAY['ACGTAC', 'TTGACA']::kmer[])
+CREATE FUNCTION find_kmers(dna, kmer[])
+    RETURNS TABLE(pattern_idx integer, "position" integer)
+    AS 'MODULE_PATHNAME', 'dna_find_kmers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION find_kmers(dna, qkmer[])
+    RETURNS TABLE(pattern_idx integer, "position" integer)
+    AS 'MODULE_PATHNAME', 'dna_find_patterns'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
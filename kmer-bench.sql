@@ -0,0 +1,66 @@
+-- Benchmarks of the kmer extension. They build tables of 100M rows or
+-- bases and take a long time and several GB of disk, so they are kept out
+-- of kmer-test.sql; run them on purpose, against the previous and the
+-- current build:
+-- psql -f kmer-bench.sql
+
+
+
+-- ########################### SP-GiST benchmark ###########################
+
+-- Pattern, prefix and equality scans over a 100M-row SP-GiST index.
+-- Run against the previous and the current build and compare the
+-- execution times and buffer counts of the EXPLAIN output. The k-mers are
+-- spelled from md5 digits, which is much faster than one subquery per row.
+    CREATE TABLE kmer_bench AS
+        SELECT translate(substr(md5(g::text), 1, 21 + g % 2),
+                         '0123456789abcdef', 'ACGTACGTACGTACGT')::kmer AS k
+        FROM generate_series(1, 100000000) AS g;
+    CREATE INDEX kmer_bench_spgist ON kmer_bench USING spgist (k);
+    VACUUM ANALYZE kmer_bench;
+    SET enable_seqscan = off;
+
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE k = 'ACGTACGTACGTACGTACGTA'::kmer;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE k ^@ 'ACGTACGTAC'::kmer;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE 'ANNNNNNNNNNNNNNNNNNGT'::qkmer @> k;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT k FROM kmer_bench WHERE 'ACGTNNNNNNNNNNNNNNNNN'::qkmer @> k;
+
+    RESET enable_seqscan;
+
+-- Current build only: the radix trie variant, and sorting with abbreviated
+-- keys through the btree opclass, which the previous build lacks
+    DROP INDEX kmer_bench_spgist;
+    CREATE INDEX kmer_bench_radix ON kmer_bench USING spgist (k kmer_spgist_radix_ops);
+    SET enable_seqscan = off;
+
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE k = 'ACGTACGTACGTACGTACGTA'::kmer;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE k ^@ 'ACGTACGTAC'::kmer;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT count(*) FROM kmer_bench WHERE 'ANNNNNNNNNNNNNNNNNNGT'::qkmer @> k;
+    EXPLAIN (ANALYZE, BUFFERS) SELECT k FROM kmer_bench WHERE 'ACGTNNNNNNNNNNNNNNNNN'::qkmer @> k;
+
+    RESET enable_seqscan;
+    EXPLAIN (ANALYZE) SELECT k FROM kmer_bench ORDER BY k OFFSET 100000000;
+
+    DROP TABLE kmer_bench;
+
+-- ########################################################################
+
+
+
+
+-- ############################# Text input ###############################
+
+-- Throughput of the text input of a 100M-base sequence; compare the
+-- execution time against the previous build. The previous build rejects N,
+-- so the comparison uses A, C, G and T only.
+    CREATE TEMP TABLE input_bench AS SELECT repeat('ACGTTacgtA', 10000000) AS s;
+    EXPLAIN ANALYZE SELECT length(s::dna) FROM input_bench;
+    DROP TABLE input_bench;
+
+-- Current build only: the same input with an N every 10 bases, each stored
+-- as an N run
+    CREATE TEMP TABLE input_bench AS SELECT repeat('ACGTNacgtA', 10000000) AS s;
+    EXPLAIN ANALYZE SELECT length(s::dna) FROM input_bench;
+    DROP TABLE input_bench;
+
+-- ########################################################################
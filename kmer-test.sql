@@ -33,6 +33,15 @@ CREATE TABLE dna_kmer_test (
 -- SEARCH with index
     SELECT * FROM dna_kmer_test WHERE kmer_sequence = 'AGCTAGCT'::kmer;
 
+-- INDEX with the radix trie variant
+    DROP INDEX kmer_index;
+    CREATE INDEX kmer_radix_index ON dna_kmer_test USING spgist (kmer_sequence kmer_spgist_radix_ops);
+
+-- SEARCH with radix index
+    SELECT * FROM dna_kmer_test WHERE kmer_sequence = 'AGCTAGCT'::kmer;
+    SELECT * FROM dna_kmer_test WHERE kmer_sequence ^@ 'AG'::kmer;
+    SELECT * FROM dna_kmer_test WHERE 'AGNNAGCT'::qkmer @> kmer_sequence;
+
 -- ########################################################################
 
 
@@ -44,8 +53,10 @@ CREATE TABLE dna_kmer_test (
 -- Valid values
     SELECT 'AAAACCCCGGGGTTTT'::dna;   
     SELECT 'ACGTTGCA'::dna;           
+-- Runs of N are kept (stored as a side list of runs)
+    SELECT 'ACGTNNNNACGT'::dna; -- Return acgtnnnnacgt
 -- Invalid values
-    SELECT 'ACGTN'::dna; -- Contains invalid character 'N'
+    SELECT 'ACGTX'::dna; -- Contains invalid character 'X'
 
 -- KMER 
 -- Valid values
@@ -86,6 +97,31 @@ CREATE TABLE dna_kmer_test (
 
 
 
+-- ################################ substr ################################
+
+-- Functionality Test: 1-based start and length, like substr(text)
+    SELECT substr('ACGTACGTAC'::dna, 3, 4); -- Return gtac
+
+-- Window partly outside the sequence is clamped
+    SELECT substr('ACGTACGTAC'::dna, 0, 3); -- Return ac
+    SELECT substr('ACGTACGTAC'::dna, 9, 10); -- Return ac
+
+-- N runs are kept
+    SELECT substr('ACGTNNNNACGT'::dna, 3, 4); -- Return gtnn
+
+-- Negative length: Return an exception
+    SELECT substr('ACGT'::dna, 1, -1);
+
+-- Slicing a long sequence only fetches the TOAST chunks it needs
+    CREATE TABLE dna_slice_test AS SELECT repeat('ACGT', 1000000)::dna AS seq;
+    SELECT length(seq), substr(seq, 2000001, 8) FROM dna_slice_test; -- Return 4000000, acgtacgt
+    DROP TABLE dna_slice_test;
+
+-- ########################################################################
+
+
+
+
 -- ############################ generate_kmers ############################
 
 -- Empty sequences: Generate kmers with length 0
@@ -101,6 +137,20 @@ CREATE TABLE dna_kmer_test (
 -- length equal than k: Return the same sequence
     SELECT * FROM generate_kmers('ACGTACGT'::dna, 8); 
 
+-- N runs: windows overlapping an N are skipped
+-- Return 2 sequences: ACG, TTG
+    SELECT * FROM generate_kmers('ACGNNTTG'::dna, 3);
+
+-- Called in the select list, as in INSERT ... SELECT: Return 6 sequences
+    SELECT generate_kmers('ACGTACGT'::dna, 3);
+
+-- Long out-of-line sequence, read a slice at a time
+-- Return 999980 and 999990
+    CREATE TABLE dna_long AS SELECT repeat('ACGTACGTAC', 100000)::dna AS d;
+    SELECT count(*) FROM dna_long, generate_kmers(d, 21);
+    SELECT count(*) FROM (SELECT generate_kmers(d, 11) FROM dna_long) AS k;
+    DROP TABLE dna_long;
+
 -- Cartesian Product: Compute the cartesian product between two generated kmers
 -- It should return 25 rows 
     SELECT 
@@ -433,4 +483,662 @@ CREATE TABLE dna_kmer_test (
     FROM generate_kmers('ACGTACGT'::dna, 4) AS k(kmer) 
     GROUP BY k.kmer;
 
--- ########################################################################
\ No newline at end of file
+-- ########################################################################
+
+
+
+-- ############################### ORDER BY ###############################
+
+-- Comparison operators: k-mers order as their text, shorter prefixes first
+-- Return True, True, True, True, True, False
+    SELECT
+            'ACG'::kmer < 'ACGT'::kmer,
+            'ACGT'::kmer < 'ACT'::kmer,
+            'T'::kmer > 'GTTT'::kmer,
+            'ACGT'::kmer <= 'ACGT'::kmer,
+            'ACGT'::kmer <> 'ACGA'::kmer,
+            ''::kmer >= 'A'::kmer;
+
+-- ORDER BY: Return ACGT, ACGT, CGTA, GTAC, TACG
+    SELECT k.kmer
+    FROM generate_kmers('ACGTACGT'::dna, 4) AS k(kmer)
+    ORDER BY k.kmer;
+
+-- DISTINCT through a sort: Return 4 rows
+    SET enable_hashagg = off;
+    SELECT DISTINCT k.kmer
+    FROM generate_kmers('ACGTACGT'::dna, 4) AS k(kmer);
+    RESET enable_hashagg;
+
+-- Merge join: Return 6 rows, same as the inner join above
+    SET enable_hashjoin = off;
+    SET enable_nestloop = off;
+    SELECT a.kmer, b.kmer
+    FROM generate_kmers('ACGTACGT'::dna, 4) AS a(kmer)
+    INNER JOIN generate_kmers('GTACGTAC'::dna, 4) AS b(kmer) ON a.kmer = b.kmer;
+    RESET enable_hashjoin;
+    RESET enable_nestloop;
+
+-- B-tree index: Return ACGTA, ACGTAC
+    CREATE TABLE kmers_btree (k kmer);
+    INSERT INTO kmers_btree VALUES ('ACGTA'), ('ACGTAC'), ('ACG'), ('ACT'), ('GATTACA');
+    CREATE INDEX kmers_btree_idx ON kmers_btree USING btree (k);
+    SET enable_seqscan = off;
+    SELECT k FROM kmers_btree WHERE k > 'ACGT'::kmer AND k < 'ACT'::kmer ORDER BY k;
+
+-- Prefix search on the B-tree index: Index Cond: k >= 'ACG' AND k < 'ACT'
+-- Return ACG, ACGTA, ACGTAC
+    EXPLAIN (COSTS OFF) SELECT k FROM kmers_btree WHERE k ^@ 'ACG'::kmer;
+    SELECT k FROM kmers_btree WHERE k ^@ 'ACG'::kmer ORDER BY k;
+    SELECT k FROM kmers_btree WHERE starts_with('ACG'::kmer, k) ORDER BY k;
+
+-- Prefix ending in T: Index Cond: k >= 'ACT' AND k < 'AG'
+-- Return ACT
+    SELECT k FROM kmers_btree WHERE k ^@ 'ACT'::kmer;
+    RESET enable_seqscan;
+    DROP TABLE kmers_btree;
+
+-- ########################################################################
+
+
+
+-- ############################## Statistics ##############################
+
+-- Estimates: the row counts of the plans should be close to the actual ones
+    CREATE TABLE kmers_stats AS
+        SELECT k.kmer
+        FROM generate_series(1, 20) AS g,
+             generate_kmers(repeat('ACGTTGCAAGCT', 5)::dna, 7) AS k(kmer);
+    ANALYZE kmers_stats;
+
+    -- Statistics kinds 9301 and 9302 are stored next to the standard ones
+    SELECT stakind1, stakind2, stakind3, stakind4, stakind5
+    FROM pg_statistic
+    WHERE starelid = 'kmers_stats'::regclass;
+
+    EXPLAIN ANALYZE SELECT * FROM kmers_stats WHERE 'ANNNNGT'::qkmer @> kmer;
+    EXPLAIN ANALYZE SELECT * FROM kmers_stats WHERE kmer <@ 'NNNNNNN'::qkmer;
+    EXPLAIN ANALYZE SELECT * FROM kmers_stats WHERE kmer ^@ 'ACG'::kmer;
+    EXPLAIN ANALYZE SELECT * FROM kmers_stats WHERE kmer = 'ACGTACG'::kmer;
+    EXPLAIN ANALYZE SELECT * FROM kmers_stats a, kmers_stats b WHERE a.kmer ^@ b.kmer;
+    DROP TABLE kmers_stats;
+
+-- ########################################################################
+
+
+
+-- ########################## reverse_complement ##########################
+
+-- Reverse complement of a sequence, N runs included
+-- Return CANNGT, empty
+    SELECT reverse_complement('ACNNTG'::dna), reverse_complement(''::dna);
+
+-- Reverse complement of a k-mer: Return ACGGT
+    SELECT reverse_complement('ACCGT'::kmer);
+
+-- Canonical k-mers: Return AAC, AAC, ACGT
+    SELECT canonical('AAC'::kmer), canonical('GTT'::kmer), canonical('ACGT'::kmer);
+
+-- Canonical mode of generate_kmers: Return ACG, CGT -> ACG, GTT -> AAC
+    SELECT * FROM generate_kmers('ACGTT'::dna, 3, true);
+
+-- Expression indexes on canonical k-mers, matching either strand
+-- Return GTT in both cases
+    CREATE TABLE kmers_canonical (k kmer);
+    INSERT INTO kmers_canonical VALUES ('AAC'), ('GTT'), ('ACGT');
+    DELETE FROM kmers_canonical WHERE k = 'AAC';
+    CREATE INDEX kmers_canonical_spgist ON kmers_canonical USING spgist (canonical(k));
+    CREATE INDEX kmers_canonical_hash ON kmers_canonical USING hash (canonical(k));
+    SET enable_seqscan = off;
+    SELECT k FROM kmers_canonical WHERE canonical(k) = canonical('AAC'::kmer);
+    SELECT k FROM kmers_canonical WHERE canonical(k) ^@ 'AA'::kmer;
+    RESET enable_seqscan;
+    DROP TABLE kmers_canonical;
+
+-- ########################################################################
+
+
+
+-- ############################ kmer_spectrum #############################
+
+-- Counts of each k-mer: Return ACGT 2, CGTA 1, GTAC 1, TACG 1
+    SELECT * FROM kmer_spectrum('ACGTACGT'::dna, 4) ORDER BY kmer;
+
+-- Same counts as the GROUP BY over generate_kmers: Return 0 rows
+    SELECT * FROM kmer_spectrum('ACGTNNACGTTGCA'::dna, 3)
+    EXCEPT
+    SELECT k.kmer, COUNT(*) FROM generate_kmers('ACGTNNACGTTGCA'::dna, 3) AS k(kmer) GROUP BY k.kmer;
+
+-- Invalid lengths: Throw errors
+    SELECT * FROM kmer_spectrum('ACGT'::dna, 0);
+    SELECT * FROM kmer_spectrum('AC'::dna, 5);
+
+-- A table larger than work_mem is spilled to disk and merged: the rows come
+-- in k-mer order, with the counts of the GROUP BY. Return 0 rows
+    CREATE TEMP TABLE long_read AS
+        SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')::dna AS d
+        FROM generate_series(1, 100000);
+    SET work_mem = '64kB';
+    SELECT s.kmer, s.count, row_number() OVER () FROM long_read, kmer_spectrum(d, 12) AS s
+    EXCEPT
+    SELECT g.kmer, g.count, row_number() OVER (ORDER BY g.kmer)
+    FROM (SELECT k.kmer, COUNT(*) FROM long_read, generate_kmers(d, 12) AS k(kmer)
+          GROUP BY k.kmer) AS g;
+    RESET work_mem;
+    DROP TABLE long_read;
+
+-- Aggregate over many rows into a kmer_spectrum, shorter and null
+-- sequences add nothing: Return ACG 3, CGT 2, GTA 1, TAC 1
+    SELECT (unnest(kmer_spectrum_agg(d, 3))).*
+    FROM (VALUES ('ACGTACG'::dna), ('ACGT'::dna), ('AC'::dna), (NULL::dna)) AS t(d)
+    ORDER BY 1;
+
+-- Parallel aggregate: the plan shows Partial Aggregate under a Gather,
+-- and the counts match the serial plan. Return 0 rows
+    CREATE TABLE reads AS
+        SELECT (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')
+                FROM generate_series(1, 150 + g % 2))::dna AS d
+        FROM generate_series(1, 100000) AS g;
+    ANALYZE reads;
+    SET parallel_setup_cost = 0;
+    SET parallel_tuple_cost = 0;
+    SET min_parallel_table_scan_size = 0;
+    EXPLAIN (COSTS OFF) SELECT kmer_spectrum_agg(d, 21) FROM reads;
+    CREATE TEMP TABLE spectrum_parallel AS SELECT (unnest(kmer_spectrum_agg(d, 5))).* FROM reads;
+    SET max_parallel_workers_per_gather = 0;
+    SELECT * FROM spectrum_parallel
+    EXCEPT
+    SELECT (unnest(kmer_spectrum_agg(d, 5))).* FROM reads;
+    RESET max_parallel_workers_per_gather;
+    RESET parallel_setup_cost;
+    RESET parallel_tuple_cost;
+    RESET min_parallel_table_scan_size;
+    DROP TABLE spectrum_parallel;
+
+-- Counts past work_mem are spilled to temporary files and merged: the
+-- counts match the ones counted in memory. Return 0 rows
+    CREATE TEMP TABLE spectrum_memory AS SELECT (unnest(kmer_spectrum_agg(d, 12))).* FROM reads;
+    SET work_mem = '64kB';
+    SELECT * FROM spectrum_memory
+    EXCEPT
+    SELECT (unnest(kmer_spectrum_agg(d, 12))).* FROM reads;
+    RESET work_mem;
+    DROP TABLE spectrum_memory;
+    DROP TABLE reads;
+
+-- Text form, in k-mer order: Return k=3:acg=2,cgt=1,gta=1,tac=1
+    SELECT kmer_spectrum_agg(d, 3) FROM (VALUES ('ACGTACG'::dna)) AS t(d);
+
+-- Input in any order, repeated k-mers summed: Return k=2:ac=3,tt=1 and 2
+    SELECT 'k=2:TT=1,AC=2,ac=1'::kmer_spectrum, cardinality('k=2:TT=1,AC=2,ac=1'::kmer_spectrum);
+
+-- Throw errors: a k-mer of another length, and a count of 0
+    SELECT 'k=2:acg=1'::kmer_spectrum;
+    SELECT 'k=2:ac=0'::kmer_spectrum;
+
+-- Different lengths in one aggregate: Throw error
+    SELECT kmer_spectrum_agg(d, k)
+    FROM (VALUES ('ACGTACG'::dna, 3), ('ACGT'::dna, 4)) AS t(d, k);
+
+-- ########################################################################
+
+
+
+-- ########################### Hamming distance ###########################
+
+-- Distances: Return 0, 1, 2, 2 (a longer k-mer counts its extra bases)
+    SELECT 'ACGT'::kmer <-> 'ACGT'::kmer, 'ACGT'::kmer <-> 'ACTT'::kmer,
+           'ACGT'::kmer <-> 'TCGA'::kmer, 'ACGT'::kmer <-> 'AC'::kmer;
+
+-- Return True, False, True, NULL
+    SELECT within('ACGT'::kmer, 'ACTT'::kmer, 1), within('ACGT'::kmer, 'TCGA'::kmer, 1),
+           'ACGT'::kmer <@ ('TCGA', 2)::hamming_ball, within('ACGT'::kmer, 'ACGT'::kmer, NULL);
+
+-- Index searches within a radius and nearest neighbours, in both SP-GiST
+-- variants. The plans are index scans and the rows match the sequential scan.
+-- Return 0 rows for each EXCEPT
+    CREATE TABLE kmers_hamming AS
+        SELECT k.kmer AS k
+        FROM generate_kmers(repeat('ACGTTGCAAGCTTAGGCATC', 50)::dna, 8) AS k(kmer);
+    CREATE TEMP TABLE hamming_expected AS
+        SELECT k, k <-> 'ACGTTGCA' AS d FROM kmers_hamming WHERE within(k, 'ACGTTGCA', 2);
+    CREATE INDEX kmers_hamming_spgist ON kmers_hamming USING spgist (k);
+    SET enable_seqscan = off;
+    SET enable_bitmapscan = off;
+    EXPLAIN (COSTS OFF) SELECT k FROM kmers_hamming WHERE within(k, 'ACGTTGCA', 2);
+    SELECT k FROM hamming_expected
+    EXCEPT ALL
+    SELECT k FROM kmers_hamming WHERE within(k, 'ACGTTGCA', 2);
+    EXPLAIN (COSTS OFF) SELECT k FROM kmers_hamming ORDER BY k <-> 'ACGTTGCA' LIMIT 5;
+    SELECT k, k <-> 'ACGTTGCA' FROM kmers_hamming ORDER BY k <-> 'ACGTTGCA' LIMIT 5;
+    DROP INDEX kmers_hamming_spgist;
+    CREATE INDEX kmers_hamming_radix ON kmers_hamming USING spgist (k kmer_spgist_radix_ops);
+    SELECT k FROM hamming_expected
+    EXCEPT ALL
+    SELECT k FROM kmers_hamming WHERE within(k, 'ACGTTGCA', 2);
+    SELECT k, k <-> 'ACGTTGCA' FROM kmers_hamming ORDER BY k <-> 'ACGTTGCA' LIMIT 5;
+    RESET enable_bitmapscan;
+    RESET enable_seqscan;
+    DROP TABLE hamming_expected;
+    DROP TABLE kmers_hamming;
+
+-- ########################################################################
+
+
+
+-- ############################## GIN on dna ##############################
+
+-- Substring searches: Return True, False, True, True, False
+    SELECT 'ACGTNNACGT'::dna @> 'ACGT'::kmer, 'ACGTNNACGT'::dna @> 'GTAA'::kmer,
+           'ACGTNNACGT'::dna @> ''::kmer, 'ACGTNNACGT'::dna ~ 'NGT'::qkmer,
+           'ACGTNNACGT'::dna ~ 'CGTA'::qkmer;
+
+-- Positions, skipping matches over N runs: Return 7, 0, 1, 2
+    SELECT strpos('ACGTNNACGTA'::dna, 'ACGTA'::kmer), strpos('ACGTNNACGT'::dna, 'TAAA'::kmer),
+           strpos('ACGT'::dna, ''::kmer), strpos('ACGTNNACGT'::dna, 'CNT'::qkmer);
+
+-- Long sequences are searched across slices of the stored value
+-- Return 300001, True
+    CREATE TABLE long_contig (d dna);
+    INSERT INTO long_contig VALUES ((repeat('A', 300000) || 'CGTACGTTGCAACGTACGTTGCAACGTACGTTG')::dna);
+    SELECT strpos(d, 'CGTACGTTGCAACGTACGTTGCAACGTACGTT'::kmer), d ~ 'YGTACGTTGCAACGTACGTTGCAACGTACGTT'::qkmer
+    FROM long_contig;
+    DROP TABLE long_contig;
+
+-- Index searches with k-mers shorter and longer than the pattern, with
+-- ambiguous patterns and sequences broken by N runs. The plans are bitmap
+-- scans on the GIN index and the rows match the sequential scan.
+-- Return 0 rows for each EXCEPT
+    CREATE TABLE contigs AS
+        SELECT g AS id,
+               (SELECT string_agg(CASE WHEN random() < 0.01 THEN 'N'
+                                       ELSE substr('ACGT', floor(random() * 4)::int + 1, 1) END, '')
+                FROM generate_series(1, 10 + g % 500))::dna AS d
+        FROM generate_series(1, 2000) AS g;
+    CREATE TEMP TABLE contigs_expected AS
+        SELECT 'c' AS q, id FROM contigs WHERE d @> 'ACGTACGTA'::kmer
+        UNION ALL SELECT 's', id FROM contigs WHERE d @> 'GATC'::kmer
+        UNION ALL SELECT 'm', id FROM contigs WHERE d ~ 'ACGNNTRCAGT'::qkmer
+        UNION ALL SELECT 'n', id FROM contigs WHERE d ~ 'NNNNNNNNNN'::qkmer;
+    CREATE INDEX contigs_gin ON contigs USING gin (d dna_gin_ops (k = 6));
+    SET enable_seqscan = off;
+    EXPLAIN (COSTS OFF) SELECT id FROM contigs WHERE d @> 'ACGTACGTA'::kmer;
+    EXPLAIN (COSTS OFF) SELECT id FROM contigs WHERE d ~ 'ACGNNTRCAGT'::qkmer;
+    SELECT * FROM contigs_expected
+    EXCEPT ALL
+    (SELECT 'c' AS q, id FROM contigs WHERE d @> 'ACGTACGTA'::kmer
+     UNION ALL SELECT 's', id FROM contigs WHERE d @> 'GATC'::kmer
+     UNION ALL SELECT 'm', id FROM contigs WHERE d ~ 'ACGNNTRCAGT'::qkmer
+     UNION ALL SELECT 'n', id FROM contigs WHERE d ~ 'NNNNNNNNNN'::qkmer);
+    RESET enable_seqscan;
+    DROP TABLE contigs_expected;
+    DROP TABLE contigs;
+
+-- Repetitive sequences index each distinct k-mer once, through the bitmap
+-- for short k-mers and the hash set for long ones
+-- Return 1, 1, 0, 0
+    CREATE TABLE repeats AS SELECT repeat('ACGTTGCA', 5000)::dna AS d;
+    CREATE INDEX repeats_gin_short ON repeats USING gin (d dna_gin_ops (k = 4));
+    CREATE INDEX repeats_gin_long ON repeats USING gin (d dna_gin_ops (k = 16));
+    SET enable_seqscan = off;
+    SELECT count(*) FROM repeats WHERE d @> 'GCAACGTTGCA'::kmer;
+    SELECT count(*) FROM repeats WHERE d @> 'TTGCAACGTTGCAACGTT'::kmer;
+    SELECT count(*) FROM repeats WHERE d @> 'GCAACGTTGCAT'::kmer;
+    SELECT count(*) FROM repeats WHERE d @> 'TTGCAACGTTGCAACGTA'::kmer;
+    RESET enable_seqscan;
+    DROP TABLE repeats;
+
+-- Invalid k-mer length for the index: Throw error
+    CREATE TABLE contigs (d dna);
+    CREATE INDEX ON contigs USING gin (d dna_gin_ops (k = 32));
+    DROP TABLE contigs;
+
+-- ########################################################################
+
+
+
+-- ############################ Binary COPY ###############################
+
+-- Wire formats: the packed values, with the integers in network byte order
+-- Return \x0000000600000001000000020000000210e0, \x0516c0, \x03f120
+    SELECT dna_send('ACNNTG'::dna), kmer_send('ACCGT'::kmer), qkmer_send('NAC'::qkmer);
+
+-- Round trip through COPY BINARY: Return 0 rows
+    CREATE TABLE binary_out (d dna, k kmer, q qkmer);
+    INSERT INTO binary_out VALUES
+        ('ACGTNNACGTN', 'ACGT', 'ANRY'),
+        ('', '', ''),
+        (repeat('ACGTN', 20000)::dna, 'AAAACCCCGGGGTTTTAAAACCCCGGGGTTTT', 'NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNA');
+    CREATE TABLE binary_in (LIKE binary_out);
+    \copy binary_out TO 'binary_copy.bin' WITH (FORMAT binary)
+    \copy binary_in FROM 'binary_copy.bin' WITH (FORMAT binary)
+    SELECT d::text, k::text, q::text FROM binary_out
+    EXCEPT ALL
+    SELECT d::text, k::text, q::text FROM binary_in;
+    DROP TABLE binary_in;
+    DROP TABLE binary_out;
+
+-- ########################################################################
+
+
+
+-- ############################# Text input ###############################
+
+-- Mixed case is accepted: Return ACGTNNACGT, ACGT, ANRY
+    SELECT 'acGTnNAcgt'::dna, 'aCgT'::kmer, 'aNrY'::qkmer;
+
+-- Errors point at the first invalid character: Throw errors at positions 5, 3, 2
+    SELECT 'ACGTXACGT'::dna;
+    SELECT 'ACNT'::kmer;
+    SELECT 'AXNN'::qkmer;
+
+-- ########################################################################
+
+
+
+-- ########################## FASTA and FASTQ ############################
+
+-- Files are written on the server; reading them needs pg_read_server_files
+    COPY (VALUES ('>seq1 first sequence'), ('ACGTN'), ('acgt'), (''), ('; comment'),
+                 ('>seq2'), ('TTTT'))
+        TO '/tmp/kmer_test.fa';
+    COPY (VALUES ('@read1 lane 1'), ('ACGT'), ('+'), ('II@+'),
+                 ('@read2'), ('NNAC'), ('GT'), ('+read2'), ('!!'), ('#"#"'))
+        TO '/tmp/kmer_test.fq';
+    COPY (VALUES ('>seq3'), ('ACGTACGT')) TO PROGRAM 'gzip > /tmp/kmer_test.fa.gz';
+
+-- Return (seq1, first sequence, ACGTNACGT) and (seq2, NULL, TTTT)
+    SELECT * FROM read_fasta('/tmp/kmer_test.fa');
+
+-- Return (read1, lane 1, ACGT, II@+) and (read2, NULL, NNACGT, !!#"#")
+    SELECT * FROM read_fastq('/tmp/kmer_test.fq');
+
+-- Compressed files are read transparently: Return (seq3, NULL, ACGTACGT)
+    SELECT * FROM read_fasta('/tmp/kmer_test.fa.gz');
+
+-- Loading and counting the k-mers of every record in one pass:
+-- Return (seq1, ACG, 2), (seq1, CGT, 2), (seq2, TTT, 2)
+    SELECT id, kmer, count(*)
+    FROM read_fasta('/tmp/kmer_test.fa'), generate_kmers(sequence, 3) AS kmer
+    GROUP BY id, kmer;
+
+-- Throw an error: a FASTQ quality shorter than its sequence
+    COPY (VALUES ('@read1'), ('ACGT'), ('+'), ('II')) TO '/tmp/kmer_test_bad.fq';
+    SELECT * FROM read_fastq('/tmp/kmer_test_bad.fq');
+
+-- ########################################################################
+
+
+
+-- ############################### BRIN #################################
+
+-- A k-mer table loaded in sorted order, with a minmax and a bloom index
+    CREATE TABLE kmer_brin AS
+        SELECT k FROM (SELECT DISTINCT kmer AS k
+                       FROM generate_kmers(repeat('ACGTTGCAAGGCTTACCGATNACGGT', 400)::dna, 6) AS kmer) s
+        ORDER BY k;
+    CREATE INDEX kmer_brin_minmax ON kmer_brin USING brin (k) WITH (pages_per_range = 1);
+    CREATE INDEX kmer_brin_bloom ON kmer_brin USING brin (k kmer_bloom_ops);
+    SET enable_seqscan = off;
+
+-- Return a Bitmap Index Scan on kmer_brin_minmax with k >= 'ACG' AND k < 'ACT'
+    EXPLAIN (COSTS OFF) SELECT * FROM kmer_brin WHERE k ^@ 'ACG';
+
+-- No matching k-mer is missed: Return no rows
+    SELECT DISTINCT kmer FROM generate_kmers('ACGTTGCAAGGCTTACCGATNACGGT'::dna, 6) AS kmer
+    WHERE kmer ^@ 'ACG'
+    EXCEPT ALL SELECT k FROM kmer_brin WHERE k ^@ 'ACG';
+
+-- Return TTACCG
+    SELECT k FROM kmer_brin WHERE k = 'TTACCG';
+
+-- The bloom index answers equality: Return a Bitmap Index Scan on kmer_brin_bloom
+    DROP INDEX kmer_brin_minmax;
+    EXPLAIN (COSTS OFF) SELECT * FROM kmer_brin WHERE k = 'TTACCG';
+
+    RESET enable_seqscan;
+    DROP TABLE kmer_brin;
+
+-- ########################################################################
+
+
+
+-- ############################ DNA sketches ##############################
+
+-- A sketch keeps the s least hashes of the canonical k-mers:
+-- Return k=4,s=3: followed by 3 hashes
+    SELECT sketch('ACGTACGTTTGCAAGTC', 4, 3);
+
+-- A sequence with fewer than s distinct k-mers keeps them all:
+-- Return 3 (ACGT, CGTA and GTAC)
+    SELECT array_length(string_to_array(split_part(sketch('ACGTACGT', 4, 100)::text, ':', 2), ','), 1);
+
+-- The text form reads back: Return true
+    SELECT sketch('ACGTACGTTTGCAAGTC', 4, 3)::text::dna_sketch::text
+         = sketch('ACGTACGTTTGCAAGTC', 4, 3)::text;
+
+-- A sequence and its reverse complement sketch the same: Return 1, 0
+    SELECT jaccard(sketch('ACGTTGCAAGGCTTACCGAT', 5, 50), sketch('ATCGGTAAGCCTTGCAACGT', 5, 50)),
+           sketch('ACGTTGCAAGGCTTACCGAT', 5, 50) <-> sketch('ATCGGTAAGCCTTGCAACGT', 5, 50);
+
+-- The first half of a sequence is contained in the whole, not the other
+-- way round: Return 1 and about 0.5
+    SELECT containment(sketch(substr(d, 1, 5000), 15, 200), sketch(d, 15, 200)),
+           containment(sketch(d, 15, 200), sketch(substr(d, 1, 5000), 15, 200))
+    FROM (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')::dna AS d
+          FROM generate_series(1, 10000)) s;
+
+-- Throw errors: sketches of different k, and an invalid sketch
+    SELECT jaccard(sketch('ACGTACGT', 4, 10), sketch('ACGTACGT', 5, 10));
+    SELECT 'k=4,s=2:0000000000000002,0000000000000001'::dna_sketch;
+
+-- All-against-all: random sequences and copies of them with a few bases
+-- changed, paired through the GIN index and ranked by distance
+    CREATE TABLE sketch_test AS
+        WITH r AS (SELECT g, string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '') AS d
+                   FROM generate_series(1, 200) AS g, generate_series(1, 2000)
+                   GROUP BY g)
+        SELECT g AS id, sketch(d::dna, 15, 100) AS s FROM r
+        UNION ALL
+        SELECT g + 1000, sketch(overlay(d placing 'TTTT' from 1000)::dna, 15, 100) FROM r;
+    CREATE INDEX sketch_test_gin ON sketch_test USING gin (s);
+    SET enable_seqscan = off;
+
+-- Return a Bitmap Index Scan on sketch_test_gin
+    EXPLAIN (COSTS OFF) SELECT id FROM sketch_test WHERE s && (SELECT s FROM sketch_test WHERE id = 1);
+
+-- The nearest other sketch of each sequence is its copy: Return 200
+    SELECT count(*) FROM sketch_test a
+    CROSS JOIN LATERAL (SELECT b.id FROM sketch_test b WHERE b.s && a.s AND b.id <> a.id
+                        ORDER BY a.s <-> b.s, b.id LIMIT 1) nearest
+    WHERE a.id <= 200 AND nearest.id = a.id + 1000;
+
+-- Sketches of another k overlap none, through the index as without it
+-- Return 0, 0
+    SELECT count(*) FROM sketch_test WHERE s && sketch(repeat('ACGTTGCAAGGCTTACCGAT', 50)::dna, 16, 100);
+    RESET enable_seqscan;
+    SELECT count(*) FROM sketch_test WHERE s && sketch(repeat('ACGTTGCAAGGCTTACCGAT', 50)::dna, 16, 100);
+
+    DROP TABLE sketch_test;
+
+-- ########################################################################
+
+
+
+-- ######################## Distinct k-mer counts ##########################
+
+-- Return 4 (ACG, CGT, GTA and TAC), and 0 without rows
+    SELECT approx_distinct_kmers('ACGTACGTACG'::dna, 3);
+    SELECT approx_distinct_kmers(d, 3) FROM (SELECT 'ACGT'::dna AS d) s WHERE false;
+
+-- Throw an error: rows with different k
+    SELECT approx_distinct_kmers(d, k)
+    FROM (VALUES ('ACGTACGT'::dna, 3), ('ACGTACGT'::dna, 4)) v(d, k);
+
+-- Estimate and exact count of the distinct 21-mers of random sequences:
+-- Return two numbers within about 2% of each other
+    CREATE TABLE hll_test AS
+        SELECT g % 4 AS sample, string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')::dna AS d
+        FROM generate_series(1, 100) AS g, generate_series(1, 2000)
+        GROUP BY g;
+    SELECT approx_distinct_kmers(d, 21),
+           (SELECT count(DISTINCT k) FROM hll_test, generate_kmers(d, 21) AS k)
+    FROM hll_test;
+
+-- Sketches stored per sample merge into the sketch of all of them: Return true
+    CREATE TABLE hll_samples AS
+        SELECT sample, kmer_hll_agg(d, 21) AS hll FROM hll_test GROUP BY sample;
+    SELECT cardinality(kmer_hll_union_agg(hll)) = (SELECT approx_distinct_kmers(d, 21) FROM hll_test)
+    FROM hll_samples;
+    SELECT cardinality(kmer_hll_union(a.hll, b.hll)) > cardinality(a.hll)
+    FROM hll_samples a, hll_samples b WHERE a.sample = 0 AND b.sample = 1;
+
+-- The text form reads back: Return true
+    SELECT hll::text::kmer_hll::text = hll::text FROM hll_samples WHERE sample = 0;
+
+    DROP TABLE hll_samples;
+    DROP TABLE hll_test;
+
+-- ########################################################################
+
+
+
+-- ########################### Bloom filters ##############################
+
+-- A reference set of 21-mers and a filter of it at 1%
+    CREATE TABLE bloom_reference AS
+        SELECT DISTINCT kmer AS k
+        FROM (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')::dna AS d
+              FROM generate_series(1, 100000)) s, generate_kmers(d, 21) AS kmer;
+    CREATE TABLE bloom_filters AS
+        SELECT 'reference' AS name, kmer_bloom_agg(k, (SELECT count(*) FROM bloom_reference)) AS f
+        FROM bloom_reference;
+
+-- Every k-mer of the set is found: Return 0
+    SELECT count(*) FROM bloom_reference, bloom_filters WHERE NOT k <@ f;
+
+-- Other k-mers are found with about the false positive rate: Return about 0.01
+    SELECT avg((k <@ f)::int)
+    FROM (SELECT (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')
+                  FROM generate_series(1, 21 + g % 2))::kmer AS k
+          FROM generate_series(1, 100000) AS g) q, bloom_filters
+    WHERE NOT EXISTS (SELECT FROM bloom_reference r WHERE r.k = q.k);
+
+-- Screening reads against the stored filter
+    EXPLAIN ANALYZE
+    SELECT count(*) FROM bloom_reference
+    WHERE k <@ (SELECT f FROM bloom_filters WHERE name = 'reference');
+
+-- Filters of the same size merge; a merged filter finds the k-mers of both:
+-- Return 0
+    SELECT count(*)
+    FROM (VALUES ('ACGTA'::kmer), ('TTTTT')) v(k),
+         (SELECT kmer_bloom_union(kmer_bloom_agg('ACGTA'::kmer, 10), kmer_bloom_agg('TTTTT'::kmer, 10)) AS f) b
+    WHERE NOT k <@ f;
+
+-- Parallel aggregate: workers OR their filters into the serial filter
+-- Return true
+    SET parallel_setup_cost = 0;
+    SET parallel_tuple_cost = 0;
+    SET min_parallel_table_scan_size = 0;
+    CREATE TEMP TABLE bloom_parallel AS
+        SELECT kmer_bloom_agg(k, 100000)::text AS f FROM bloom_reference;
+    SET max_parallel_workers_per_gather = 0;
+    SELECT f = (SELECT kmer_bloom_agg(k, 100000)::text FROM bloom_reference) FROM bloom_parallel;
+    RESET max_parallel_workers_per_gather;
+    RESET parallel_setup_cost;
+    RESET parallel_tuple_cost;
+    RESET min_parallel_table_scan_size;
+    DROP TABLE bloom_parallel;
+
+-- Throw errors: filters of different sizes, and an invalid rate
+    SELECT kmer_bloom_union(kmer_bloom_agg('ACGTA'::kmer, 10), kmer_bloom_agg('ACGTA'::kmer, 100000));
+    SELECT kmer_bloom_agg('ACGTA'::kmer, 10, 1.5);
+
+    DROP TABLE bloom_filters;
+    DROP TABLE bloom_reference;
+
+-- ########################################################################
+
+
+
+-- ########################### Seed-and-extend search #####################
+
+-- Random contigs, and a read taken from the 37th one with a mismatch, a
+-- deletion and an insertion
+    CREATE TABLE search_contigs AS
+        SELECT g AS id,
+               (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')
+                FROM generate_series(1, 2000 + g % 2))::dna AS d
+        FROM generate_series(1, 200) AS g;
+    CREATE INDEX search_contigs_gin ON search_contigs USING gin (d dna_gin_ops (k = 12));
+    ANALYZE search_contigs;
+    CREATE TABLE search_read AS
+        SELECT (substr(s, 501, 50) || 'A' || substr(s, 552, 49) || substr(s, 604, 50)
+                || 'TT' || substr(s, 654, 100))::dna AS q
+        FROM (SELECT d::text AS s FROM search_contigs WHERE id = 37) c;
+
+-- The read aligns at the start of the 37th contig it was taken from:
+-- Return 37, 501
+    SELECT c.id, s.position
+    FROM search_read, dna_search('search_contigs', 'd', q, 12, 2) s
+         JOIN search_contigs c ON c.ctid = s.ctid
+    ORDER BY s.score DESC LIMIT 1;
+
+-- Seeding goes through the GIN index: Return a Bitmap Index Scan
+    EXPLAIN (COSTS OFF)
+    SELECT t.ctid, m.score FROM search_contigs t, search_read r,
+           LATERAL seed_and_extend(t.d, r.q, 12, 2) m
+    WHERE t.d @> ANY (ARRAY(SELECT DISTINCT generate_kmers(r.q, 12)));
+
+-- A single sequence: Return 12, 3 (six matching bases)
+    SELECT * FROM seed_and_extend('GGACGTACTT', 'ACGTAC', 3, 1);
+
+-- Unrelated sequences: Return no row
+    SELECT * FROM seed_and_extend('AAAAAAAAAA', 'CCCCCC', 3, 1);
+
+-- Throw errors: invalid k-mer length and min_hits
+    SELECT * FROM seed_and_extend('ACGTACGT', 'ACGT', 33, 1);
+    SELECT * FROM seed_and_extend('ACGTACGT', 'ACGT', 3, 0);
+
+    DROP TABLE search_read;
+    DROP TABLE search_contigs;
+
+-- ########################################################################
+
+
+
+-- ########################### Multi-pattern scan #########################
+
+-- Occurrences of each pattern, overlapping ones included:
+-- Return (1, 1), (4, 2), (2, 3), (1, 5), (3, 7)
+    SELECT * FROM find_kmers('ACGTACGTTTN', ARRAY['ACG', 'GTA', 'GTT', 'CGTAC']::kmer[])
+    ORDER BY position;
+
+-- Patterns never match across an N, and null elements are skipped: Return 0
+    SELECT count(*) FROM find_kmers('ACGNACG', ARRAY['CGA', 'GA', NULL]::kmer[]);
+
+-- The subscripts follow the lower bound of the array: Return 5
+    SELECT pattern_idx FROM find_kmers('TTGACA', '[5:5]={TTGACA}'::kmer[]);
+
+-- IUPAC patterns: Return (1, 1), (1, 5), (2, 2), (2, 6)
+    SELECT * FROM find_kmers('ACGTACGT', ARRAY['RCG', 'CNT']::qkmer[])
+    ORDER BY pattern_idx, position;
+
+-- Agrees with strpos on random sequences: Return 0
+    WITH seqs AS (
+        SELECT (SELECT string_agg(substr('ACGT', floor(random() * 4)::int + 1, 1), '')
+                FROM generate_series(1, 500 + g % 2))::dna AS d
+        FROM generate_series(1, 50) AS g),
+    patterns AS (
+        SELECT ARRAY(SELECT substr(d::text, 100 + 7 * g, 8)::kmer
+                     FROM (SELECT d FROM seqs LIMIT 1) s, generate_series(1, 40) AS g) AS p)
+    SELECT count(*)
+    FROM seqs, patterns, generate_subscripts(p, 1) AS i
+    WHERE (strpos(d, p[i]) > 0) <>
+          EXISTS (SELECT FROM find_kmers(d, p) f WHERE f.pattern_idx = i);
+
+-- Throw error: too many k-mers matched by a pattern
+    SELECT * FROM find_kmers('ACGT', ARRAY['NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN']::qkmer[]);
+
+-- ########################################################################
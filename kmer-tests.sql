@@ -27,16 +27,28 @@
 
 -------------------------------------------------------------------------------------
 
-    -- TEST 1.2 Defining invalid values
+    -- TEST 1.2 Defining values with unknown bases
 
-        SELECT 'ACGTN'::dna; -- Contains invalid character 'N'
+        SELECT 'ACGTN'::dna, 'NNACGTNNNT'::dna; -- N is stored as a run of unknown bases
+    
+    -- Result:
+        --   dna  |    dna     
+        -- -------+------------
+        --  acgtn | nnacgtnnnt
+        -- (1 row)
+
+-------------------------------------------------------------------------------------
+
+    -- TEST 1.3 Defining invalid values
+
+        SELECT 'ACGTX'::dna; -- Contains invalid character 'X'
     
     -- Result:
 
         -- ERROR:  Invalid DNA Sequence
-        -- LINE 1: SELECT 'ACGTN'::dna;
+        -- LINE 1: SELECT 'ACGTX'::dna;
         --                ^
-        -- DETAIL:  Valid characters are A, C, G, T (case-insensitive).
+        -- DETAIL:  Invalid character at position 5. Valid characters are A, C, G, T and N (case-insensitive).
 
 -------------------------------------------------------------------------------------
 -------------------------------------------------------------------------------------
@@ -86,7 +98,7 @@
         -- ERROR:  Invalid DNA Sequence
         -- LINE 1: SELECT 'AGTCN'::kmer;
         --                ^
-        -- DETAIL:  Valid characters are A, C, G, T (case-insensitive).
+        -- DETAIL:  Invalid character at position 5. Valid characters are A, C, G, T (case-insensitive).
 
 -------------------------------------------------------------------------------------
 -------------------------------------------------------------------------------------
@@ -135,7 +147,8 @@
     -- Result
         -- ERROR:  Invalid QKMer Sequence
         -- LINE 1: SELECT 'ACGT123'::qkmer;
-        --         ^
+        --                ^
+        -- DETAIL:  Invalid character at position 5. Valid characters are the IUPAC nucleotide codes (case-insensitive).
 
 
 -- ######################################################################
@@ -5,77 +5,422 @@
 #include "kmer.h"
 #include "fmgr.h"
 #include "funcapi.h"
-#include <ctype.h>
 #include "access/spgist.h"
+#include "access/detoast.h"
 #include "access/hash.h"
 #include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "libpq/pqformat.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/elog.h"
+#include "utils/lsyscache.h"
+#include "utils/tuplestore.h"
 
 PG_MODULE_MAGIC;
 
 /*****************************************************************************/
 
-// Helper Function to Validate the DNA Sequence for A,C,G and T characters
-static inline void validate_sequence(char *input)
+// Input characters, in either case, are looked up in a table. Accepted
+// characters have INPUT_VALID set; in a sequence the low bits hold the 2-bit
+// code of the nucleotide (A for N, which has SEQUENCE_N set), in a pattern
+// the IUPAC mask nibble.
+#define INPUT_VALID 0x10
+#define SEQUENCE_N 0x08
+
+static const uint8 sequence_chars[256] = {
+	['a'] = INPUT_VALID | 0, ['c'] = INPUT_VALID | 1, ['g'] = INPUT_VALID | 2,
+	['t'] = INPUT_VALID | 3, ['n'] = INPUT_VALID | SEQUENCE_N,
+	['A'] = INPUT_VALID | 0, ['C'] = INPUT_VALID | 1, ['G'] = INPUT_VALID | 2,
+	['T'] = INPUT_VALID | 3, ['N'] = INPUT_VALID | SEQUENCE_N};
+
+static const uint8 pattern_chars[256] = {
+	['u'] = INPUT_VALID | 0x0, ['a'] = INPUT_VALID | 0x1, ['c'] = INPUT_VALID | 0x2,
+	['m'] = INPUT_VALID | 0x3, ['g'] = INPUT_VALID | 0x4, ['r'] = INPUT_VALID | 0x5,
+	['s'] = INPUT_VALID | 0x6, ['v'] = INPUT_VALID | 0x7, ['t'] = INPUT_VALID | 0x8,
+	['w'] = INPUT_VALID | 0x9, ['y'] = INPUT_VALID | 0xA, ['h'] = INPUT_VALID | 0xB,
+	['k'] = INPUT_VALID | 0xC, ['d'] = INPUT_VALID | 0xD, ['b'] = INPUT_VALID | 0xE,
+	['n'] = INPUT_VALID | 0xF,
+	['U'] = INPUT_VALID | 0x0, ['A'] = INPUT_VALID | 0x1, ['C'] = INPUT_VALID | 0x2,
+	['M'] = INPUT_VALID | 0x3, ['G'] = INPUT_VALID | 0x4, ['R'] = INPUT_VALID | 0x5,
+	['S'] = INPUT_VALID | 0x6, ['V'] = INPUT_VALID | 0x7, ['T'] = INPUT_VALID | 0x8,
+	['W'] = INPUT_VALID | 0x9, ['Y'] = INPUT_VALID | 0xA, ['H'] = INPUT_VALID | 0xB,
+	['K'] = INPUT_VALID | 0xC, ['D'] = INPUT_VALID | 0xD, ['B'] = INPUT_VALID | 0xE,
+	['N'] = INPUT_VALID | 0xF};
+
+// Helper Function to validate a text input, shared by the input functions.
+// A character is invalid when its table value lacks INPUT_VALID or has a
+// reject bit set. The values are combined eight characters at a time with
+// no branch, and only a failing input is scanned again, to report the
+// position of its first invalid character. Returns the length; seen gets
+// the union of the values.
+static int scan_input(const char *input, const uint8 *table, uint8 reject, uint8 *seen,
+					  const char *message, const char *valid)
 {
+	const uint8 *chars = (const uint8 *)input;
+	int len = strlen(input);
+	uint8 all = INPUT_VALID;
+	uint8 any = 0;
+	int i, j;
 
-	char *ptr = input;
-	char c;
-
-	for (ptr = input; *ptr; ptr++)
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		for (j = 0; j < 8; j++)
+		{
+			all &= table[chars[i + j]];
+			any |= table[chars[i + j]];
+		}
+	}
+	for (; i < len; i++)
 	{
-		c = tolower(*ptr);
-		*ptr = c;
+		all &= table[chars[i]];
+		any |= table[chars[i]];
+	}
 
-		if ((c != 'a') && (c != 'c') && (c != 'g') && (c != 't'))
+	if (!(all & INPUT_VALID) || (any & reject))
+	{
+		for (i = 0; i < len; i++)
 		{
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-					 errmsg("Invalid DNA Sequence"),
-					 errdetail("Valid characters are A, C, G, T (case-insensitive).")));
+			if (!(table[chars[i]] & INPUT_VALID) || (table[chars[i]] & reject))
+				break;
 		}
+
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("%s", message),
+				 errdetail("Invalid character at position %d. Valid characters are %s.",
+						   i + 1, valid)));
 	}
 
-	return;
+	if (seen)
+		*seen = any;
+	return len;
 }
 
 // Helper function to check if a KMER starts with a given prefix
 static inline bool kmer_starts_with_helper(KMER *prefix, KMER *kmer) {
-    int len1 = VARSIZE_ANY_EXHDR(prefix);
-    int len2 = VARSIZE_ANY_EXHDR(kmer);
+    int len1 = kmer_get_length(prefix);
+    int len2 = kmer_get_length(kmer);
 
     // If length of prefix is greater than kmer, return false
     if (len1 > len2) {
         return false;
     }
 
-    // Compare the kmer with the given prefix
-    return memcmp(VARDATA_ANY(prefix), VARDATA_ANY(kmer), len1) == 0;
+    // Compare the leading bases of kmer with the given prefix
+    return ((kmer_get_bits(prefix) ^ kmer_get_bits(kmer)) & kmer_prefix_mask(len1)) == 0;
 }
 
 
 // Helper function to compare KMER and QKMER
 static inline bool kmer_query(KMER *kmer, QKMER *qkmer) {
-    int len1 = VARSIZE_ANY_EXHDR(qkmer);
-    int len2 = VARSIZE_ANY_EXHDR(kmer);
+    int len1 = qkmer_get_length(qkmer);
+    int len2 = kmer_get_length(kmer);
+    uint64 mask[2];
 
     // If lengths are not equal, return false
     if (len1 != len2) {
         return false;
     }
 
-    char *qkmer_str = VARDATA_ANY(qkmer);
-    char *kmer_str = VARDATA_ANY(kmer);
+    // Compare all bases at once against the pattern masks
+    qkmer_get_mask(qkmer, mask);
+    return qkmer_match_prefix(mask, kmer_get_bits(kmer), len1);
+}
 
-    // Compare each character
-    for (int i = 0; i < len1; i++) {
-        if (!match(qkmer_str[i], kmer_str[i])) {
-            return false;
-        }
-    }
+/*****************************************************************************/
+
+/* Packed DNA helpers */
+
+// Counts the runs of N in a validated sequence in either case
+static int dna_count_runs(const char *seq, int len)
+{
+	const uint8 *chars = (const uint8 *)seq;
+	bool previous = false;
+	int nruns = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		bool isN = (sequence_chars[chars[i]] & SEQUENCE_N) != 0;
+
+		nruns += isN && !previous;
+		previous = isN;
+	}
+
+	return nruns;
+}
+
+// Creates a packed DNA value with nruns runs of N from a validated sequence
+// in either case. The bases are packed four to a byte, N as A, and the
+// sequence is only scanned for runs when it has some.
+static DNA *dna_pack(const char *seq, int len, int nruns)
+{
+	const uint8 *chars = (const uint8 *)seq;
+	DnaHeader header;
+	DnaRun *runs;
+	uint8 *bases;
+	Size size;
+	DNA *dna;
+	int i;
+
+	size = VARHDRSZ + DNA_BASES_OFFSET(nruns) + KMER_PACKED_BYTES(len);
+	dna = (DNA *)palloc0(size);
+	SET_VARSIZE(dna, size);
+
+	header.length = len;
+	header.nruns = nruns;
+	memcpy(VARDATA(dna), &header, sizeof(DnaHeader));
+	runs = (DnaRun *)(VARDATA(dna) + sizeof(DnaHeader));
+	bases = (uint8 *)VARDATA(dna) + DNA_BASES_OFFSET(nruns);
+
+	for (i = 0; i + 4 <= len; i += 4)
+		bases[i >> 2] = (uint8)(((sequence_chars[chars[i]] & 3) << 6) |
+								((sequence_chars[chars[i + 1]] & 3) << 4) |
+								((sequence_chars[chars[i + 2]] & 3) << 2) |
+								(sequence_chars[chars[i + 3]] & 3));
+	for (; i < len; i++)
+		bases[i >> 2] |= (uint8)((sequence_chars[chars[i]] & 3) << (6 - 2 * (i & 3)));
+
+	nruns = 0;
+	for (i = 0; i < len && header.nruns > 0; i++)
+	{
+		if (sequence_chars[chars[i]] & SEQUENCE_N)
+		{
+			if (i == 0 || !(sequence_chars[chars[i - 1]] & SEQUENCE_N))
+			{
+				runs[nruns].start = i;
+				runs[nruns].length = 0;
+				nruns++;
+			}
+			runs[nruns - 1].length++;
+		}
+	}
+
+	return dna;
+}
+
+// Creates a packed DNA value from a validated sequence in either case
+DNA *dna_from_chars(const char *seq, int len)
+{
+	return dna_pack(seq, len, dna_count_runs(seq, len));
+}
+
+// Creates a packed DNA value from a NUL-terminated text sequence, reporting
+// the position of the first invalid character
+DNA *dna_from_text(const char *input)
+{
+	uint8 seen;
+	int len = scan_input(input, sequence_chars, 0, &seen, "Invalid DNA Sequence",
+						 "A, C, G, T and N (case-insensitive)");
+
+	return dna_pack(input, len, (seen & SEQUENCE_N) ? dna_count_runs(input, len) : 0);
+}
+
+// Reads the header of a DNA value without detoasting the rest of it
+static inline void dna_get_header(Datum datum, DnaHeader *header)
+{
+	struct varlena *head = PG_DETOAST_DATUM_SLICE(datum, 0, sizeof(DnaHeader));
+
+	memcpy(header, VARDATA_ANY(head), sizeof(DnaHeader));
+}
+
+// Checks whether a value is stored out of line without compression, so
+// that a slice of it only reads the TOAST chunks covering the slice
+static inline bool dna_is_sliceable(struct varlena *raw)
+{
+	struct varatt_external toast_pointer;
+
+	if (!VARATT_IS_EXTERNAL_ONDISK(raw))
+		return false;
+
+	VARATT_EXTERNAL_GET_POINTER(toast_pointer, raw);
+	return !VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer);
+}
+
+// Prepares to read a DNA value. Uncompressed out-of-line values are left in
+// TOAST and read a slice at a time; anything else is detoasted once.
+void dna_reader_init(DnaReader *reader, Datum datum)
+{
+	struct varlena *raw = (struct varlena *)DatumGetPointer(datum);
+	DnaHeader header;
+	Size runsSize;
+
+	reader->datum = datum;
+	reader->value = NULL;
+
+	if (dna_is_sliceable(raw))
+	{
+		dna_get_header(datum, &header);
+		runsSize = header.nruns * sizeof(DnaRun);
+		reader->runs = (DnaRun *)palloc(runsSize + 1);
+		if (runsSize)
+		{
+			struct varlena *runs = PG_DETOAST_DATUM_SLICE(datum, sizeof(DnaHeader), runsSize);
+
+			memcpy(reader->runs, VARDATA_ANY(runs), runsSize);
+			pfree(runs);
+		}
+	}
+	else
+	{
+		reader->value = PG_DETOAST_DATUM_PACKED(datum);
+		memcpy(&header, VARDATA_ANY(reader->value), sizeof(DnaHeader));
+		runsSize = header.nruns * sizeof(DnaRun);
+		reader->runs = (DnaRun *)palloc(runsSize + 1);
+		memcpy(reader->runs, VARDATA_ANY(reader->value) + sizeof(DnaHeader), runsSize);
+	}
+
+	reader->length = header.length;
+	reader->nruns = header.nruns;
+}
+
+// Decodes count bases starting at start into out (not NUL-terminated),
+// with 'n' for bases under an N run
+void dna_reader_read(DnaReader *reader, int start, int count, char *out)
+{
+	struct varlena *slice = NULL;
+	const uint8 *bytes;
+	int first = start >> 2;
+	int low, high;
+	int i;
+
+	Assert(start >= 0 && count >= 0 && start + count <= reader->length);
+
+	if (count == 0)
+		return;
+
+	if (reader->value)
+		bytes = (const uint8 *)VARDATA_ANY(reader->value) + DNA_BASES_OFFSET(reader->nruns) + first;
+	else
+	{
+		int nbytes = ((start + count - 1) >> 2) - first + 1;
+
+		slice = PG_DETOAST_DATUM_SLICE(reader->datum, DNA_BASES_OFFSET(reader->nruns) + first, nbytes);
+		bytes = (const uint8 *)VARDATA_ANY(slice);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		int pos = start + i - (first << 2);
+
+		out[i] = kmer_nucleotides[(bytes[pos >> 2] >> (6 - 2 * (pos & 3))) & 3];
+	}
+
+	/* Binary search for the first run ending after start, then overlay N */
+	low = 0;
+	high = reader->nruns;
+	while (low < high)
+	{
+		int middle = (low + high) >> 1;
+
+		if (reader->runs[middle].start + reader->runs[middle].length <= (uint32)start)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	for (i = low; i < reader->nruns && reader->runs[i].start < (uint32)(start + count); i++)
+	{
+		int runStart = Max((int)reader->runs[i].start, start);
+		int runEnd = Min((int)(reader->runs[i].start + reader->runs[i].length), start + count);
+
+		memset(out + runStart - start, 'n', runEnd - runStart);
+	}
+
+	if (slice)
+		pfree(slice);
+}
+
+// Bytes of packed bases fetched per slice by a k-mer iterator
+#define DNA_SLICE_BYTES 65536
+
+// Prepares to iterate over the k-mers of length k of a DNA value
+void dna_kmers_init(DnaKmerIterator *iter, Datum datum, int k)
+{
+	dna_reader_init(&iter->reader, datum);
+
+	iter->k = k;
+	iter->position = 0;
+	iter->valid = 0;
+	iter->run = 0;
+	iter->canonical = false;
+	iter->window = 0;
+	iter->rcwindow = 0;
+	iter->slice = NULL;
+
+	if (iter->reader.value)
+	{
+		iter->bytes = (const uint8 *)VARDATA_ANY(iter->reader.value) + DNA_BASES_OFFSET(iter->reader.nruns);
+		iter->chunkStart = 0;
+		iter->chunkEnd = iter->reader.length;
+	}
+	else
+	{
+		iter->bytes = NULL;
+		iter->chunkStart = 0;
+		iter->chunkEnd = 0;
+	}
+}
+
+// Fetches the slice of packed bases starting with the given base
+static void dna_kmers_load(DnaKmerIterator *iter, int position)
+{
+	int first = position >> 2;
+	int nbytes = Min(DNA_SLICE_BYTES, (int)KMER_PACKED_BYTES(iter->reader.length) - first);
+
+	if (iter->slice)
+		pfree(iter->slice);
 
-    return true;
+	iter->slice = PG_DETOAST_DATUM_SLICE(iter->reader.datum, DNA_BASES_OFFSET(iter->reader.nruns) + first, nbytes);
+	iter->bytes = (const uint8 *)VARDATA_ANY(iter->slice);
+	iter->chunkStart = first << 2;
+	iter->chunkEnd = Min(iter->reader.length, (first + nbytes) << 2);
+}
+
+// Returns the next k-mer (left aligned bases) and its start position, or
+// false once the sequence is exhausted
+bool dna_kmers_next(DnaKmerIterator *iter, uint64 *bits, int *start)
+{
+	DnaReader *reader = &iter->reader;
+
+	while (iter->position < reader->length)
+	{
+		int pos = iter->position++;
+		int offset;
+		uint64 code;
+
+		/* Jump over an N run and restart the window after it */
+		if (iter->run < reader->nruns && pos >= (int)reader->runs[iter->run].start)
+		{
+			iter->position = reader->runs[iter->run].start + reader->runs[iter->run].length;
+			iter->run++;
+			iter->valid = 0;
+			continue;
+		}
+
+		if (pos >= iter->chunkEnd)
+			dna_kmers_load(iter, pos);
+
+		offset = pos - iter->chunkStart;
+		code = (iter->bytes[offset >> 2] >> (6 - 2 * (offset & 3))) & 3;
+		iter->window = (iter->window << 2) | code;
+
+		/* The complement of the newest base is the first base of the reverse complement */
+		if (iter->canonical)
+			iter->rcwindow = (iter->rcwindow >> 2) | ((code ^ 3) << (2 * iter->k - 2));
+
+		if (++iter->valid >= iter->k)
+		{
+			*bits = iter->window << (64 - 2 * iter->k);
+			if (iter->canonical)
+				*bits = Min(*bits, iter->rcwindow << (64 - 2 * iter->k));
+			*start = pos - iter->k + 1;
+			return true;
+		}
+	}
+
+	return false;
 }
 
 /*****************************************************************************/
@@ -84,33 +429,148 @@ static inline bool kmer_query(KMER *kmer, QKMER *qkmer) {
 PG_FUNCTION_INFO_V1(dna_in);
 Datum dna_in(PG_FUNCTION_ARGS)
 {
-	char *input = PG_GETARG_CSTRING(0);
-	int len = strlen(input);
-
-	validate_sequence(input);
-
-	DNA *result = (DNA *)palloc(len + VARHDRSZ);
-    SET_VARSIZE(result, len + VARHDRSZ);
-    if (len) memcpy(VARDATA_ANY(result), input, len);
-
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(dna_from_text(PG_GETARG_CSTRING(0)));
 }
 
 PG_FUNCTION_INFO_V1(dna_out);
 Datum dna_out(PG_FUNCTION_ARGS)
 {
-	DNA *dna = (DNA *)PG_GETARG_VARLENA_P(0);
-	char *result = psprintf("%.*s", VARSIZE_ANY_EXHDR(dna), VARDATA_ANY(dna));
+	DnaReader reader;
+	char *result;
+
+	dna_reader_init(&reader, PG_GETARG_DATUM(0));
+	result = palloc(reader.length + 1);
+	dna_reader_read(&reader, 0, reader.length, result);
+	result[reader.length] = '\0';
 
 	PG_RETURN_CSTRING(result);
 }
 
+// Clears the packed bases from..to-1, as bases under N are stored as A
+static inline void dna_clear_bases(uint8 *bases, int64 from, int64 to)
+{
+	for (; from < to && (from & 3); from++)
+		bases[from >> 2] &= ~(3 << (6 - 2 * (from & 3)));
+	if (to - from >= 4)
+	{
+		memset(bases + (from >> 2), 0, (to - from) >> 2);
+		from += (to - from) & ~INT64CONST(3);
+	}
+	for (; from < to; from++)
+		bases[from >> 2] &= ~(3 << (6 - 2 * (from & 3)));
+}
+
+// Binary input: the header, the N runs and the packed bases, as stored but
+// with the integers in network byte order. Runs must be sorted, non-empty
+// and apart; bases under N runs and past the end are cleared.
+PG_FUNCTION_INFO_V1(dna_recv);
+Datum dna_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	DnaHeader header;
+	DnaRun *runs;
+	uint8 *bases;
+	Size nbytes, size;
+	DNA *dna;
+	int64 end = -1;
+	uint32 i;
+
+	header.length = pq_getmsgint(buf, 4);
+	header.nruns = pq_getmsgint(buf, 4);
+	nbytes = KMER_PACKED_BYTES((Size)header.length);
+
+	if (header.length > PG_INT32_MAX ||
+		(Size)(buf->len - buf->cursor) != header.nruns * sizeof(DnaRun) + nbytes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("Invalid binary DNA Sequence"),
+				 errdetail("The message does not hold %u bases and %u N runs.",
+						   header.length, header.nruns)));
+
+	size = VARHDRSZ + DNA_BASES_OFFSET(header.nruns) + nbytes;
+	dna = (DNA *)palloc(size);
+	SET_VARSIZE(dna, size);
+	memcpy(VARDATA(dna), &header, sizeof(DnaHeader));
+	runs = (DnaRun *)(VARDATA(dna) + sizeof(DnaHeader));
+	bases = (uint8 *)VARDATA(dna) + DNA_BASES_OFFSET(header.nruns);
+
+	for (i = 0; i < header.nruns; i++)
+	{
+		runs[i].start = pq_getmsgint(buf, 4);
+		runs[i].length = pq_getmsgint(buf, 4);
+
+		if ((int64)runs[i].start <= end || runs[i].length == 0 ||
+			(int64)runs[i].start + runs[i].length > header.length)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("Invalid binary DNA Sequence"),
+					 errdetail("N runs must be non-empty, sorted, apart and within the sequence.")));
+		end = (int64)runs[i].start + runs[i].length;
+	}
+
+	pq_copymsgbytes(buf, (char *)bases, nbytes);
+	pq_getmsgend(buf);
+
+	for (i = 0; i < header.nruns; i++)
+		dna_clear_bases(bases, runs[i].start, (int64)runs[i].start + runs[i].length);
+	dna_clear_bases(bases, header.length, (int64)nbytes << 2);
+
+	PG_RETURN_POINTER(dna);
+}
+
+PG_FUNCTION_INFO_V1(dna_send);
+Datum dna_send(PG_FUNCTION_ARGS)
+{
+	DNA *dna = (DNA *)PG_GETARG_VARLENA_PP(0);
+	const char *data = VARDATA_ANY(dna);
+	DnaHeader header;
+	DnaRun run;
+	StringInfoData buf;
+	uint32 i;
+
+	memcpy(&header, data, sizeof(DnaHeader));
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, header.length);
+	pq_sendint32(&buf, header.nruns);
+	for (i = 0; i < header.nruns; i++)
+	{
+		memcpy(&run, data + sizeof(DnaHeader) + i * sizeof(DnaRun), sizeof(DnaRun));
+		pq_sendint32(&buf, run.start);
+		pq_sendint32(&buf, run.length);
+	}
+	pq_sendbytes(&buf, data + DNA_BASES_OFFSET(header.nruns), KMER_PACKED_BYTES(header.length));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+// Rewrites a dna value stored by version 1.0.0 as plain ASCII into the packed
+// layout. A packed value never consists of letters only, so values that are
+// already packed are returned unchanged.
+PG_FUNCTION_INFO_V1(dna_upgrade_packed);
+Datum dna_upgrade_packed(PG_FUNCTION_ARGS)
+{
+	DNA *dna = (DNA *)PG_GETARG_VARLENA_PP(0);
+	char *data = VARDATA_ANY(dna);
+	int len = VARSIZE_ANY_EXHDR(dna);
+
+	for (int i = 0; i < len; i++)
+	{
+		if (data[i] != 'a' && data[i] != 'c' && data[i] != 'g' && data[i] != 't')
+			PG_RETURN_POINTER(dna);
+	}
+
+	PG_RETURN_POINTER(dna_from_chars(data, len));
+}
+
 /* KMER Input and Output Functions */
 PG_FUNCTION_INFO_V1(kmer_in);
 Datum kmer_in(PG_FUNCTION_ARGS)
 {
 	char *input = PG_GETARG_CSTRING(0);
-	int len = strlen(input);
+	int len = scan_input(input, sequence_chars, SEQUENCE_N, NULL, "Invalid DNA Sequence",
+						 "A, C, G, T (case-insensitive)");
+	uint64 bits = 0;
 
 	if (len > MAX_KMER_LENGTH)
 	{
@@ -119,32 +579,106 @@ Datum kmer_in(PG_FUNCTION_ARGS)
 				 errmsg("KMer Sequence larger than length 32")));
 	}
 
-	validate_sequence(input);
-
-	KMER *result = (KMER *)palloc(len + VARHDRSZ_SHORT);
-    SET_VARSIZE_SHORT(result, len + VARHDRSZ_SHORT);
-    if (len) memcpy(VARDATA_ANY(result), input, len);
+	for (int i = 0; i < len; i++)
+		bits |= (uint64)(sequence_chars[(uint8)input[i]] & 3) << (62 - 2 * i);
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(kmer_from_bits(bits, len));
 }
 
 PG_FUNCTION_INFO_V1(kmer_out);
 Datum kmer_out(PG_FUNCTION_ARGS)
 {
-	KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(0);
-	char *result = psprintf("%.*s", VARSIZE_ANY_EXHDR(kmer), VARDATA_ANY(kmer));
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	int len = kmer_get_length(kmer);
+	char *result = palloc(len + 1);
+
+	kmer_unpack_chars(kmer_get_bits(kmer), len, result);
+	result[len] = '\0';
 
 	PG_RETURN_CSTRING(result);
 }
 
+// Binary input: the length byte and the packed bases, as stored. Bits past
+// the last base are cleared.
+PG_FUNCTION_INFO_V1(kmer_recv);
+Datum kmer_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	int len = pq_getmsgbyte(buf);
+	const uint8 *data;
+	uint64 bits = 0;
+
+	if (len > MAX_KMER_LENGTH || buf->len - buf->cursor != KMER_PACKED_BYTES(len))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("Invalid binary KMer Sequence")));
+
+	data = (const uint8 *)pq_getmsgbytes(buf, KMER_PACKED_BYTES(len));
+	for (int i = 0; i < KMER_PACKED_BYTES(len); i++)
+		bits |= (uint64)data[i] << (56 - 8 * i);
+	pq_getmsgend(buf);
+
+	PG_RETURN_POINTER(kmer_from_bits(bits, len));
+}
+
+PG_FUNCTION_INFO_V1(kmer_send);
+Datum kmer_send(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendbytes(&buf, VARDATA_ANY(kmer), VARSIZE_ANY_EXHDR(kmer));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+// Rewrites a kmer stored by version 1.0.0 as plain ASCII into the packed
+// layout. Packed values start with a length byte, which is never a letter,
+// so values that are already packed are returned unchanged.
+PG_FUNCTION_INFO_V1(kmer_upgrade_packed);
+Datum kmer_upgrade_packed(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	char *data = VARDATA_ANY(kmer);
+	int len = VARSIZE_ANY_EXHDR(kmer);
+
+	if (len > 0 && (uint8) data[0] <= MAX_KMER_LENGTH)
+		PG_RETURN_POINTER(kmer);
+
+	if (len > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("Invalid stored KMer of length %d", len)));
+
+	PG_RETURN_POINTER(kmer_from_bits(kmer_pack_chars(data, len), len));
+}
+
 /* QKMER Input and Output Functions */
+
+// Create a packed QKMER from a validated, lowercase pattern
+static inline QKMER *qkmer_from_chars(const char *pattern, int len)
+{
+	QKMER *qkmer = (QKMER *)palloc0(QKMER_PACKED_SIZE(len));
+	uint8 *data;
+
+	SET_VARSIZE_SHORT(qkmer, QKMER_PACKED_SIZE(len));
+	data = (uint8 *)VARDATA_ANY(qkmer);
+	data[0] = (uint8)len;
+	for (int i = 0; i < len; i++)
+		data[1 + (i >> 1)] |= iupac_mask(pattern[i]) << ((i & 1) ? 0 : 4);
+
+	return qkmer;
+}
+
 PG_FUNCTION_INFO_V1(qkmer_in);
 Datum qkmer_in(PG_FUNCTION_ARGS)
 {
 	char *input = PG_GETARG_CSTRING(0);
-	int len = strlen(input);
-	char *ptr = input;
-	char c;
+	int len = scan_input(input, pattern_chars, 0, NULL, "Invalid QKMer Sequence",
+						 "the IUPAC nucleotide codes (case-insensitive)");
+	QKMER *qkmer;
+	uint8 *data;
 
 	if (len > MAX_KMER_LENGTH)
 	{
@@ -153,71 +687,508 @@ Datum qkmer_in(PG_FUNCTION_ARGS)
 				 errmsg("QKMer Sequence larger than length 32")));
 	}
 
-	for (ptr = input; *ptr; ptr++)
-	{
-		c = tolower(*ptr);
-		*ptr = c;
-
-		if (c != 'a' && // Adenine
-			c != 'c' && // Cytosine
-			c != 'g' && // Guanine
-			c != 't' && // Thymine
-			c != 'u' && // Uracil
-			c != 'r' && // A or G
-			c != 'y' && // C or T
-			c != 'k' && // G or T
-			c != 'm' && // A or C
-			c != 's' && // G or C
-			c != 'w' && // A or T
-			c != 'b' && // C, G, or T (not A)
-			c != 'd' && // A, G, or T (not C)
-			c != 'h' && // A, C, or T (not G)
-			c != 'v' && // A, C, or G (not T)
-			c != 'n'	// A, T, C, or G (any nucleotide)
-		)
-		{
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
-					 errmsg("Invalid QKMer Sequence")));
-		}
-	}
-
-    QKMER *result = (QKMER *)palloc(len + VARHDRSZ_SHORT);
-    SET_VARSIZE_SHORT(result, len + VARHDRSZ_SHORT);
-    if (len) memcpy(VARDATA_ANY(result), input, len);
+	qkmer = (QKMER *)palloc0(QKMER_PACKED_SIZE(len));
+	SET_VARSIZE_SHORT(qkmer, QKMER_PACKED_SIZE(len));
+	data = (uint8 *)VARDATA_ANY(qkmer);
+	data[0] = (uint8)len;
+	for (int i = 0; i < len; i++)
+		data[1 + (i >> 1)] |= (pattern_chars[(uint8)input[i]] & 0xF) << ((i & 1) ? 0 : 4);
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_POINTER(qkmer);
 }
 
 PG_FUNCTION_INFO_V1(qkmer_out);
 Datum qkmer_out(PG_FUNCTION_ARGS)
 {
-	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_P(0);
-	char *result = psprintf("%.*s", VARSIZE_ANY_EXHDR(qkmer), VARDATA_ANY(qkmer));
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+	const uint8 *data = (const uint8 *)VARDATA_ANY(qkmer) + 1;
+	int len = qkmer_get_length(qkmer);
+	char *result = palloc(len + 1);
+
+	for (int i = 0; i < len; i++)
+		result[i] = qkmer_symbols[(data[i >> 1] >> ((i & 1) ? 0 : 4)) & 0xF];
+	result[len] = '\0';
 
 	PG_RETURN_CSTRING(result);
 }
 
+// Binary input: the length byte and the mask nibbles, as stored. Every
+// nibble is a valid mask; the one past an odd length is cleared.
+PG_FUNCTION_INFO_V1(qkmer_recv);
+Datum qkmer_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	int len = pq_getmsgbyte(buf);
+	QKMER *qkmer;
+	uint8 *data;
+
+	if (len > MAX_KMER_LENGTH || buf->len - buf->cursor != QKMER_PACKED_BYTES(len))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("Invalid binary QKMer Sequence")));
+
+	qkmer = (QKMER *)palloc(QKMER_PACKED_SIZE(len));
+	SET_VARSIZE_SHORT(qkmer, QKMER_PACKED_SIZE(len));
+	data = (uint8 *)VARDATA_ANY(qkmer);
+	data[0] = (uint8)len;
+	pq_copymsgbytes(buf, (char *)data + 1, QKMER_PACKED_BYTES(len));
+	pq_getmsgend(buf);
+
+	if (len & 1)
+		data[QKMER_PACKED_BYTES(len)] &= 0xF0;
+
+	PG_RETURN_POINTER(qkmer);
+}
+
+PG_FUNCTION_INFO_V1(qkmer_send);
+Datum qkmer_send(PG_FUNCTION_ARGS)
+{
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendbytes(&buf, VARDATA_ANY(qkmer), VARSIZE_ANY_EXHDR(qkmer));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+// Rewrites a qkmer stored by version 1.0.0 as plain ASCII into the packed
+// layout, leaving values that are already packed unchanged.
+PG_FUNCTION_INFO_V1(qkmer_upgrade_packed);
+Datum qkmer_upgrade_packed(PG_FUNCTION_ARGS)
+{
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+	char *data = VARDATA_ANY(qkmer);
+	int len = VARSIZE_ANY_EXHDR(qkmer);
+
+	if (len > 0 && (uint8) data[0] <= MAX_KMER_LENGTH)
+		PG_RETURN_POINTER(qkmer);
+
+	if (len > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("Invalid stored QKMer of length %d", len)));
+
+	PG_RETURN_POINTER(qkmer_from_chars(data, len));
+}
+
+// Applies one of the upgrade functions above to every element of an array,
+// keeping its dimensions and NULL elements, so that array columns written by
+// version 1.0.0 are rewritten as well.
+PG_FUNCTION_INFO_V1(upgrade_packed_array);
+Datum upgrade_packed_array(PG_FUNCTION_ARGS)
+{
+	ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+	Oid upgrade = PG_GETARG_OID(1);
+	Oid elemtype = ARR_ELEMTYPE(array);
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	Datum *elems;
+	bool *nulls;
+	int nelems;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(array, elemtype, typlen, typbyval, typalign, &elems, &nulls, &nelems);
+
+	for (int i = 0; i < nelems; i++)
+	{
+		if (!nulls[i])
+			elems[i] = OidFunctionCall1(upgrade, elems[i]);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, ARR_NDIM(array), ARR_DIMS(array),
+											 ARR_LBOUND(array), elemtype, typlen, typbyval,
+											 typalign));
+}
+
 /* Length Functions */
 PG_FUNCTION_INFO_V1(dna_length);
 Datum dna_length(PG_FUNCTION_ARGS)
 {
-	DNA *dna = (DNA *)PG_GETARG_VARLENA_P(0);
-	PG_RETURN_INT32(VARSIZE_ANY_EXHDR(dna));
+	DnaHeader header;
+
+	/* Only the header is fetched, even for out-of-line values */
+	dna_get_header(PG_GETARG_DATUM(0), &header);
+	PG_RETURN_INT32(header.length);
 }
 
 PG_FUNCTION_INFO_V1(kmer_length);
 Datum kmer_length(PG_FUNCTION_ARGS)
 {
-	KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(0);
-	PG_RETURN_INT32(VARSIZE_ANY_EXHDR(kmer));
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	PG_RETURN_INT32(kmer_get_length(kmer));
 }
 
 PG_FUNCTION_INFO_V1(qkmer_length);
 Datum qkmer_length(PG_FUNCTION_ARGS)
 {
-	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_P(0);
-	PG_RETURN_INT32(VARSIZE_ANY_EXHDR(qkmer));
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+	PG_RETURN_INT32(qkmer_get_length(qkmer));
+}
+
+/* Substring Function */
+// SQL-style substring: count bases from 1-based position start. Only the
+// TOAST chunks covering the requested bases are fetched.
+PG_FUNCTION_INFO_V1(dna_substring);
+Datum dna_substring(PG_FUNCTION_ARGS)
+{
+	int32 start = PG_GETARG_INT32(1);
+	int32 count = PG_GETARG_INT32(2);
+	DnaReader reader;
+	int64 first, last;
+	char *sequence;
+
+	if (count < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_SUBSTRING_ERROR),
+				 errmsg("negative substring length not allowed")));
+
+	dna_reader_init(&reader, PG_GETARG_DATUM(0));
+
+	/* Clamp the 1-based window [start, start + count) to the sequence */
+	first = Max((int64)start, 1);
+	last = Min((int64)start + count, (int64)reader.length + 1);
+	if (last <= first)
+		PG_RETURN_POINTER(dna_from_chars(NULL, 0));
+
+	sequence = palloc(last - first);
+	dna_reader_read(&reader, first - 1, last - first, sequence);
+
+	PG_RETURN_POINTER(dna_from_chars(sequence, last - first));
+}
+
+/* Search Functions */
+
+// Loads the 32 packed bases starting at the given byte of nbytes packed
+// bytes, padded with A past the end
+static inline uint64 dna_load_bases(const uint8 *bytes, int nbytes, int index)
+{
+	uint64 word = 0;
+
+	if (index + (int)sizeof(uint64) <= nbytes)
+		memcpy(&word, bytes + index, sizeof(uint64));
+	else if (index < nbytes)
+		memcpy(&word, bytes + index, nbytes - index);
+
+	return pg_ntoh64(word);
+}
+
+// Sets the high bit of each base of a word of 32 packed bases that is one
+// of the bases in a qkmer mask nibble
+static inline uint64 dna_match_bases(uint64 word, int nibble)
+{
+	uint64 hits = 0;
+	int code;
+
+	for (code = 0; code < 4; code++)
+	{
+		if (nibble & (1 << code))
+		{
+			/* Both bits of a base agree with the code */
+			uint64 same = ~(word ^ (UINT64CONST(0x5555555555555555) * code));
+
+			hits |= same & (same << 1);
+		}
+	}
+
+	return hits & UINT64CONST(0xAAAAAAAAAAAAAAAA);
+}
+
+// First start from from..limit-1 where the bases match a pattern, given as
+// one mask nibble per position, or -1. The 32 starts of a word are tested
+// together, one pattern position at a time, and a word is left as soon as
+// none of its starts can match, so most take only a few steps.
+static int dna_search_bases(const uint8 *bytes, int nbytes, const int *nibbles, int len,
+							int from, int limit)
+{
+	int index;
+
+	for (index = from >> 2; index << 2 < limit; index += sizeof(uint64))
+	{
+		uint64 first = dna_load_bases(bytes, nbytes, index);
+		uint64 next = dna_load_bases(bytes, nbytes, index + sizeof(uint64));
+		uint64 hits = ~UINT64CONST(0);
+		int start = index << 2;
+		int j;
+
+		for (j = 0; j < len && hits; j++)
+		{
+			uint64 word = j ? (first << (2 * j)) | (next >> (64 - 2 * j)) : first;
+
+			if (nibbles[j] != 0xF)
+				hits &= dna_match_bases(word, nibbles[j]);
+		}
+
+		hits &= UINT64CONST(0xAAAAAAAAAAAAAAAA);
+		if (start < from)
+			hits &= ~kmer_prefix_mask(from - start);
+		if (limit - start < 32)
+			hits &= kmer_prefix_mask(limit - start);
+
+		if (hits)
+			return start + ((63 - pg_leftmost_one_pos64(hits)) >> 1);
+	}
+
+	return -1;
+}
+
+// Start of the first occurrence in a DNA value of a pattern of len bases,
+// given as qkmer masks, or -1. The packed bases are searched a word at a
+// time, a slice at a time for uncompressed out-of-line values; matches
+// overlapping an N run are skipped, as patterns hold no N.
+int dna_find_pattern(Datum datum, const uint64 mask[2], int len)
+{
+	DnaReader reader;
+	int nibbles[MAX_KMER_LENGTH];
+	int from = 0;
+	int run = 0;
+	int j;
+
+	if (len == 0)
+		return 0;
+
+	for (j = 0; j < len; j++)
+		nibbles[j] = qkmer_mask_at(mask, j);
+
+	dna_reader_init(&reader, datum);
+
+	while (from + len <= reader.length)
+	{
+		struct varlena *slice = NULL;
+		const uint8 *bytes;
+		int nbytes, chunkStart, limit, found;
+
+		if (reader.value)
+		{
+			bytes = (const uint8 *)VARDATA_ANY(reader.value) + DNA_BASES_OFFSET(reader.nruns);
+			nbytes = KMER_PACKED_BYTES(reader.length);
+			chunkStart = 0;
+		}
+		else
+		{
+			int first = from >> 2;
+
+			nbytes = Min(DNA_SLICE_BYTES, (int)KMER_PACKED_BYTES(reader.length) - first);
+			slice = PG_DETOAST_DATUM_SLICE(datum, DNA_BASES_OFFSET(reader.nruns) + first, nbytes);
+			bytes = (const uint8 *)VARDATA_ANY(slice);
+			chunkStart = first << 2;
+		}
+
+		/* Matches must end within the chunk; later ones wait for the next */
+		limit = Min(reader.length, chunkStart + (nbytes << 2)) - len + 1;
+
+		while ((found = dna_search_bases(bytes, nbytes, nibbles, len,
+										 from - chunkStart, limit - chunkStart)) >= 0)
+		{
+			found += chunkStart;
+
+			while (run < reader.nruns && (int)(reader.runs[run].start + reader.runs[run].length) <= found)
+				run++;
+
+			if (run == reader.nruns || (int)reader.runs[run].start >= found + len)
+			{
+				if (slice)
+					pfree(slice);
+				return found;
+			}
+
+			/* Restart past the N run */
+			from = reader.runs[run].start + reader.runs[run].length;
+		}
+
+		from = Max(from, limit);
+		if (slice)
+			pfree(slice);
+	}
+
+	return -1;
+}
+
+// Position function: 1-based start of the first occurrence of a KMER in a
+// DNA sequence, or 0, like strpos
+PG_FUNCTION_INFO_V1(dna_strpos);
+Datum dna_strpos(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(1);
+	uint64 mask[2];
+
+	kmer_get_mask(kmer_get_bits(kmer), mask);
+	PG_RETURN_INT32(dna_find_pattern(PG_GETARG_DATUM(0), mask, kmer_get_length(kmer)) + 1);
+}
+
+// Position function for a QKMER pattern
+PG_FUNCTION_INFO_V1(dna_strpos_pattern);
+Datum dna_strpos_pattern(PG_FUNCTION_ARGS)
+{
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(1);
+	uint64 mask[2];
+
+	qkmer_get_mask(qkmer, mask);
+	PG_RETURN_INT32(dna_find_pattern(PG_GETARG_DATUM(0), mask, qkmer_get_length(qkmer)) + 1);
+}
+
+// Contains function: a DNA sequence contains a KMER as a substring
+PG_FUNCTION_INFO_V1(dna_contains);
+Datum dna_contains(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(1);
+	uint64 mask[2];
+
+	kmer_get_mask(kmer_get_bits(kmer), mask);
+	PG_RETURN_BOOL(dna_find_pattern(PG_GETARG_DATUM(0), mask, kmer_get_length(kmer)) >= 0);
+}
+
+// Matches function: a DNA sequence has a substring matching a QKMER
+PG_FUNCTION_INFO_V1(dna_matches);
+Datum dna_matches(PG_FUNCTION_ARGS)
+{
+	QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(1);
+	uint64 mask[2];
+
+	qkmer_get_mask(qkmer, mask);
+	PG_RETURN_BOOL(dna_find_pattern(PG_GETARG_DATUM(0), mask, qkmer_get_length(qkmer)) >= 0);
+}
+
+/* Reverse Complement Functions */
+
+// Reverse complement of each byte of 4 packed bases, filled on first use
+static uint8 dna_rc_table[256];
+static bool dna_rc_table_ready = false;
+
+// Reverse complement of a DNA value. The packed bytes are reversed through
+// the table, then shifted to drop the padding bases that end up in front;
+// the N runs are mirrored.
+PG_FUNCTION_INFO_V1(dna_reverse_complement);
+Datum dna_reverse_complement(PG_FUNCTION_ARGS)
+{
+	struct varlena *dna = PG_DETOAST_DATUM_PACKED(PG_GETARG_DATUM(0));
+	const char *data = VARDATA_ANY(dna);
+	DnaHeader header;
+	const uint8 *bases;
+	uint8 *outBases;
+	DnaRun *outRuns;
+	DNA *result;
+	Size size;
+	int nbytes, shift, i;
+
+	if (!dna_rc_table_ready)
+	{
+		for (i = 0; i < 256; i++)
+			dna_rc_table[i] = (uint8)(kmer_reverse_complement_bits((uint64)i << 56, 4) >> 56);
+		dna_rc_table_ready = true;
+	}
+
+	memcpy(&header, data, sizeof(DnaHeader));
+	nbytes = KMER_PACKED_BYTES(header.length);
+	bases = (const uint8 *)data + DNA_BASES_OFFSET(header.nruns);
+
+	size = VARHDRSZ + DNA_BASES_OFFSET(header.nruns) + nbytes;
+	result = (DNA *)palloc(size);
+	SET_VARSIZE(result, size);
+	memcpy(VARDATA(result), &header, sizeof(DnaHeader));
+	outRuns = (DnaRun *)(VARDATA(result) + sizeof(DnaHeader));
+	outBases = (uint8 *)VARDATA(result) + DNA_BASES_OFFSET(header.nruns);
+
+	for (i = 0; i < nbytes; i++)
+		outBases[i] = dna_rc_table[bases[nbytes - 1 - i]];
+
+	shift = 2 * (4 * nbytes - (int)header.length);
+	if (shift)
+	{
+		for (i = 0; i < nbytes - 1; i++)
+			outBases[i] = (uint8)(outBases[i] << shift) | (outBases[i + 1] >> (8 - shift));
+		outBases[nbytes - 1] = (uint8)(outBases[nbytes - 1] << shift);
+	}
+
+	/* Bases under an N run are stored as A again */
+	for (i = 0; i < (int)header.nruns; i++)
+	{
+		DnaRun run;
+
+		memcpy(&run, data + sizeof(DnaHeader) + (header.nruns - 1 - i) * sizeof(DnaRun), sizeof(DnaRun));
+		run.start = header.length - run.start - run.length;
+		outRuns[i] = run;
+
+		for (uint32 p = run.start; p < run.start + run.length; p++)
+			outBases[p >> 2] &= (uint8)~(3 << (6 - 2 * (p & 3)));
+	}
+
+	PG_RETURN_POINTER(result);
+}
+
+PG_FUNCTION_INFO_V1(kmer_reverse_complement);
+Datum kmer_reverse_complement(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	int len = kmer_get_length(kmer);
+
+	PG_RETURN_POINTER(kmer_from_bits(kmer_reverse_complement_bits(kmer_get_bits(kmer), len), len));
+}
+
+// Canonical function: the lesser of a KMER and its reverse complement. A
+// KMER that is canonical already is returned as is, without a copy, so
+// expression indexes on canonical(kmer) cost little more than plain ones.
+PG_FUNCTION_INFO_V1(kmer_canonical);
+Datum kmer_canonical(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	uint64 bits = kmer_get_bits(kmer);
+	int len = kmer_get_length(kmer);
+	uint64 rc = kmer_reverse_complement_bits(bits, len);
+
+	if (bits <= rc)
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+
+	PG_RETURN_POINTER(kmer_from_bits(rc, len));
+}
+
+/* Hamming Distance Functions */
+
+// Reads a hamming_ball composite value
+bool hamming_ball_get(Datum ball, uint64 *bits, int *length, int *radius)
+{
+	HeapTupleHeader tuple = DatumGetHeapTupleHeader(ball);
+	Datum center, distance;
+	bool centerNull, distanceNull;
+	KMER *kmer;
+
+	center = GetAttributeByNum(tuple, 1, &centerNull);
+	distance = GetAttributeByNum(tuple, 2, &distanceNull);
+	if (centerNull || distanceNull)
+		return false;
+
+	kmer = (KMER *)PG_DETOAST_DATUM_PACKED(center);
+	*bits = kmer_get_bits(kmer);
+	*length = kmer_get_length(kmer);
+	*radius = DatumGetInt32(distance);
+	return true;
+}
+
+// Distance function for the <-> operator
+PG_FUNCTION_INFO_V1(kmer_hamming_distance);
+Datum kmer_hamming_distance(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_INT32(kmer_hamming_bits(kmer_get_bits(kmer1), kmer_get_length(kmer1),
+									  kmer_get_bits(kmer2), kmer_get_length(kmer2)));
+}
+
+// Within function: a KMER is in a hamming_ball when it is at most radius
+// mismatches away from the center
+PG_FUNCTION_INFO_V1(kmer_within_ball);
+Datum kmer_within_ball(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	uint64 bits;
+	int length, radius;
+
+	if (!hamming_ball_get(PG_GETARG_DATUM(1), &bits, &length, &radius))
+		PG_RETURN_NULL();
+
+	PG_RETURN_BOOL(kmer_hamming_bits(kmer_get_bits(kmer), kmer_get_length(kmer), bits, length) <= radius);
 }
 
 /* Comparison functions */
@@ -226,29 +1197,29 @@ Datum qkmer_length(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(kmer_equals);
 Datum kmer_equals(PG_FUNCTION_ARGS)
 {
-	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_P(0);
-	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_P(1);
-
 	// If either of the value is null return false
 	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
 		PG_RETURN_BOOL(false);
 
-	int len1 = VARSIZE_ANY_EXHDR(kmer1);
-	int len2 = VARSIZE_ANY_EXHDR(kmer2);
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	int len1 = kmer_get_length(kmer1);
+	int len2 = kmer_get_length(kmer2);
 
 	// if lengths are unequal, then they are automatically unequal
 	if (len1 != len2)
 		PG_RETURN_BOOL(false);
 
-	bool result = memcmp(VARDATA_ANY(kmer1), VARDATA_ANY(kmer2), len1) == 0;
+	bool result = kmer_get_bits(kmer1) == kmer_get_bits(kmer2);
 	PG_RETURN_BOOL(result);
 }
 
 // Starts with function
 PG_FUNCTION_INFO_V1(kmer_starts_with);
 Datum kmer_starts_with(PG_FUNCTION_ARGS) {
-    KMER *prefix = (KMER *)PG_GETARG_VARLENA_P(0);
-    KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(1);
+    KMER *prefix = (KMER *)PG_GETARG_VARLENA_PP(0);
+    KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(1);
 
     bool result = kmer_starts_with_helper(prefix, kmer);
     PG_RETURN_BOOL(result);
@@ -257,8 +1228,8 @@ Datum kmer_starts_with(PG_FUNCTION_ARGS) {
 // Starts with function specially for the operator
 PG_FUNCTION_INFO_V1(kmer_starts_with_op);
 Datum kmer_starts_with_op(PG_FUNCTION_ARGS) {
-    KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(0);
-    KMER *prefix = (KMER *)PG_GETARG_VARLENA_P(1);
+    KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+    KMER *prefix = (KMER *)PG_GETARG_VARLENA_PP(1);
 
     bool result = kmer_starts_with_helper(prefix, kmer);
     PG_RETURN_BOOL(result);
@@ -267,8 +1238,8 @@ Datum kmer_starts_with_op(PG_FUNCTION_ARGS) {
 // Containing function
 PG_FUNCTION_INFO_V1(kmer_containing);
 Datum kmer_containing(PG_FUNCTION_ARGS) {
-    KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(0);
-    QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_P(1);
+    KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+    QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(1);
 
     bool result = kmer_query(kmer, qkmer);
     PG_RETURN_BOOL(result);
@@ -277,89 +1248,59 @@ Datum kmer_containing(PG_FUNCTION_ARGS) {
 // Contains function
 PG_FUNCTION_INFO_V1(kmer_contains);
 Datum kmer_contains(PG_FUNCTION_ARGS) {
-    QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_P(0);
-    KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(1);
+    QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+    KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(1);
 
     bool result = kmer_query(kmer, qkmer);
     PG_RETURN_BOOL(result);
 }
 
 // generate kmer function
+// All k-mers are returned at once in materialize mode, rolling a 2-bit
+// window over the packed sequence; each k-mer is built in a stack buffer
+// that the tuplestore copies. With a third argument set to true, canonical
+// k-mers are returned.
 // https://www.postgresql.org/docs/current/xfunc-c.html#XFUNC-C-RETURN-SET
 PG_FUNCTION_INFO_V1(generate_kmers);
 Datum generate_kmers(PG_FUNCTION_ARGS)
 {
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	int window_size = PG_GETARG_INT32(1);
+	char buffer[KMER_PACKED_SIZE(MAX_KMER_LENGTH)];
+	KMER *kmer = (KMER *)buffer;
+	DnaKmerIterator iter;
+	Datum value = PointerGetDatum(kmer);
+	bool isnull = false;
+	uint64 bits;
+	int start;
+
+	dna_kmers_init(&iter, PG_GETARG_DATUM(0), window_size);
+	iter.canonical = PG_NARGS() > 2 && PG_GETARG_BOOL(2);
+
+	if (iter.reader.length < window_size || window_size <= 0 || window_size > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid KMER Length")));
 
-	FuncCallContext *funcctx;
-	int call_cntr;
-	int max_calls;
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
 
-	if (SRF_IS_FIRSTCALL())
+	// Windows overlapping an N run are skipped, as a kmer cannot hold N
+	while (dna_kmers_next(&iter, &bits, &start))
 	{
-
-		MemoryContext oldcontext;
-
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-		DNA *dna = (DNA *)PG_GETARG_VARLENA_P(0);
-		int window_size = PG_GETARG_INT32(1);
-
-		int len_dna = VARSIZE_ANY_EXHDR(dna);
-
-		if (len_dna < window_size || window_size <= 0 || window_size > MAX_KMER_LENGTH)
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("Invalid KMER Length")));
-
-		// Total Number of calls to make
-		funcctx->max_calls = len_dna - window_size + 1;
-
-		// User context saved for each call
-		funcctx->user_fctx = palloc(sizeof(struct {
-			char *sequence;
-			int k_size;
-		}));
-
-		((struct { char *sequence; int k_size; } *)funcctx->user_fctx)->sequence = pstrdup(VARDATA_ANY(dna));
-		((struct { char *sequence; int k_size; } *)funcctx->user_fctx)->k_size = window_size;
-
-		MemoryContextSwitchTo(oldcontext);
+		kmer_set_bits(kmer, bits, window_size);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
 	}
 
-	funcctx = SRF_PERCALL_SETUP();
-
-	call_cntr = funcctx->call_cntr;
-	max_calls = funcctx->max_calls;
-
-	if (call_cntr < max_calls)
-	{
-
-		char *dna_sequence = ((struct { char *sequence; int k_size; } *)funcctx->user_fctx)->sequence;
-		int window_size = ((struct { char *sequence; int k_size; } *)funcctx->user_fctx)->k_size;
-
-		KMER *kmer = (KMER *)palloc(VARHDRSZ_SHORT + window_size);
-		SET_VARSIZE_SHORT(kmer, VARHDRSZ_SHORT + window_size);
-		memcpy(VARDATA_ANY(kmer), dna_sequence + call_cntr, window_size);
-
-		SRF_RETURN_NEXT(funcctx, PointerGetDatum(kmer));
-	}
-	else
-	{
-		SRF_RETURN_DONE(funcctx);
-	}
+	return (Datum)0;
 }
 
 PG_FUNCTION_INFO_V1(kmer_hash);
 Datum
 kmer_hash(PG_FUNCTION_ARGS)
 {
-    KMER *kmer = (KMER *)PG_GETARG_VARLENA_P(0);
-    int len = VARSIZE_ANY_EXHDR(kmer);
-    Datum result;
-    
-    /* Use the built-in hash function on the entire KMER contents */
-    result = hash_any((unsigned char *) VARDATA_ANY(kmer), len);
-    
-    PG_RETURN_DATUM(result);
+    KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+    uint64 hash = kmer_hash_bits(kmer_get_bits(kmer), kmer_get_length(kmer));
+
+    /* The hash opclass takes the low 32 bits of the packed k-mer hash */
+    PG_RETURN_UINT32((uint32) hash);
 }
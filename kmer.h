@@ -4,6 +4,8 @@
 
 #include "postgres.h"
 #include "utils/varlena.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_bswap.h"
 
 // DNA Sequence Type
 typedef struct varlena DNA;
@@ -17,37 +19,431 @@ typedef struct varlena QKMER;
 // Maximum length for kmer and qkmer types
 #define MAX_KMER_LENGTH 32
 
-// Helper Function to  match the possible DNA sequences for a given QKMer
-static inline bool
-match(char pattern, char nucleotide)
+/*
+ * Packed K-mer layout
+ *
+ * A kmer is a short varlena whose payload is one length byte followed by the
+ * bases packed 2 bits each, four to a byte, first base in the high bits.
+ * Loaded into a uint64 the first base lands in bits 63..62 and unused low
+ * bits are zero, so for any two k-mers (bits, length) ordering is the
+ * lexicographic ordering of their text form. A 32-mer takes 10 bytes.
+ */
+#define KMER_PACKED_BYTES(len) (((len) + 3) >> 2)
+#define KMER_PACKED_SIZE(len) (VARHDRSZ_SHORT + 1 + KMER_PACKED_BYTES(len))
+
+/*
+ * Packed DNA layout
+ *
+ * A dna payload is a DnaHeader, the runs of N in the sequence (sorted by
+ * start) and then the bases packed like a k-mer, 2 bits each with the first
+ * base in the high bits. Bases under an N run are stored as A. The header and
+ * run list come first so readers can fetch them and then only the bytes of the
+ * bases they need; the type uses external storage so that slicing an
+ * out-of-line value reads just the TOAST chunks covering the slice.
+ */
+typedef struct DnaHeader
+{
+	uint32 length; // number of bases
+	uint32 nruns;  // number of N runs
+} DnaHeader;
+
+typedef struct DnaRun
+{
+	uint32 start;
+	uint32 length;
+} DnaRun;
+
+#define DNA_BASES_OFFSET(nruns) (sizeof(DnaHeader) + (nruns) * sizeof(DnaRun))
+
+// Reader over a possibly toasted dna value
+typedef struct DnaReader
+{
+	Datum datum;			 // original, possibly out-of-line value
+	struct varlena *value;	 // whole value when it was cheap to detoast
+	int length;
+	int nruns;
+	DnaRun *runs;
+} DnaReader;
+
+// Rolling iterator over the k-mers of a dna value. The packed bases are read
+// a slice at a time and shifted 2 bits at a time into a window; windows
+// overlapping an N run are skipped.
+typedef struct DnaKmerIterator
 {
+	DnaReader reader;
+	int k;
+	int position;			 // next base to shift into the window
+	int valid;				 // bases shifted in since the last N run
+	int run;				 // next N run
+	bool canonical;			 // return the lesser of each k-mer and its reverse complement
+	uint64 window;			 // latest bases, right aligned
+	uint64 rcwindow;		 // reverse complement of the window, right aligned
+	struct varlena *slice;	 // current slice of an out-of-line value
+	const uint8 *bytes;		 // packed bases from base chunkStart on
+	int chunkStart;
+	int chunkEnd;
+} DnaKmerIterator;
 
-	if (pattern == nucleotide || pattern == 'n')
-		return true;
+extern DNA *dna_from_chars(const char *seq, int len);
+extern DNA *dna_from_text(const char *input);
+extern void dna_reader_init(DnaReader *reader, Datum datum);
+extern void dna_reader_read(DnaReader *reader, int start, int count, char *out);
+extern void dna_kmers_init(DnaKmerIterator *iter, Datum datum, int k);
+extern bool dna_kmers_next(DnaKmerIterator *iter, uint64 *bits, int *start);
+extern int dna_find_pattern(Datum datum, const uint64 mask[2], int len);
 
-	switch (pattern)
+// Center and radius of a hamming_ball value; false if either is null
+extern bool hamming_ball_get(Datum ball, uint64 *bits, int *length, int *radius);
+
+// 2-bit code of the i-th base of a packed k-mer
+#define KMER_CODE_AT(bits, i) ((int) (((bits) >> (62 - 2 * (i))) & 3))
+
+// Nucleotides by 2-bit code, in alphabetical order
+static const char kmer_nucleotides[4] = {'a', 'c', 'g', 't'};
+
+// Helper Function to get the 2-bit code of a validated, lowercase nucleotide
+static inline uint64
+nucleotide_code(char c)
+{
+	switch (c)
 	{
-	case 'r':
-		return nucleotide == 'a' || nucleotide == 'g'; // puRine
-	case 'y':
-		return nucleotide == 'c' || nucleotide == 't'; // pYrimidine
-	case 'k':
-		return nucleotide == 'g' || nucleotide == 't'; // Keto
-	case 'm':
-		return nucleotide == 'a' || nucleotide == 'c'; // aMino
-	case 's':
-		return nucleotide == 'g' || nucleotide == 'c'; // Strong
-	case 'w':
-		return nucleotide == 'a' || nucleotide == 't'; // Weak
-	case 'b':
-		return nucleotide == 'c' || nucleotide == 'g' || nucleotide == 't'; // not A
-	case 'd':
-		return nucleotide == 'a' || nucleotide == 'g' || nucleotide == 't'; // not C
-	case 'h':
-		return nucleotide == 'a' || nucleotide == 'c' || nucleotide == 't'; // not G
-	case 'v':
-		return nucleotide == 'a' || nucleotide == 'c' || nucleotide == 'g'; // not T
+	case 'c':
+		return 1;
+	case 'g':
+		return 2;
+	case 't':
+		return 3;
 	default:
-		return false;
+		return 0;
+	}
+}
+
+// Mask covering the first len bases of a packed k-mer
+static inline uint64
+kmer_prefix_mask(int len)
+{
+	return len == 0 ? 0 : ~UINT64CONST(0) << (64 - 2 * len);
+}
+
+// Mask covering bases from..to-1 of a packed k-mer
+static inline uint64
+kmer_range_mask(int from, int to)
+{
+	return kmer_prefix_mask(to) & ~kmer_prefix_mask(from);
+}
+
+// Number of leading bases two packed k-mers have in common
+static inline int
+kmer_common_prefix(uint64 a, int lena, uint64 b, int lenb)
+{
+	uint64 diff = a ^ b;
+	int common = diff ? (63 - pg_leftmost_one_pos64(diff)) >> 1 : MAX_KMER_LENGTH;
+
+	return Min(common, Min(lena, lenb));
+}
+
+// Bases of a packed k-mer from position start on, left aligned
+static inline uint64
+kmer_suffix_bits(uint64 bits, int start)
+{
+	return start >= MAX_KMER_LENGTH ? 0 : bits << (2 * start);
+}
+
+// Places left aligned bases at position start after the bases in prefix
+static inline uint64
+kmer_append_bits(uint64 prefix, int start, uint64 bits)
+{
+	return start >= MAX_KMER_LENGTH ? prefix : prefix | (bits >> (2 * start));
+}
+
+// Length of a packed k-mer
+static inline int
+kmer_get_length(const KMER *kmer)
+{
+	return *(const uint8 *) VARDATA_ANY(kmer);
+}
+
+// Bases of a packed k-mer, left aligned in a uint64
+static inline uint64
+kmer_get_bits(const KMER *kmer)
+{
+	const uint8 *data = (const uint8 *) VARDATA_ANY(kmer) + 1;
+	int nbytes = VARSIZE_ANY_EXHDR(kmer) - 1;
+	uint64 bits = 0;
+
+	for (int i = 0; i < nbytes; i++)
+		bits |= (uint64) data[i] << (56 - 8 * i);
+
+	return bits;
+}
+
+// Three-way comparison of packed k-mers in lexicographic order
+static inline int
+kmer_compare(uint64 bitsa, int lena, uint64 bitsb, int lenb)
+{
+	if (bitsa != bitsb)
+		return bitsa < bitsb ? -1 : 1;
+	if (lena != lenb)
+		return lena < lenb ? -1 : 1;
+	return 0;
+}
+
+// Write a packed k-mer from left aligned bases into a buffer of
+// KMER_PACKED_SIZE(len) bytes
+static inline void
+kmer_set_bits(KMER *kmer, uint64 bits, int len)
+{
+	int nbytes = KMER_PACKED_BYTES(len);
+	uint8 *data;
+
+	Assert(len >= 0 && len <= MAX_KMER_LENGTH);
+
+	bits &= kmer_prefix_mask(len);
+	SET_VARSIZE_SHORT(kmer, KMER_PACKED_SIZE(len));
+	data = (uint8 *) VARDATA_ANY(kmer);
+	data[0] = (uint8) len;
+	for (int i = 0; i < nbytes; i++)
+		data[i + 1] = (uint8) (bits >> (56 - 8 * i));
+}
+
+// Create a packed k-mer from left aligned bases
+static inline KMER *
+kmer_from_bits(uint64 bits, int len)
+{
+	KMER *kmer = (KMER *) palloc(KMER_PACKED_SIZE(len));
+
+	kmer_set_bits(kmer, bits, len);
+
+	return kmer;
+}
+
+// Pack a validated, lowercase nucleotide string into left aligned bases
+static inline uint64
+kmer_pack_chars(const char *str, int len)
+{
+	uint64 bits = 0;
+
+	for (int i = 0; i < len; i++)
+		bits |= nucleotide_code(str[i]) << (62 - 2 * i);
+
+	return bits;
+}
+
+// Unpack left aligned bases into a nucleotide string (not NUL-terminated)
+static inline void
+kmer_unpack_chars(uint64 bits, int len, char *out)
+{
+	for (int i = 0; i < len; i++)
+		out[i] = kmer_nucleotides[KMER_CODE_AT(bits, i)];
+}
+
+// 64-bit hash of a packed k-mer (murmur3 finalizer over bases and length)
+static inline uint64
+kmer_hash_bits(uint64 bits, int len)
+{
+	uint64 h = bits ^ ((uint64) len * UINT64CONST(0x9E3779B97F4A7C15));
+
+	h ^= h >> 33;
+	h *= UINT64CONST(0xFF51AFD7ED558CCD);
+	h ^= h >> 33;
+	h *= UINT64CONST(0xC4CEB9FE1A85EC53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+// Mismatching bases within the first len bases of two packed k-mers
+static inline int
+kmer_mismatches(uint64 a, uint64 b, int len)
+{
+	uint64 diff = a ^ b;
+
+	// One bit per differing base, the high bit of its 2-bit code
+	return pg_popcount64((diff | (diff << 1)) & UINT64CONST(0xAAAAAAAAAAAAAAAA) & kmer_prefix_mask(len));
+}
+
+// Hamming distance between two packed k-mers; each base of the longer one
+// past the end of the shorter one counts as a mismatch
+static inline int
+kmer_hamming_bits(uint64 a, int lena, uint64 b, int lenb)
+{
+	return kmer_mismatches(a, b, Min(lena, lenb)) + Abs(lena - lenb);
+}
+
+// Least Hamming distance from b of any k-mer starting with the prefix a
+static inline int
+kmer_hamming_bound(uint64 a, int lena, uint64 b, int lenb)
+{
+	return kmer_mismatches(a, b, Min(lena, lenb)) + Max(lena - lenb, 0);
+}
+
+// Reverse complement of a packed k-mer. The complement of a 2-bit code is
+// its bitwise inverse, and the bases are reversed by swapping bytes, then
+// nibbles, then 2-bit pairs.
+static inline uint64
+kmer_reverse_complement_bits(uint64 bits, int len)
+{
+	uint64 x = pg_bswap64(~bits);
+
+	x = ((x >> 4) & UINT64CONST(0x0F0F0F0F0F0F0F0F)) | ((x & UINT64CONST(0x0F0F0F0F0F0F0F0F)) << 4);
+	x = ((x >> 2) & UINT64CONST(0x3333333333333333)) | ((x & UINT64CONST(0x3333333333333333)) << 2);
+
+	return len == 0 ? 0 : x << (64 - 2 * len);
+}
+
+// Canonical form of a packed k-mer: the lesser of it and its reverse
+// complement
+static inline uint64
+kmer_canonical_bits(uint64 bits, int len)
+{
+	uint64 rc = kmer_reverse_complement_bits(bits, len);
+
+	return Min(bits, rc);
+}
+
+/*
+ * K-mer column statistics
+ *
+ * kmer_typanalyze stores two slot kinds of its own next to the standard
+ * statistics, numbered outside the range reserved for core (1-99):
+ * - per-position base frequencies, MAX_KMER_LENGTH * 4 numbers where entry
+ *   4 * i + c is the fraction of non-null k-mers that are longer than i and
+ *   whose base i has code c
+ * - length frequencies, MAX_KMER_LENGTH + 1 numbers where entry l is the
+ *   fraction of non-null k-mers of length l
+ */
+#define KMER_STATISTIC_KIND_POSITIONS 9301
+#define KMER_STATISTIC_KIND_LENGTHS 9302
+
+/*
+ * Packed QKmer layout
+ *
+ * A qkmer is a short varlena whose payload is one length byte followed by one
+ * IUPAC mask nibble per position, first position in the high nibble. Bit c of
+ * a nibble is set when the nucleotide with 2-bit code c matches; the 16 masks
+ * are exactly the 16 symbols a qkmer accepts ('u' matches no nucleotide).
+ * Loaded into two uint64 words a pattern is matched against a packed k-mer
+ * with a handful of word operations instead of a switch per base.
+ */
+#define QKMER_PACKED_BYTES(len) (((len) + 1) >> 1)
+#define QKMER_PACKED_SIZE(len) (VARHDRSZ_SHORT + 1 + QKMER_PACKED_BYTES(len))
+
+// IUPAC symbols by mask nibble
+static const char qkmer_symbols[16] = {
+	'u', 'a', 'c', 'm', 'g', 'r', 's', 'v',
+	't', 'w', 'y', 'h', 'k', 'd', 'b', 'n'};
+
+// Helper Function to get the mask nibble of a lowercase IUPAC symbol, or -1
+static inline int
+iupac_mask(char c)
+{
+	switch (c)
+	{
+	case 'u': return 0x0; // Uracil
+	case 'a': return 0x1; // Adenine
+	case 'c': return 0x2; // Cytosine
+	case 'm': return 0x3; // A or C
+	case 'g': return 0x4; // Guanine
+	case 'r': return 0x5; // A or G
+	case 's': return 0x6; // G or C
+	case 'v': return 0x7; // A, C, or G (not T)
+	case 't': return 0x8; // Thymine
+	case 'w': return 0x9; // A or T
+	case 'y': return 0xA; // C or T
+	case 'h': return 0xB; // A, C, or T (not G)
+	case 'k': return 0xC; // G or T
+	case 'd': return 0xD; // A, G, or T (not C)
+	case 'b': return 0xE; // C, G, or T (not A)
+	case 'n': return 0xF; // A, T, C, or G (any nucleotide)
+	default: return -1;
 	}
-}
\ No newline at end of file
+}
+
+// Length of a packed qkmer
+static inline int
+qkmer_get_length(const QKMER *qkmer)
+{
+	return *(const uint8 *) VARDATA_ANY(qkmer);
+}
+
+// Mask nibbles of a packed qkmer in two words (positions 0-15 and 16-31);
+// positions past the end of the pattern match anything
+static inline void
+qkmer_get_mask(const QKMER *qkmer, uint64 mask[2])
+{
+	const uint8 *data = (const uint8 *) VARDATA_ANY(qkmer) + 1;
+	int nbytes = VARSIZE_ANY_EXHDR(qkmer) - 1;
+	int len = qkmer_get_length(qkmer);
+
+	mask[0] = mask[1] = 0;
+	for (int i = 0; i < nbytes; i++)
+		mask[i >> 3] |= (uint64) data[i] << (56 - 8 * (i & 7));
+
+	for (int i = len; i < MAX_KMER_LENGTH; i++)
+		mask[i >> 4] |= UINT64CONST(0xF) << (60 - 4 * (i & 15));
+}
+
+// Spread 16 2-bit codes into one-hot nibbles (bit c set for code c)
+static inline uint64
+kmer_onehot(uint32 codes)
+{
+	uint64 x = codes;
+	uint64 lo, hi;
+
+	x = (x | (x << 16)) & UINT64CONST(0x0000FFFF0000FFFF);
+	x = (x | (x << 8)) & UINT64CONST(0x00FF00FF00FF00FF);
+	x = (x | (x << 4)) & UINT64CONST(0x0F0F0F0F0F0F0F0F);
+	x = (x | (x << 2)) & UINT64CONST(0x3333333333333333);
+
+	lo = x & UINT64CONST(0x1111111111111111);
+	hi = (x >> 1) & UINT64CONST(0x1111111111111111);
+
+	return ((lo ^ UINT64CONST(0x1111111111111111)) & (hi ^ UINT64CONST(0x1111111111111111))) |
+		   ((lo & (hi ^ UINT64CONST(0x1111111111111111))) << 1) |
+		   (((lo ^ UINT64CONST(0x1111111111111111)) & hi) << 2) |
+		   ((lo & hi) << 3);
+}
+
+// Pattern masks matching exactly the bases of a packed k-mer
+static inline void
+kmer_get_mask(uint64 bits, uint64 mask[2])
+{
+	mask[0] = kmer_onehot((uint32) (bits >> 32));
+	mask[1] = kmer_onehot((uint32) bits);
+}
+
+// Mask nibble of position i of a qkmer mask
+static inline int
+qkmer_mask_at(const uint64 mask[2], int i)
+{
+	return (int) ((mask[i >> 4] >> (60 - 4 * (i & 15))) & 0xF);
+}
+
+// Mask of the nibbles of the first len positions in the given mask word
+static inline uint64
+qkmer_position_mask(int len, int word)
+{
+	int n = len - 16 * word;
+
+	if (n <= 0)
+		return 0;
+	return n >= 16 ? ~UINT64CONST(0) : ~UINT64CONST(0) << (64 - 4 * n);
+}
+
+// Checks bases from..to-1 of a packed k-mer against a qkmer mask
+static inline bool
+qkmer_match_range(const uint64 mask[2], uint64 bits, int from, int to)
+{
+	uint64 miss0 = kmer_onehot((uint32) (bits >> 32)) & ~mask[0];
+	uint64 miss1 = kmer_onehot((uint32) bits) & ~mask[1];
+
+	return ((miss0 & qkmer_position_mask(to, 0) & ~qkmer_position_mask(from, 0)) |
+			(miss1 & qkmer_position_mask(to, 1) & ~qkmer_position_mask(from, 1))) == 0;
+}
+
+// Checks the first len bases of a packed k-mer against a qkmer mask
+static inline bool
+qkmer_match_prefix(const uint64 mask[2], uint64 bits, int len)
+{
+	return qkmer_match_range(mask, bits, 0, len);
+}
@@ -0,0 +1,140 @@
+/*
+ * kmer_analyze.c
+ *
+ * ANALYZE support for kmer. On top of the standard statistics (most common
+ * values, histogram, correlation) the sample is summarised as per-position
+ * base frequencies and length frequencies, which the estimators in
+ * kmer_selfuncs.c combine to estimate pattern and prefix searches.
+ *
+ * References:
+ * pg_statistic: https://www.postgresql.org/docs/current/catalog-pg-statistic.html
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "commands/vacuum.h"
+
+/*****************************************************************************/
+
+// Standard analysis, run before the kmer-specific one
+typedef struct KmerAnalyzeExtraData
+{
+	AnalyzeAttrComputeStatsFunc std_compute_stats;
+	void *std_extra_data;
+} KmerAnalyzeExtraData;
+
+// Index of the first unused statistics slot, or -1 if there is none
+static int
+kmer_free_slot(VacAttrStats *stats, int from)
+{
+	for (int slot = from; slot < STATISTIC_NUM_SLOTS; slot++)
+	{
+		if (stats->stakind[slot] == 0)
+			return slot;
+	}
+
+	return -1;
+}
+
+// Stores numbers in a statistics slot
+static void
+kmer_store_slot(VacAttrStats *stats, int slot, int16 kind, const double *counts,
+				int ncounts, double total)
+{
+	MemoryContext old_context = MemoryContextSwitchTo(stats->anl_context);
+	float4 *numbers = (float4 *)palloc(sizeof(float4) * ncounts);
+
+	MemoryContextSwitchTo(old_context);
+
+	for (int i = 0; i < ncounts; i++)
+		numbers[i] = (float4)(counts[i] / total);
+
+	stats->stakind[slot] = kind;
+	stats->staop[slot] = InvalidOid;
+	stats->stacoll[slot] = InvalidOid;
+	stats->stanumbers[slot] = numbers;
+	stats->numnumbers[slot] = ncounts;
+}
+
+// Computes the standard statistics, then base and length frequencies
+static void
+compute_kmer_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc,
+				   int samplerows, double totalrows)
+{
+	KmerAnalyzeExtraData *extra_data = (KmerAnalyzeExtraData *)stats->extra_data;
+	double positions[MAX_KMER_LENGTH * 4] = {0};
+	double lengths[MAX_KMER_LENGTH + 1] = {0};
+	int nonnull = 0;
+	int slot1, slot2;
+
+	/* The standard analysis expects its own extra data */
+	stats->extra_data = extra_data->std_extra_data;
+	extra_data->std_compute_stats(stats, fetchfunc, samplerows, totalrows);
+	stats->extra_data = extra_data;
+
+	if (!stats->stats_valid)
+		return;
+
+	for (int i = 0; i < samplerows; i++)
+	{
+		Datum value;
+		bool isnull;
+		KMER *kmer;
+		uint64 bits;
+		int len;
+
+		vacuum_delay_point();
+
+		value = fetchfunc(stats, i, &isnull);
+		if (isnull)
+			continue;
+
+		kmer = (KMER *)PG_DETOAST_DATUM_PACKED(value);
+		bits = kmer_get_bits(kmer);
+		len = kmer_get_length(kmer);
+
+		lengths[len]++;
+		for (int j = 0; j < len; j++)
+			positions[4 * j + KMER_CODE_AT(bits, j)]++;
+		nonnull++;
+
+		if ((Pointer)kmer != DatumGetPointer(value))
+			pfree(kmer);
+	}
+
+	if (nonnull == 0)
+		return;
+
+	slot1 = kmer_free_slot(stats, 0);
+	slot2 = slot1 < 0 ? -1 : kmer_free_slot(stats, slot1 + 1);
+	if (slot2 < 0)
+		return;
+
+	kmer_store_slot(stats, slot1, KMER_STATISTIC_KIND_POSITIONS,
+					positions, MAX_KMER_LENGTH * 4, nonnull);
+	kmer_store_slot(stats, slot2, KMER_STATISTIC_KIND_LENGTHS,
+					lengths, MAX_KMER_LENGTH + 1, nonnull);
+}
+
+/*****************************************************************************/
+
+/* Typanalyze function */
+PG_FUNCTION_INFO_V1(kmer_typanalyze);
+Datum kmer_typanalyze(PG_FUNCTION_ARGS)
+{
+	VacAttrStats *stats = (VacAttrStats *)PG_GETARG_POINTER(0);
+	KmerAnalyzeExtraData *extra_data;
+
+	// Set up the standard analysis (sample size, MCVs and histogram)
+	if (!std_typanalyze(stats))
+		PG_RETURN_BOOL(false);
+
+	extra_data = (KmerAnalyzeExtraData *)palloc(sizeof(KmerAnalyzeExtraData));
+	extra_data->std_compute_stats = stats->compute_stats;
+	extra_data->std_extra_data = stats->extra_data;
+
+	stats->compute_stats = compute_kmer_stats;
+	stats->extra_data = extra_data;
+
+	PG_RETURN_BOOL(true);
+}
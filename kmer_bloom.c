@@ -0,0 +1,533 @@
+/*
+ * kmer_bloom.c
+ *
+ * Bloom filters of k-mers. kmer_bloom_agg(kmer, capacity, rate) builds a
+ * filter sized for capacity k-mers at the given false positive rate, and
+ * kmer <@ kmer_bloom tests a k-mer against it: a k-mer of the set is always
+ * found, another one with about that probability. Filtering against a
+ * precomputed filter replaces a join against a large k-mer table.
+ *
+ * The filter is blocked: the hash of a k-mer picks one 64-byte block, and
+ * all the bits of the k-mer are set within that block, so a probe costs a
+ * single cache miss. Blocks fill unevenly, so a blocked filter needs a few
+ * percent more bits than a standard one for the same false positive rate;
+ * the filter is sized from the expected rate of the blocked layout.
+ *
+ * Filters of the same size merge by OR, so kmer_bloom_agg is parallel safe
+ * and filters built apart can be combined with kmer_bloom_union.
+ *
+ * References:
+ * F. Putze, P. Sanders, J. Singler, Cache-, Hash- and Space-Efficient Bloom
+ * Filters: https://doi.org/10.1007/978-3-540-72845-0_9
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include <math.h>
+#include "access/detoast.h"
+#include "libpq/pqformat.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+/*****************************************************************************/
+
+// Bits of a block, one cache line. Bit i of a block is bit i % 8 of its
+// byte i / 8, so the filter reads the same on any platform.
+#define KMER_BLOOM_BLOCK_BITS 512
+#define KMER_BLOOM_BLOCK_BYTES (KMER_BLOOM_BLOCK_BITS / 8)
+#define KMER_BLOOM_MAX_HASHES 16
+
+typedef struct KmerBloom
+{
+	int32 vl_len_; // varlena header (do not touch directly!)
+	int32 nhashes;
+	int64 nblocks;
+	uint8 bytes[FLEXIBLE_ARRAY_MEMBER];
+} KmerBloom;
+
+#define KMER_BLOOM_SIZE(nblocks) (offsetof(KmerBloom, bytes) + (Size)KMER_BLOOM_BLOCK_BYTES * (nblocks))
+#define KMER_BLOOM_MAX_BLOCKS ((int64)((MaxAllocSize - offsetof(KmerBloom, bytes)) / KMER_BLOOM_BLOCK_BYTES))
+
+#define DatumGetKmerBloomP(X) ((KmerBloom *)PG_DETOAST_DATUM(X))
+#define PG_GETARG_KMER_BLOOM_P(n) DatumGetKmerBloomP(PG_GETARG_DATUM(n))
+
+// Filter kept across the calls of a query, with the value it was read from
+typedef struct KmerBloomCache
+{
+	struct varatt_external pointer;
+	KmerBloom *bloom;
+} KmerBloomCache;
+
+/*****************************************************************************/
+
+/* Filter helper functions */
+
+// Allocates an empty filter
+static KmerBloom *
+kmer_bloom_create(int64 nblocks, int nhashes)
+{
+	KmerBloom *bloom = (KmerBloom *)palloc0(KMER_BLOOM_SIZE(nblocks));
+
+	SET_VARSIZE(bloom, KMER_BLOOM_SIZE(nblocks));
+	bloom->nhashes = nhashes;
+	bloom->nblocks = nblocks;
+
+	return bloom;
+}
+
+// Checks the shape of a filter read from outside
+static void
+kmer_bloom_check_shape(int64 nblocks, int nhashes, int sqlerrcode)
+{
+	if (nblocks <= 0 || nblocks > KMER_BLOOM_MAX_BLOCKS ||
+		nhashes <= 0 || nhashes > KMER_BLOOM_MAX_HASHES)
+		ereport(ERROR,
+				(errcode(sqlerrcode),
+				 errmsg("Invalid KMer Bloom filter of %lld blocks and %d hashes",
+						(long long)nblocks, nhashes)));
+}
+
+// Checks that two filters have the same size and hashes
+static void
+kmer_bloom_check_pair(const KmerBloom *a, const KmerBloom *b)
+{
+	if (a->nblocks != b->nblocks || a->nhashes != b->nhashes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Bloom filters of different sizes cannot be merged")));
+}
+
+// Block of a k-mer, picked by the high half of its hash
+static inline uint8 *
+kmer_bloom_block(const KmerBloom *bloom, uint64 hash)
+{
+	uint64 block = ((hash >> 32) * (uint64)bloom->nblocks) >> 32;
+
+	return (uint8 *)bloom->bytes + block * KMER_BLOOM_BLOCK_BYTES;
+}
+
+// Next bit of a k-mer within its block: the top 9 bits of the hash times
+// successive powers of an odd constant. Deriving each bit from a step of
+// the previous one would repeat patterns and raise the false positive rate.
+static inline int
+kmer_bloom_next_bit(uint64 *state)
+{
+	*state *= UINT64CONST(0x9E3779B97F4A7C15);
+	return (int)(*state >> 55);
+}
+
+// Adds a k-mer to a filter
+static void
+kmer_bloom_add(KmerBloom *bloom, KMER *kmer)
+{
+	uint64 hash = kmer_hash_bits(kmer_get_bits(kmer), kmer_get_length(kmer));
+	uint8 *block = kmer_bloom_block(bloom, hash);
+	uint64 state = hash | 1;
+	int i;
+
+	for (i = 0; i < bloom->nhashes; i++)
+	{
+		int bit = kmer_bloom_next_bit(&state);
+
+		block[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+// Checks whether a k-mer may have been added to a filter
+static bool
+kmer_bloom_test(const KmerBloom *bloom, KMER *kmer)
+{
+	uint64 hash = kmer_hash_bits(kmer_get_bits(kmer), kmer_get_length(kmer));
+	const uint8 *block = kmer_bloom_block(bloom, hash);
+	uint64 state = hash | 1;
+	int i;
+
+	for (i = 0; i < bloom->nhashes; i++)
+	{
+		int bit = kmer_bloom_next_bit(&state);
+
+		if ((block[bit >> 3] & (1 << (bit & 7))) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Expected false positive rate of a blocked filter holding capacity k-mers:
+// the number of k-mers in a block is Poisson distributed, and a block
+// holding i of them answers wrongly with the probability of a standard
+// filter of one block
+static double
+kmer_bloom_rate(double nblocks, int nhashes, double capacity)
+{
+	double lambda = capacity / nblocks;
+	int last = (int)(lambda + 20 * sqrt(lambda) + 20);
+	double rate = 0.0;
+	int i;
+
+	for (i = 0; i <= last; i++)
+	{
+		double p = exp(i * log(lambda) - lambda - lgamma(i + 1.0));
+		double filled = 1.0 - pow(1.0 - 1.0 / KMER_BLOOM_BLOCK_BITS, (double)i * nhashes);
+
+		rate += p * pow(filled, nhashes);
+	}
+
+	return rate;
+}
+
+// Size and hashes of a filter for capacity k-mers at the given false
+// positive rate. Starting from the size of a standard filter, the size
+// grows by 2% until the best number of hashes reaches the rate.
+static void
+kmer_bloom_size(int64 capacity, double rate, int64 *nblocks, int *nhashes)
+{
+	double ln2 = log(2.0);
+	double blocks = ceil(-(double)capacity * log(rate) / (ln2 * ln2) / KMER_BLOOM_BLOCK_BITS);
+
+	*nhashes = 1;
+	for (;;)
+	{
+		double best = 1.0;
+		int k;
+
+		if (blocks > KMER_BLOOM_MAX_BLOCKS)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("Bloom filter for %lld k-mers at rate %g is too large",
+							(long long)capacity, rate),
+					 errdetail("A filter holds at most %lld bits.",
+							   (long long)KMER_BLOOM_MAX_BLOCKS * KMER_BLOOM_BLOCK_BITS)));
+
+		for (k = 1; k <= KMER_BLOOM_MAX_HASHES; k++)
+		{
+			double r = kmer_bloom_rate(blocks, k, (double)capacity);
+
+			if (r < best)
+			{
+				best = r;
+				*nhashes = k;
+			}
+		}
+
+		if (best <= rate)
+			break;
+		blocks = ceil(blocks * 1.02);
+	}
+
+	*nblocks = (int64)blocks;
+}
+
+// ORs the bits of another filter into a filter
+static void
+kmer_bloom_merge(KmerBloom *bloom, const KmerBloom *other)
+{
+	Size n = KMER_BLOOM_SIZE(bloom->nblocks) - offsetof(KmerBloom, bytes);
+	Size i;
+
+	kmer_bloom_check_pair(bloom, other);
+
+	for (i = 0; i < n; i++)
+		bloom->bytes[i] |= other->bytes[i];
+}
+
+// Filter of an argument. A filter stored out of line is read once per
+// query and kept for the following calls with the same value, so probing
+// many k-mers against a stored filter does not detoast it every time.
+static KmerBloom *
+kmer_bloom_get_arg(FunctionCallInfo fcinfo, int argno)
+{
+	struct varlena *value = (struct varlena *)DatumGetPointer(PG_GETARG_DATUM(argno));
+	KmerBloomCache *cache = (KmerBloomCache *)fcinfo->flinfo->fn_extra;
+	struct varatt_external pointer;
+	MemoryContext oldcontext;
+
+	if (!VARATT_IS_EXTERNAL_ONDISK(value))
+		return DatumGetKmerBloomP(PointerGetDatum(value));
+
+	VARATT_EXTERNAL_GET_POINTER(pointer, value);
+
+	if (cache != NULL && cache->pointer.va_valueid == pointer.va_valueid &&
+		cache->pointer.va_toastrelid == pointer.va_toastrelid)
+		return cache->bloom;
+
+	if (cache == NULL)
+		cache = (KmerBloomCache *)MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+														 sizeof(KmerBloomCache));
+	else
+		pfree(cache->bloom);
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	cache->bloom = DatumGetKmerBloomP(PointerGetDatum(value));
+	MemoryContextSwitchTo(oldcontext);
+
+	fcinfo->flinfo->fn_extra = cache;
+	cache->pointer = pointer;
+
+	return cache->bloom;
+}
+
+/*****************************************************************************/
+
+/* Input and Output Functions */
+
+// Text form: k=<hashes>,b=<blocks>: then the bits in hexadecimal
+PG_FUNCTION_INFO_V1(kmer_bloom_in);
+Datum kmer_bloom_in(PG_FUNCTION_ARGS)
+{
+	char *input = PG_GETARG_CSTRING(0);
+	int nhashes;
+	long long nblocks;
+	int offset = -1;
+	KmerBloom *bloom;
+	Size bytes;
+
+	if (sscanf(input, "k=%d,b=%lld:%n", &nhashes, &nblocks, &offset) != 2 || offset < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("Invalid KMer Bloom filter"),
+				 errdetail("A filter starts with \"k=<hashes>,b=<blocks>:\".")));
+
+	kmer_bloom_check_shape(nblocks, nhashes, ERRCODE_INVALID_TEXT_REPRESENTATION);
+
+	bytes = KMER_BLOOM_SIZE(nblocks) - offsetof(KmerBloom, bytes);
+	if (strlen(input + offset) != 2 * bytes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("Invalid KMer Bloom filter"),
+				 errdetail("A filter of %lld blocks has %zu hexadecimal digits.", nblocks, 2 * bytes)));
+
+	bloom = kmer_bloom_create(nblocks, nhashes);
+	hex_decode(input + offset, 2 * bytes, (char *)bloom->bytes);
+
+	PG_RETURN_POINTER(bloom);
+}
+
+PG_FUNCTION_INFO_V1(kmer_bloom_out);
+Datum kmer_bloom_out(PG_FUNCTION_ARGS)
+{
+	KmerBloom *bloom = PG_GETARG_KMER_BLOOM_P(0);
+	Size bytes = KMER_BLOOM_SIZE(bloom->nblocks) - offsetof(KmerBloom, bytes);
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "k=%d,b=%lld:", bloom->nhashes, (long long)bloom->nblocks);
+	enlargeStringInfo(&buf, 2 * bytes);
+	buf.len += hex_encode((const char *)bloom->bytes, bytes, buf.data + buf.len);
+	buf.data[buf.len] = '\0';
+
+	PG_RETURN_CSTRING(buf.data);
+}
+
+// Binary form: the number of hashes and of blocks, then the bits
+PG_FUNCTION_INFO_V1(kmer_bloom_recv);
+Datum kmer_bloom_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	int nhashes = pq_getmsgint(buf, 4);
+	int64 nblocks = pq_getmsgint64(buf);
+	KmerBloom *bloom;
+	Size bytes;
+
+	kmer_bloom_check_shape(nblocks, nhashes, ERRCODE_INVALID_BINARY_REPRESENTATION);
+
+	bytes = KMER_BLOOM_SIZE(nblocks) - offsetof(KmerBloom, bytes);
+	if ((Size)(buf->len - buf->cursor) != bytes)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("Invalid binary KMer Bloom filter")));
+
+	bloom = kmer_bloom_create(nblocks, nhashes);
+	pq_copymsgbytes(buf, (char *)bloom->bytes, bytes);
+	pq_getmsgend(buf);
+
+	PG_RETURN_POINTER(bloom);
+}
+
+PG_FUNCTION_INFO_V1(kmer_bloom_send);
+Datum kmer_bloom_send(PG_FUNCTION_ARGS)
+{
+	KmerBloom *bloom = PG_GETARG_KMER_BLOOM_P(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, bloom->nhashes);
+	pq_sendint64(&buf, bloom->nblocks);
+	pq_sendbytes(&buf, (const char *)bloom->bytes,
+				 KMER_BLOOM_SIZE(bloom->nblocks) - offsetof(KmerBloom, bytes));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*****************************************************************************/
+
+/* Filter functions */
+
+// Membership test: true for every k-mer added to the filter, and for others
+// with about the false positive rate the filter was built for
+PG_FUNCTION_INFO_V1(kmer_bloom_within);
+Datum kmer_bloom_within(PG_FUNCTION_ARGS)
+{
+	KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KmerBloom *bloom = kmer_bloom_get_arg(fcinfo, 1);
+
+	PG_RETURN_BOOL(kmer_bloom_test(bloom, kmer));
+}
+
+// Filter of the k-mers added to either of two filters
+PG_FUNCTION_INFO_V1(kmer_bloom_union);
+Datum kmer_bloom_union(PG_FUNCTION_ARGS)
+{
+	KmerBloom *a = PG_GETARG_KMER_BLOOM_P(0);
+	KmerBloom *b = PG_GETARG_KMER_BLOOM_P(1);
+	KmerBloom *result = (KmerBloom *)palloc(VARSIZE(a));
+
+	memcpy(result, a, VARSIZE(a));
+	kmer_bloom_merge(result, b);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*****************************************************************************/
+
+/* Aggregate functions */
+
+// Transition function of kmer_bloom_agg. The capacity and rate of the first
+// row size the filter, which is built in the aggregate context and passed
+// as internal, so that the executor neither copies it nor keeps a second
+// filter of the same size; later rows update it in place.
+PG_FUNCTION_INFO_V1(kmer_bloom_transfn);
+Datum kmer_bloom_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	KmerBloom *bloom = PG_ARGISNULL(0) ? NULL : (KmerBloom *)PG_GETARG_POINTER(0);
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "kmer_bloom_transfn called in non-aggregate context");
+
+	if (bloom == NULL)
+	{
+		int64 capacity = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT64(2);
+		double rate = PG_NARGS() > 3 && !PG_ARGISNULL(3) ? PG_GETARG_FLOAT8(3) : 0.01;
+		int64 nblocks;
+		int nhashes;
+		MemoryContext oldcontext;
+
+		if (capacity <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("Bloom filter capacity must be positive")));
+		if (!(rate > 0.0 && rate < 1.0))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("Bloom filter false positive rate must be between 0 and 1")));
+
+		kmer_bloom_size(capacity, rate, &nblocks, &nhashes);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		bloom = kmer_bloom_create(nblocks, nhashes);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	// Rows with a null k-mer are ignored
+	if (!PG_ARGISNULL(1))
+		kmer_bloom_add(bloom, (KMER *)PG_GETARG_VARLENA_PP(1));
+
+	PG_RETURN_POINTER(bloom);
+}
+
+// Combine function of kmer_bloom_agg, ORing the filters of two workers
+PG_FUNCTION_INFO_V1(kmer_bloom_combinefn);
+Datum kmer_bloom_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	KmerBloom *bloom1 = PG_ARGISNULL(0) ? NULL : (KmerBloom *)PG_GETARG_POINTER(0);
+	KmerBloom *bloom2 = PG_ARGISNULL(1) ? NULL : (KmerBloom *)PG_GETARG_POINTER(1);
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "kmer_bloom_combinefn called in non-aggregate context");
+
+	if (bloom2 == NULL)
+	{
+		if (bloom1 == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(bloom1);
+	}
+
+	// The state has to live in the aggregate context, so the first filter is
+	// copied there
+	if (bloom1 == NULL)
+	{
+		bloom1 = (KmerBloom *)MemoryContextAlloc(aggcontext, VARSIZE(bloom2));
+		memcpy(bloom1, bloom2, VARSIZE(bloom2));
+		PG_RETURN_POINTER(bloom1);
+	}
+
+	kmer_bloom_merge(bloom1, bloom2);
+
+	PG_RETURN_POINTER(bloom1);
+}
+
+// Serialize function of kmer_bloom_agg: the filter is a varlena already
+PG_FUNCTION_INFO_V1(kmer_bloom_serialfn);
+Datum kmer_bloom_serialfn(PG_FUNCTION_ARGS)
+{
+	KmerBloom *bloom = (KmerBloom *)PG_GETARG_POINTER(0);
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "kmer_bloom_serialfn called in non-aggregate context");
+
+	PG_RETURN_BYTEA_P(bloom);
+}
+
+// Deserialize function of kmer_bloom_agg
+PG_FUNCTION_INFO_V1(kmer_bloom_deserialfn);
+Datum kmer_bloom_deserialfn(PG_FUNCTION_ARGS)
+{
+	KmerBloom *bloom = (KmerBloom *)PG_GETARG_BYTEA_P_COPY(0);
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "kmer_bloom_deserialfn called in non-aggregate context");
+
+	if (VARSIZE(bloom) < offsetof(KmerBloom, bytes))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("Invalid KMer Bloom filter")));
+	kmer_bloom_check_shape(bloom->nblocks, bloom->nhashes, ERRCODE_DATA_CORRUPTED);
+	if (VARSIZE(bloom) != KMER_BLOOM_SIZE(bloom->nblocks))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("Invalid KMer Bloom filter")));
+
+	PG_RETURN_POINTER(bloom);
+}
+
+// Final function of kmer_bloom_agg, returning the filter itself. It is
+// declared FINALFUNC_MODIFY = READ_WRITE so that the state is not updated
+// after being returned.
+PG_FUNCTION_INFO_V1(kmer_bloom_finalfn);
+Datum kmer_bloom_finalfn(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+}
+
+// Transition and combine function of kmer_bloom_union_agg. The executor
+// copies the first non-null filter to the aggregate context as it is,
+// possibly compressed; once detoasted and copied again, it is updated in
+// place.
+PG_FUNCTION_INFO_V1(kmer_bloom_union_transfn);
+Datum kmer_bloom_union_transfn(PG_FUNCTION_ARGS)
+{
+	KmerBloom *bloom = PG_GETARG_KMER_BLOOM_P(0);
+	KmerBloom *other = PG_GETARG_KMER_BLOOM_P(1);
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "kmer_bloom_union_transfn called in non-aggregate context");
+
+	kmer_bloom_merge(bloom, other);
+
+	PG_RETURN_POINTER(bloom);
+}
@@ -0,0 +1,155 @@
+/*
+ * kmer_btree.c
+ *
+ * Ordering operators, B-tree support and sort support for kmer. Packed
+ * k-mers order as their text form when compared as (bits, length), see
+ * kmer.h, so every comparison is an integer comparison.
+ *
+ * References:
+ * B-Tree Support Functions: https://www.postgresql.org/docs/current/btree-support-funcs.html
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "utils/sortsupport.h"
+
+/*****************************************************************************/
+
+// Helper function to compare two KMERs
+static inline int
+kmer_cmp_helper(KMER *kmer1, KMER *kmer2)
+{
+	return kmer_compare(kmer_get_bits(kmer1), kmer_get_length(kmer1),
+						kmer_get_bits(kmer2), kmer_get_length(kmer2));
+}
+
+/*****************************************************************************/
+
+/* Comparison functions */
+PG_FUNCTION_INFO_V1(kmer_cmp);
+Datum kmer_cmp(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_INT32(kmer_cmp_helper(kmer1, kmer2));
+}
+
+PG_FUNCTION_INFO_V1(kmer_lt);
+Datum kmer_lt(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_BOOL(kmer_cmp_helper(kmer1, kmer2) < 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_le);
+Datum kmer_le(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_BOOL(kmer_cmp_helper(kmer1, kmer2) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_gt);
+Datum kmer_gt(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_BOOL(kmer_cmp_helper(kmer1, kmer2) > 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_ge);
+Datum kmer_ge(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_BOOL(kmer_cmp_helper(kmer1, kmer2) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_ne);
+Datum kmer_ne(PG_FUNCTION_ARGS)
+{
+	KMER *kmer1 = (KMER *)PG_GETARG_VARLENA_PP(0);
+	KMER *kmer2 = (KMER *)PG_GETARG_VARLENA_PP(1);
+
+	PG_RETURN_BOOL(kmer_cmp_helper(kmer1, kmer2) != 0);
+}
+
+/*****************************************************************************/
+
+/* Sort support */
+
+// Full comparator on the packed values
+static int
+kmer_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+	KMER *kmer1 = (KMER *)PG_DETOAST_DATUM_PACKED(x);
+	KMER *kmer2 = (KMER *)PG_DETOAST_DATUM_PACKED(y);
+	int result = kmer_cmp_helper(kmer1, kmer2);
+
+	if ((Pointer)kmer1 != DatumGetPointer(x))
+		pfree(kmer1);
+	if ((Pointer)kmer2 != DatumGetPointer(y))
+		pfree(kmer2);
+
+	return result;
+}
+
+// The abbreviated key is the packed bases themselves (their leading half
+// where a Datum is 4 bytes), compared as an unsigned integer
+static Datum
+kmer_abbrev_convert(Datum original, SortSupport ssup)
+{
+	KMER *kmer = (KMER *)PG_DETOAST_DATUM_PACKED(original);
+	uint64 bits = kmer_get_bits(kmer);
+
+	if ((Pointer)kmer != DatumGetPointer(original))
+		pfree(kmer);
+
+#if SIZEOF_DATUM == 8
+	return (Datum)bits;
+#else
+	return (Datum)(bits >> 32);
+#endif
+}
+
+static int
+kmer_cmp_abbrev(Datum x, Datum y, SortSupport ssup)
+{
+	if (x < y)
+		return -1;
+	if (x > y)
+		return 1;
+	return 0;
+}
+
+// Abbreviated keys only tie on k-mers sharing all their bases (or the first
+// 16 where a Datum is 4 bytes), so abbreviation is never abandoned
+static bool
+kmer_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+	return false;
+}
+
+PG_FUNCTION_INFO_V1(kmer_sortsupport);
+Datum kmer_sortsupport(PG_FUNCTION_ARGS)
+{
+	SortSupport ssup = (SortSupport)PG_GETARG_POINTER(0);
+
+	ssup->comparator = kmer_fastcmp;
+
+	if (ssup->abbreviate)
+	{
+		ssup->abbrev_full_comparator = kmer_fastcmp;
+		ssup->comparator = kmer_cmp_abbrev;
+		ssup->abbrev_converter = kmer_abbrev_convert;
+		ssup->abbrev_abort = kmer_abbrev_abort;
+	}
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,442 @@
+/*
+ * kmer_fasta.c
+ *
+ * Server-side FASTA and FASTQ readers. read_fasta(path) and read_fastq(path)
+ * return one row per record and are meant for INSERT ... SELECT, so that a
+ * read file is loaded without converting it to SQL first. The file is read
+ * in large blocks and parsed a record at a time, so only the current record
+ * is held in memory, and the sequence lines of a record are parsed straight
+ * into a dna value. Gzip-compressed files are read transparently when the
+ * server is built with zlib.
+ *
+ * Reading server files needs the privileges of pg_read_server_files, as for
+ * COPY FROM a file.
+ *
+ * References:
+ * Returning Sets: https://www.postgresql.org/docs/current/xfunc-c.html#XFUNC-C-RETURN-SET
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/htup_details.h"
+#include "catalog/pg_authid.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/*****************************************************************************/
+
+// Bytes read from the file at a time
+#define SEQ_FILE_BLOCK_SIZE (1024 * 1024)
+
+// An open sequence file and its read buffer
+typedef struct SeqFile
+{
+	char *path;
+#ifdef HAVE_LIBZ
+	gzFile file;
+#else
+	FILE *file;
+#endif
+	char *buffer;
+	int pos;
+	int len;
+	bool eof;
+	int64 lineno;			  // lines read so far
+	StringInfoData line;	  // header line of the next record, once read
+	bool pending;			  // line holds the next header
+	MemoryContextCallback cleanup;
+} SeqFile;
+
+// Record being parsed, for error messages
+typedef struct SeqRecordContext
+{
+	SeqFile *file;
+	int64 lineno;
+} SeqRecordContext;
+
+/*****************************************************************************/
+
+/* File helper functions */
+
+// Closes a sequence file, also when the query ends early or fails
+static void
+seq_file_close(void *arg)
+{
+	SeqFile *file = (SeqFile *)arg;
+
+	if (file->file == NULL)
+		return;
+
+#ifdef HAVE_LIBZ
+	gzclose(file->file);
+#else
+	fclose(file->file);
+#endif
+	file->file = NULL;
+	ReleaseExternalFD();
+}
+
+// Opens a sequence file, checking that the user may read server files
+static SeqFile *
+seq_file_open(text *path, MemoryContext context)
+{
+	SeqFile *file;
+	MemoryContext oldcontext;
+
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to read sequence file"),
+				 errdetail("Only roles with privileges of the \"%s\" role may read server files.",
+						   "pg_read_server_files")));
+
+	oldcontext = MemoryContextSwitchTo(context);
+
+	file = (SeqFile *)palloc0(sizeof(SeqFile));
+	file->path = text_to_cstring(path);
+	file->buffer = (char *)palloc(SEQ_FILE_BLOCK_SIZE);
+	initStringInfo(&file->line);
+
+	/* The descriptor is not one of fd.c's, so account for it */
+	if (!AcquireExternalFD())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not open file \"%s\": too many open files", file->path)));
+
+#ifdef HAVE_LIBZ
+	/* gzread passes uncompressed files through unchanged */
+	file->file = gzopen(file->path, "rb");
+	if (file->file != NULL)
+		gzbuffer(file->file, SEQ_FILE_BLOCK_SIZE);
+#else
+	file->file = fopen(file->path, PG_BINARY_R);
+#endif
+	if (file->file == NULL)
+	{
+		int save_errno = errno;
+
+		ReleaseExternalFD();
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", file->path)));
+	}
+
+	file->cleanup.func = seq_file_close;
+	file->cleanup.arg = file;
+	MemoryContextRegisterResetCallback(context, &file->cleanup);
+
+	MemoryContextSwitchTo(oldcontext);
+	return file;
+}
+
+// Refills the read buffer, setting eof at the end of the file
+static void
+seq_file_fill(SeqFile *file)
+{
+#ifdef HAVE_LIBZ
+	int nread = gzread(file->file, file->buffer, SEQ_FILE_BLOCK_SIZE);
+
+	if (nread < 0)
+	{
+		int errnum;
+		const char *message = gzerror(file->file, &errnum);
+
+		if (errnum == Z_ERRNO)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", file->path)));
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not decompress file \"%s\": %s", file->path, message)));
+	}
+#else
+	int nread = fread(file->buffer, 1, SEQ_FILE_BLOCK_SIZE, file->file);
+
+	if (nread == 0 && ferror(file->file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", file->path)));
+#endif
+
+	file->pos = 0;
+	file->len = nread;
+	file->eof = nread == 0;
+}
+
+// Appends the next line, without its line break, to out. Returns false at
+// the end of the file.
+static bool
+seq_file_read_line(SeqFile *file, StringInfo out)
+{
+	bool any = false;
+
+	for (;;)
+	{
+		char *start, *newline;
+		int count;
+
+		if (file->pos == file->len)
+		{
+			seq_file_fill(file);
+			if (file->eof)
+				break;
+		}
+
+		start = file->buffer + file->pos;
+		newline = memchr(start, '\n', file->len - file->pos);
+		count = newline ? newline - start : file->len - file->pos;
+
+		appendBinaryStringInfo(out, start, count);
+		file->pos += count;
+		any = true;
+
+		if (newline)
+		{
+			file->pos++;
+			break;
+		}
+	}
+
+	if (!any)
+		return false;
+
+	if (out->len > 0 && out->data[out->len - 1] == '\r')
+		out->data[--out->len] = '\0';
+	file->lineno++;
+	return true;
+}
+
+// Reads the next line that is not empty into the header line, unless it
+// already holds the next header. Returns false at the end of the file.
+static bool
+seq_file_next_header(SeqFile *file)
+{
+	if (file->pending)
+	{
+		file->pending = false;
+		return true;
+	}
+
+	do
+	{
+		resetStringInfo(&file->line);
+		if (!seq_file_read_line(file, &file->line))
+			return false;
+	} while (file->line.len == 0);
+
+	return true;
+}
+
+// Reads sequence lines into sequence up to a line starting with any of the
+// stop characters, which is kept as the next header, or the end of the file
+static void
+seq_file_read_sequence(SeqFile *file, StringInfo sequence, const char *stop)
+{
+	for (;;)
+	{
+		int start = sequence->len;
+
+		if (!seq_file_read_line(file, sequence))
+			return;
+
+		if (sequence->len > start && strchr(stop, sequence->data[start]) != NULL)
+		{
+			resetStringInfo(&file->line);
+			appendBinaryStringInfo(&file->line, sequence->data + start, sequence->len - start);
+			sequence->len = start;
+			sequence->data[start] = '\0';
+			file->pending = true;
+			return;
+		}
+	}
+}
+
+// Error context of a record
+static void
+seq_record_error_callback(void *arg)
+{
+	SeqRecordContext *record = (SeqRecordContext *)arg;
+
+	errcontext("record starting at line " INT64_FORMAT " of file \"%s\"",
+			   record->lineno, record->file->path);
+}
+
+// Splits a header line into its identifier and its description
+static void
+seq_header_values(const char *header, Datum *values, bool *nulls)
+{
+	const char *space = header + strcspn(header, " \t");
+	const char *description = space + strspn(space, " \t");
+
+	values[0] = PointerGetDatum(cstring_to_text_with_len(header, space - header));
+	nulls[0] = false;
+	values[1] = PointerGetDatum(cstring_to_text(description));
+	nulls[1] = *description == '\0';
+}
+
+// Sets up a sequence file for the calls of a set-returning function
+static void
+seq_file_first_call(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx = SRF_FIRSTCALL_INIT();
+	MemoryContext oldcontext;
+	TupleDesc tupdesc;
+
+	oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context that cannot accept type record")));
+	funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	funcctx->user_fctx = seq_file_open(PG_GETARG_TEXT_PP(0), funcctx->multi_call_memory_ctx);
+}
+
+/*****************************************************************************/
+
+/* Reader functions */
+// Returns the records of a FASTA file as (id, description, sequence). Lines
+// starting with ';' are comments.
+PG_FUNCTION_INFO_V1(read_fasta);
+Datum read_fasta(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	SeqFile *file;
+	SeqRecordContext record;
+	ErrorContextCallback errcallback;
+	StringInfoData sequence;
+	Datum values[3];
+	bool nulls[3];
+
+	if (SRF_IS_FIRSTCALL())
+		seq_file_first_call(fcinfo);
+
+	funcctx = SRF_PERCALL_SETUP();
+	file = (SeqFile *)funcctx->user_fctx;
+
+	/* Skip comments before the header */
+	do
+	{
+		if (!seq_file_next_header(file))
+		{
+			seq_file_close(file);
+			SRF_RETURN_DONE(funcctx);
+		}
+	} while (file->line.data[0] == ';');
+
+	record.file = file;
+	record.lineno = file->lineno;
+	errcallback.callback = seq_record_error_callback;
+	errcallback.arg = &record;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+
+	if (file->line.data[0] != '>')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid FASTA record"),
+				 errdetail("A record must start with a line starting with \">\".")));
+
+	seq_header_values(file->line.data + 1, values, nulls);
+
+	/* Comment lines end the sequence like a header; drop them */
+	initStringInfo(&sequence);
+	for (;;)
+	{
+		seq_file_read_sequence(file, &sequence, ">;");
+		if (!file->pending || file->line.data[0] != ';')
+			break;
+		file->pending = false;
+	}
+
+	values[2] = PointerGetDatum(dna_from_text(sequence.data));
+	nulls[2] = false;
+	pfree(sequence.data);
+
+	error_context_stack = errcallback.previous;
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+}
+
+// Returns the records of a FASTQ file as (id, description, sequence,
+// quality). Sequence and quality may span several lines.
+PG_FUNCTION_INFO_V1(read_fastq);
+Datum read_fastq(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	SeqFile *file;
+	SeqRecordContext record;
+	ErrorContextCallback errcallback;
+	StringInfoData sequence;
+	StringInfoData quality;
+	Datum values[4];
+	bool nulls[4];
+
+	if (SRF_IS_FIRSTCALL())
+		seq_file_first_call(fcinfo);
+
+	funcctx = SRF_PERCALL_SETUP();
+	file = (SeqFile *)funcctx->user_fctx;
+
+	if (!seq_file_next_header(file))
+	{
+		seq_file_close(file);
+		SRF_RETURN_DONE(funcctx);
+	}
+
+	record.file = file;
+	record.lineno = file->lineno;
+	errcallback.callback = seq_record_error_callback;
+	errcallback.arg = &record;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+
+	if (file->line.data[0] != '@')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid FASTQ record"),
+				 errdetail("A record must start with a line starting with \"@\".")));
+
+	seq_header_values(file->line.data + 1, values, nulls);
+
+	initStringInfo(&sequence);
+	seq_file_read_sequence(file, &sequence, "+");
+	if (!file->pending)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid FASTQ record"),
+				 errdetail("The sequence is not followed by a \"+\" line.")));
+	file->pending = false;
+
+	/* Quality lines may start with '@' or '+', so they are counted instead */
+	initStringInfo(&quality);
+	while (quality.len < sequence.len && seq_file_read_line(file, &quality))
+		;
+	if (quality.len != sequence.len)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid FASTQ record"),
+				 errdetail("The sequence has %d bases but the quality has %d scores.",
+						   sequence.len, quality.len)));
+
+	values[2] = PointerGetDatum(dna_from_text(sequence.data));
+	nulls[2] = false;
+	values[3] = PointerGetDatum(cstring_to_text_with_len(quality.data, quality.len));
+	nulls[3] = false;
+	pfree(sequence.data);
+	pfree(quality.data);
+
+	error_context_stack = errcallback.previous;
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+}
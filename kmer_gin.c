@@ -0,0 +1,420 @@
+/*
+ * kmer_gin.c
+ *
+ * GIN operator class for dna, answering dna @> kmer and dna ~ qkmer. The
+ * keys of a sequence are its k-mers for the k given as the opclass option,
+ * so a search intersects the posting lists of the k-mers of the pattern and
+ * rechecks the candidates with a substring search.
+ *
+ * Keys are int8: the packed bases followed by a 1 bit, so that the lowest
+ * set bit gives the length. Besides the k-mers, every stretch of the
+ * sequence between N runs that is shorter than k is a key of its own, which
+ * lets patterns shorter than k be answered by matching them against every
+ * key, with no sequence left out.
+ *
+ * References:
+ * GIN Extensibility: https://www.postgresql.org/docs/current/gin-extensibility.html
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "access/gin.h"
+#include "access/reloptions.h"
+#include "access/stratnum.h"
+
+/*****************************************************************************/
+
+// Strategies of dna @> kmer and dna ~ qkmer
+#define DnaContainsStrategyNumber RTContainsStrategyNumber
+#define DnaMatchesStrategyNumber 8
+
+// Length of the indexed k-mers: one bit past the bases must fit in a key
+#define DNA_GIN_DEFAULT_K 8
+#define DNA_GIN_MAX_K (MAX_KMER_LENGTH - 1)
+
+// Longest k-mers deduplicated with a bitmap of all 4^k k-mers (2MB)
+#define DNA_GIN_BITMAP_MAX_K 12
+
+typedef struct DnaGinOptions
+{
+	int32 vl_len_; // varlena header (do not touch directly!)
+	int k;
+} DnaGinOptions;
+
+// Set of the k-mers of a sequence, for k-mers too long for a bitmap
+typedef struct DnaGinKmer
+{
+	uint64 bits;
+	char status;
+} DnaGinKmer;
+
+#define SH_PREFIX dnaginkmer
+#define SH_ELEMENT_TYPE DnaGinKmer
+#define SH_KEY_TYPE uint64
+#define SH_KEY bits
+#define SH_HASH_KEY(tb, key) ((uint32)kmer_hash_bits(key, 0))
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+// Keys of a sequence, grown as needed
+typedef struct DnaGinKeys
+{
+	Datum *entries;
+	int n;
+	int max;
+} DnaGinKeys;
+
+// Pattern of a search, kept as the extra data of its partial match key
+typedef struct DnaGinPattern
+{
+	int length;
+	uint64 mask[2];
+} DnaGinPattern;
+
+/*****************************************************************************/
+
+/* GIN helper functions */
+
+// Length of the indexed k-mers, from the opclass options
+static inline int
+dna_gin_k(FunctionCallInfo fcinfo)
+{
+	if (PG_HAS_OPCLASS_OPTIONS())
+		return ((DnaGinOptions *)PG_GET_OPCLASS_OPTIONS())->k;
+
+	return DNA_GIN_DEFAULT_K;
+}
+
+// Key for len bases
+static inline Datum
+dna_gin_key(uint64 bits, int len)
+{
+	return Int64GetDatum((int64)(bits | (UINT64CONST(1) << (63 - 2 * len))));
+}
+
+// Bases and length of a key
+static inline uint64
+dna_gin_key_bits(Datum key, int *len)
+{
+	uint64 value = (uint64)DatumGetInt64(key);
+	int end = pg_rightmost_one_pos64(value);
+
+	*len = (63 - end) >> 1;
+	return value & ~(UINT64CONST(1) << end);
+}
+
+// Checks whether a pattern occurs anywhere in the bases of a key
+static inline bool
+dna_gin_key_matches(const DnaGinPattern *pattern, uint64 bits, int len)
+{
+	int offset;
+
+	for (offset = 0; offset + pattern->length <= len; offset++)
+	{
+		if (qkmer_match_prefix(pattern->mask, bits << (2 * offset), pattern->length))
+			return true;
+	}
+
+	return false;
+}
+
+// Packs the bases of a stretch of a DNA value without N
+static uint64
+dna_gin_stretch_bits(DnaReader *reader, int start, int len)
+{
+	char bases[MAX_KMER_LENGTH];
+	uint64 bits = 0;
+	int i;
+
+	dna_reader_read(reader, start, len, bases);
+	for (i = 0; i < len; i++)
+		bits |= nucleotide_code(bases[i]) << (62 - 2 * i);
+
+	return bits;
+}
+
+// Appends a key
+static inline void
+dna_gin_keys_add(DnaGinKeys *keys, Datum key)
+{
+	if (keys->n == keys->max)
+	{
+		keys->max *= 2;
+		keys->entries = (Datum *)repalloc_huge(keys->entries, sizeof(Datum) * keys->max);
+	}
+	keys->entries[keys->n++] = key;
+}
+
+// Adds the distinct k-mers of a sequence, marked in a bitmap of all 4^k
+// k-mers and read back in order
+static void
+dna_gin_keys_add_bitmap(DnaGinKeys *keys, DnaKmerIterator *iter, int k)
+{
+	Size nwords = Max(((Size)1 << (2 * k)) / 64, 1);
+	uint64 *bitmap = (uint64 *)palloc0(sizeof(uint64) * nwords);
+	uint64 bits;
+	int start;
+
+	while (dna_kmers_next(iter, &bits, &start))
+	{
+		uint64 value = bits >> (64 - 2 * k);
+
+		bitmap[value >> 6] |= UINT64CONST(1) << (value & 63);
+	}
+
+	for (Size i = 0; i < nwords; i++)
+	{
+		uint64 word = bitmap[i];
+
+		while (word != 0)
+		{
+			uint64 value = i * 64 + pg_rightmost_one_pos64(word);
+
+			dna_gin_keys_add(keys, dna_gin_key(value << (64 - 2 * k), k));
+			word &= word - 1;
+		}
+	}
+
+	pfree(bitmap);
+}
+
+// Adds the distinct k-mers of a sequence, through a hash set
+static void
+dna_gin_keys_add_set(DnaGinKeys *keys, DnaKmerIterator *iter, int k, int windows)
+{
+	dnaginkmer_hash *set = dnaginkmer_create(CurrentMemoryContext, Min(windows, 1024), NULL);
+	uint64 bits;
+	int start;
+
+	while (dna_kmers_next(iter, &bits, &start))
+	{
+		bool found;
+
+		dnaginkmer_insert(set, bits, &found);
+		if (!found)
+			dna_gin_keys_add(keys, dna_gin_key(bits, k));
+	}
+
+	dnaginkmer_destroy(set);
+}
+
+/*****************************************************************************/
+
+/* GIN support functions */
+// Declares the k opclass option
+PG_FUNCTION_INFO_V1(dna_gin_options);
+Datum dna_gin_options(PG_FUNCTION_ARGS)
+{
+	local_relopts *relopts = (local_relopts *)PG_GETARG_POINTER(0);
+
+	init_local_reloptions(relopts, sizeof(DnaGinOptions));
+	add_local_int_reloption(relopts, "k", "length of the indexed k-mers",
+							DNA_GIN_DEFAULT_K, 1, DNA_GIN_MAX_K,
+							offsetof(DnaGinOptions, k));
+
+	PG_RETURN_VOID();
+}
+
+// Keys of a sequence: its distinct k-mers and its stretches between N runs
+// that are shorter than k. The k-mers are deduplicated here rather than by
+// GIN, so that a long sequence yields at most 4^k keys instead of one per
+// position: through a bitmap of all k-mers when it is no larger than the
+// keys of every position would be, and through a hash set otherwise.
+PG_FUNCTION_INFO_V1(dna_gin_extract_value);
+Datum dna_gin_extract_value(PG_FUNCTION_ARGS)
+{
+	int32 *nentries = (int32 *)PG_GETARG_POINTER(1);
+	int k = dna_gin_k(fcinfo);
+	DnaKmerIterator iter;
+	DnaGinKeys keys;
+	int stretchStart = 0;
+	int windows;
+	int i;
+
+	dna_kmers_init(&iter, PG_GETARG_DATUM(0), k);
+	windows = Max(iter.reader.length - k + 1, 0);
+
+	keys.max = iter.reader.nruns + 1 + Min(windows, 1024);
+	keys.entries = (Datum *)palloc(sizeof(Datum) * keys.max);
+	keys.n = 0;
+
+	for (i = 0; i <= iter.reader.nruns; i++)
+	{
+		int stretchEnd = i < iter.reader.nruns ? (int)iter.reader.runs[i].start : iter.reader.length;
+		int len = stretchEnd - stretchStart;
+
+		if (len > 0 && len < k)
+			dna_gin_keys_add(&keys, dna_gin_key(dna_gin_stretch_bits(&iter.reader, stretchStart, len), len));
+
+		if (i < iter.reader.nruns)
+			stretchStart = iter.reader.runs[i].start + iter.reader.runs[i].length;
+	}
+
+	if (k <= DNA_GIN_BITMAP_MAX_K && ((Size)1 << (2 * k)) / 8 <= (Size)windows * sizeof(Datum))
+		dna_gin_keys_add_bitmap(&keys, &iter, k);
+	else if (windows > 0)
+		dna_gin_keys_add_set(&keys, &iter, k, windows);
+
+	*nentries = keys.n;
+	PG_RETURN_POINTER(keys.entries);
+}
+
+// Keys of a search. A pattern of k bases or more needs the keys of its
+// windows with no ambiguous base; with none of them, the most selective
+// window is matched against every key instead. A pattern shorter than k is
+// matched against every key.
+PG_FUNCTION_INFO_V1(dna_gin_extract_query);
+Datum dna_gin_extract_query(PG_FUNCTION_ARGS)
+{
+	int32 *nentries = (int32 *)PG_GETARG_POINTER(1);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+	bool **pmatch = (bool **)PG_GETARG_POINTER(3);
+	Pointer **extra_data = (Pointer **)PG_GETARG_POINTER(4);
+	int32 *searchMode = (int32 *)PG_GETARG_POINTER(6);
+	int k = dna_gin_k(fcinfo);
+	DnaGinPattern *pattern = (DnaGinPattern *)palloc(sizeof(DnaGinPattern));
+	Datum *entries;
+	uint64 best[2] = {0, 0};
+	uint64 bestChoices = PG_UINT64_MAX;
+	int i, j;
+
+	switch (strategy)
+	{
+	case DnaContainsStrategyNumber:
+	{
+		KMER *kmer = (KMER *)PG_GETARG_VARLENA_PP(0);
+
+		pattern->length = kmer_get_length(kmer);
+		kmer_get_mask(kmer_get_bits(kmer), pattern->mask);
+		break;
+	}
+	case DnaMatchesStrategyNumber:
+	{
+		QKMER *qkmer = (QKMER *)PG_GETARG_VARLENA_PP(0);
+
+		pattern->length = qkmer_get_length(qkmer);
+		qkmer_get_mask(qkmer, pattern->mask);
+		break;
+	}
+	default:
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+		break;
+	}
+
+	*nentries = 0;
+	entries = (Datum *)palloc(sizeof(Datum) * Max(pattern->length - k + 1, 1));
+
+	if (pattern->length >= k)
+	{
+		for (i = 0; i + k <= pattern->length; i++)
+		{
+			uint64 window[2] = {0, 0};
+			uint64 bits = 0;
+			uint64 choices = 1;
+
+			/* Bases the window allows; at most 4^31, which fits */
+			for (j = 0; j < k; j++)
+			{
+				int nibble = qkmer_mask_at(pattern->mask, i + j);
+
+				choices *= pg_popcount32(nibble);
+				bits |= (uint64)pg_rightmost_one_pos32(nibble) << (62 - 2 * j);
+				window[j >> 4] |= (uint64)nibble << (60 - 4 * (j & 15));
+			}
+
+			if (choices == 1)
+				entries[(*nentries)++] = dna_gin_key(bits, k);
+			else if (choices < bestChoices)
+			{
+				bestChoices = choices;
+				best[0] = window[0];
+				best[1] = window[1];
+			}
+		}
+
+		if (*nentries > 0)
+			PG_RETURN_POINTER(entries);
+
+		/* A window of N alone says nothing, every sequence is a candidate */
+		if (bestChoices == UINT64CONST(1) << (2 * k))
+		{
+			*searchMode = GIN_SEARCH_MODE_ALL;
+			PG_RETURN_POINTER(entries);
+		}
+
+		/* Match the keys against the most selective window */
+		pattern->mask[0] = best[0];
+		pattern->mask[1] = best[1];
+		pattern->length = k;
+	}
+	else if (pattern->length == 0)
+	{
+		/* Every sequence contains the empty pattern */
+		*searchMode = GIN_SEARCH_MODE_ALL;
+		PG_RETURN_POINTER(entries);
+	}
+
+	/* One partial match key, starting from the least key */
+	entries[0] = Int64GetDatum(PG_INT64_MIN);
+	*nentries = 1;
+	*pmatch = (bool *)palloc(sizeof(bool));
+	(*pmatch)[0] = true;
+	*extra_data = (Pointer *)palloc(sizeof(Pointer));
+	(*extra_data)[0] = (Pointer)pattern;
+
+	PG_RETURN_POINTER(entries);
+}
+
+// Compares a key with the partial match key: 0 when the pattern occurs in
+// the key, -1 to go on to the next key. Matching keys are not contiguous,
+// so every key is visited.
+PG_FUNCTION_INFO_V1(dna_gin_compare_partial);
+Datum dna_gin_compare_partial(PG_FUNCTION_ARGS)
+{
+	Datum key = PG_GETARG_DATUM(1);
+	DnaGinPattern *pattern = (DnaGinPattern *)PG_GETARG_POINTER(3);
+	uint64 bits;
+	int len;
+
+	bits = dna_gin_key_bits(key, &len);
+	PG_RETURN_INT32(dna_gin_key_matches(pattern, bits, len) ? 0 : -1);
+}
+
+// A sequence can match only if it has every key of the search. Keys only
+// say that the pattern may occur, so matches are always rechecked.
+PG_FUNCTION_INFO_V1(dna_gin_consistent);
+Datum dna_gin_consistent(PG_FUNCTION_ARGS)
+{
+	bool *check = (bool *)PG_GETARG_POINTER(0);
+	int32 nkeys = PG_GETARG_INT32(3);
+	bool *recheck = (bool *)PG_GETARG_POINTER(5);
+	int i;
+
+	*recheck = true;
+	for (i = 0; i < nkeys; i++)
+	{
+		if (!check[i])
+			PG_RETURN_BOOL(false);
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_triconsistent);
+Datum dna_gin_triconsistent(PG_FUNCTION_ARGS)
+{
+	GinTernaryValue *check = (GinTernaryValue *)PG_GETARG_POINTER(0);
+	int32 nkeys = PG_GETARG_INT32(3);
+	int i;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		if (check[i] == GIN_FALSE)
+			PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+	}
+
+	PG_RETURN_GIN_TERNARY_VALUE(GIN_MAYBE);
+}
@@ -0,0 +1,386 @@
+/*
+ * kmer_scan.c
+ *
+ * Multi-pattern scan of DNA sequences. find_kmers(dna, kmer[]) reports
+ * every occurrence of every pattern of the array in one pass over the
+ * sequence, instead of one strpos pass per pattern; find_kmers(dna, qkmer[])
+ * does the same for IUPAC patterns such as degenerate primers.
+ *
+ * The patterns are compiled into an Aho-Corasick automaton: a trie of the
+ * patterns whose missing transitions are filled in from the failure links,
+ * so that each base costs one table lookup whatever the number of patterns.
+ * A qkmer is inserted as all the k-mers it matches, sharing their prefixes
+ * in the trie. The automaton is built once per query and kept in fn_extra
+ * while the pattern array stays the same.
+ *
+ * As for strpos and @>, occurrences never overlap an N run, and empty
+ * patterns are not reported.
+ *
+ * References:
+ * A. V. Aho, M. J. Corasick, Efficient string matching: an aid to
+ * bibliographic search: https://doi.org/10.1145/360825.360855
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/tuplestore.h"
+
+/*****************************************************************************/
+
+// States of an automaton at most, bounding the expansion of IUPAC patterns
+#define KMER_SCAN_MAX_STATES (1 << 20)
+
+// Bases read from the sequence at a time
+#define KMER_SCAN_CHUNK 65536
+
+typedef struct KmerScanState
+{
+	int32 next[4];			  // transition by 2-bit code
+	int32 fail;				  // longest proper suffix that is in the trie
+	int32 output;			  // first pattern ending here, or -1
+	int32 dict;				  // next state on the fail chain with an output, or -1
+} KmerScanState;
+
+// A pattern ending at a state, chained with the others ending there
+typedef struct KmerScanOutput
+{
+	int32 pattern;			  // subscript in the pattern array
+	int32 length;
+	int32 next;
+} KmerScanOutput;
+
+typedef struct KmerScanAutomaton
+{
+	KmerScanState *states;
+	int nstates;
+	int maxstates;
+	KmerScanOutput *outputs;
+	int noutputs;
+	int maxoutputs;
+	ArrayType *patterns;	  // copy of the array it was built from
+} KmerScanAutomaton;
+
+/*****************************************************************************/
+
+/* Automaton helper functions */
+
+// Appends a state without transitions
+static int32
+kmer_scan_add_state(KmerScanAutomaton *automaton)
+{
+	KmerScanState *state;
+
+	if (automaton->nstates == KMER_SCAN_MAX_STATES)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("Pattern set too large, over %d states", KMER_SCAN_MAX_STATES),
+				 errhint("Patterns with many ambiguous positions match too many k-mers.")));
+
+	if (automaton->nstates == automaton->maxstates)
+	{
+		automaton->maxstates *= 2;
+		automaton->states = (KmerScanState *)repalloc(automaton->states,
+													   sizeof(KmerScanState) * automaton->maxstates);
+	}
+
+	state = &automaton->states[automaton->nstates];
+	state->next[0] = state->next[1] = state->next[2] = state->next[3] = -1;
+	state->fail = 0;
+	state->output = -1;
+	state->dict = -1;
+
+	return automaton->nstates++;
+}
+
+// Inserts a pattern of len positions given as qkmer masks. The set of
+// states reached so far is advanced position by position along every
+// nucleotide the position matches.
+static void
+kmer_scan_insert(KmerScanAutomaton *automaton, const uint64 mask[2], int len, int32 pattern)
+{
+	int32 *frontier = (int32 *)palloc(sizeof(int32));
+	int nfrontier = 1;
+	int i, j, c;
+
+	frontier[0] = 0;
+
+	for (i = 0; i < len && nfrontier > 0; i++)
+	{
+		int nibble = qkmer_mask_at(mask, i);
+		int32 *reached = (int32 *)palloc(sizeof(int32) * (nfrontier * pg_popcount32(nibble) + 1));
+		int nreached = 0;
+
+		for (j = 0; j < nfrontier; j++)
+		{
+			for (c = 0; c < 4; c++)
+			{
+				if (!(nibble & (1 << c)))
+					continue;
+
+				if (automaton->states[frontier[j]].next[c] < 0)
+				{
+					int32 child = kmer_scan_add_state(automaton);
+
+					automaton->states[frontier[j]].next[c] = child;
+				}
+				reached[nreached++] = automaton->states[frontier[j]].next[c];
+			}
+		}
+
+		pfree(frontier);
+		frontier = reached;
+		nfrontier = nreached;
+	}
+
+	for (j = 0; j < nfrontier; j++)
+	{
+		KmerScanOutput *output;
+
+		if (automaton->noutputs == automaton->maxoutputs)
+		{
+			automaton->maxoutputs *= 2;
+			automaton->outputs = (KmerScanOutput *)repalloc(automaton->outputs,
+															sizeof(KmerScanOutput) * automaton->maxoutputs);
+		}
+
+		output = &automaton->outputs[automaton->noutputs];
+		output->pattern = pattern;
+		output->length = len;
+		output->next = automaton->states[frontier[j]].output;
+		automaton->states[frontier[j]].output = automaton->noutputs++;
+	}
+
+	pfree(frontier);
+}
+
+// Sets the failure and dictionary links breadth first, and fills in the
+// missing transitions so that the scan never follows a failure link
+static void
+kmer_scan_link(KmerScanAutomaton *automaton)
+{
+	KmerScanState *states = automaton->states;
+	int32 *queue = (int32 *)palloc(sizeof(int32) * automaton->nstates);
+	int head = 0;
+	int tail = 0;
+	int c;
+
+	for (c = 0; c < 4; c++)
+	{
+		if (states[0].next[c] < 0)
+			states[0].next[c] = 0;
+		else
+		{
+			states[states[0].next[c]].fail = 0;
+			queue[tail++] = states[0].next[c];
+		}
+	}
+
+	while (head < tail)
+	{
+		int32 state = queue[head++];
+		int32 fail = states[state].fail;
+
+		states[state].dict = states[fail].output >= 0 ? fail : states[fail].dict;
+
+		for (c = 0; c < 4; c++)
+		{
+			int32 child = states[state].next[c];
+
+			if (child < 0)
+				states[state].next[c] = states[fail].next[c];
+			else
+			{
+				states[child].fail = states[fail].next[c];
+				queue[tail++] = child;
+			}
+		}
+	}
+
+	pfree(queue);
+}
+
+// Automaton of a pattern array, from fn_extra while the array is the same
+static KmerScanAutomaton *
+kmer_scan_get_automaton(FunctionCallInfo fcinfo, ArrayType *patterns, bool isQkmer)
+{
+	KmerScanAutomaton *automaton = (KmerScanAutomaton *)fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	Datum *elems;
+	bool *nulls;
+	int nelems;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	int lbound;
+	int i;
+
+	if (automaton != NULL &&
+		VARSIZE(automaton->patterns) == VARSIZE(patterns) &&
+		memcmp(automaton->patterns, patterns, VARSIZE(patterns)) == 0)
+		return automaton;
+
+	if (ARR_NDIM(patterns) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("Pattern array must be one-dimensional")));
+
+	if (automaton != NULL)
+	{
+		pfree(automaton->states);
+		pfree(automaton->outputs);
+		pfree(automaton->patterns);
+	}
+	else
+		automaton = (KmerScanAutomaton *)MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+																sizeof(KmerScanAutomaton));
+	fcinfo->flinfo->fn_extra = NULL;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	automaton->maxstates = 64;
+	automaton->states = (KmerScanState *)palloc(sizeof(KmerScanState) * automaton->maxstates);
+	automaton->nstates = 0;
+	automaton->maxoutputs = 16;
+	automaton->outputs = (KmerScanOutput *)palloc(sizeof(KmerScanOutput) * automaton->maxoutputs);
+	automaton->noutputs = 0;
+	kmer_scan_add_state(automaton);
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(patterns), &typlen, &typbyval, &typalign);
+	deconstruct_array(patterns, ARR_ELEMTYPE(patterns), typlen, typbyval, typalign,
+					  &elems, &nulls, &nelems);
+	lbound = ARR_NDIM(patterns) == 1 ? ARR_LBOUND(patterns)[0] : 1;
+
+	for (i = 0; i < nelems; i++)
+	{
+		uint64 mask[2];
+		int len;
+
+		if (nulls[i])
+			continue;
+
+		if (isQkmer)
+		{
+			QKMER *qkmer = (QKMER *)DatumGetPointer(elems[i]);
+
+			qkmer_get_mask(qkmer, mask);
+			len = qkmer_get_length(qkmer);
+		}
+		else
+		{
+			KMER *kmer = (KMER *)DatumGetPointer(elems[i]);
+
+			kmer_get_mask(kmer_get_bits(kmer), mask);
+			len = kmer_get_length(kmer);
+		}
+
+		if (len > 0)
+			kmer_scan_insert(automaton, mask, len, lbound + i);
+	}
+
+	kmer_scan_link(automaton);
+
+	pfree(elems);
+	pfree(nulls);
+	automaton->patterns = (ArrayType *)palloc(VARSIZE(patterns));
+	memcpy(automaton->patterns, patterns, VARSIZE(patterns));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Only cached once complete, so that an error leaves no half-built automaton */
+	fcinfo->flinfo->fn_extra = automaton;
+
+	return automaton;
+}
+
+// Runs the automaton over a sequence, returning a (pattern, position) row
+// per occurrence in order of their end
+static void
+kmer_scan_run(FunctionCallInfo fcinfo, KmerScanAutomaton *automaton)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	const KmerScanState *states = automaton->states;
+	DnaReader reader;
+	char *bases;
+	int32 state = 0;
+	int from, i;
+
+	if (automaton->noutputs == 0)
+		return;
+
+	dna_reader_init(&reader, PG_GETARG_DATUM(0));
+	bases = (char *)palloc(Min(reader.length, KMER_SCAN_CHUNK) + 1);
+
+	for (from = 0; from < reader.length; from += KMER_SCAN_CHUNK)
+	{
+		int count = Min(reader.length - from, KMER_SCAN_CHUNK);
+
+		dna_reader_read(&reader, from, count, bases);
+
+		for (i = 0; i < count; i++)
+		{
+			int32 match;
+
+			if (bases[i] == 'n')
+			{
+				state = 0;
+				continue;
+			}
+
+			state = states[state].next[nucleotide_code(bases[i])];
+
+			for (match = states[state].output >= 0 ? state : states[state].dict;
+				 match >= 0; match = states[match].dict)
+			{
+				int32 output;
+
+				for (output = states[match].output; output >= 0; output = automaton->outputs[output].next)
+				{
+					Datum values[2];
+					bool nulls[2] = {false, false};
+
+					values[0] = Int32GetDatum(automaton->outputs[output].pattern);
+					values[1] = Int32GetDatum(from + i - automaton->outputs[output].length + 2);
+					tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+				}
+			}
+		}
+	}
+
+	pfree(bases);
+}
+
+/*****************************************************************************/
+
+/* Scan functions */
+
+// Occurrences of the KMERs of an array in a DNA sequence, as the subscript
+// of the pattern and its 1-based start
+PG_FUNCTION_INFO_V1(dna_find_kmers);
+Datum dna_find_kmers(PG_FUNCTION_ARGS)
+{
+	KmerScanAutomaton *automaton;
+
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+	automaton = kmer_scan_get_automaton(fcinfo, PG_GETARG_ARRAYTYPE_P(1), false);
+	kmer_scan_run(fcinfo, automaton);
+
+	return (Datum)0;
+}
+
+// Occurrences of the QKMER patterns of an array in a DNA sequence
+PG_FUNCTION_INFO_V1(dna_find_patterns);
+Datum dna_find_patterns(PG_FUNCTION_ARGS)
+{
+	KmerScanAutomaton *automaton;
+
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+	automaton = kmer_scan_get_automaton(fcinfo, PG_GETARG_ARRAYTYPE_P(1), true);
+	kmer_scan_run(fcinfo, automaton);
+
+	return (Datum)0;
+}
@@ -0,0 +1,412 @@
+/*
+ * kmer_search.c
+ *
+ * Seed-and-extend search of a query sequence in a stored one.
+ * seed_and_extend(subject, query, k, min_hits) looks up every k-mer of the
+ * subject among the k-mers of the query (the seeds) and counts the hits by
+ * diagonal, the difference of their subject and query positions. Hits of
+ * one alignment share a diagonal, up to the indels between them, so hits
+ * are counted in bins of DNA_SEARCH_BIN diagonals together with the two
+ * neighbouring bins. The best bins with at least min_hits hits are then
+ * extended by a local alignment with affine gaps, limited to a band of
+ * diagonals around the bin, and the best alignment is returned as its
+ * score and its 1-based start in the subject.
+ *
+ * dna_search(table, column, query, k, min_hits) runs it over a table: the
+ * rows sharing a k-mer with the query are found through the GIN index on
+ * the column (dna_gin_ops), and each of them is searched in turn.
+ *
+ * Only the forward strand of the subject is searched; search
+ * reverse_complement(query) for the other one.
+ *
+ * References:
+ * S. F. Altschul et al., Basic local alignment search tool:
+ * https://doi.org/10.1016/S0022-2836(05)80360-2
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "utils/tuplestore.h"
+
+/*****************************************************************************/
+
+// Diagonals counted together, and half the width of the alignment band
+#define DNA_SEARCH_BIN 16
+#define DNA_SEARCH_BAND (2 * DNA_SEARCH_BIN)
+
+// Bins extended at most per subject
+#define DNA_SEARCH_CANDIDATES 4
+
+// K-mers occurring more often in the query are not used as seeds, as in
+// low-complexity masking; they would hit everywhere along repeats
+#define DNA_SEARCH_MAX_REPEATS 16
+
+// Scores of the extension, as the defaults of blastn
+#define DNA_SEARCH_MATCH 2
+#define DNA_SEARCH_MISMATCH (-3)
+#define DNA_SEARCH_GAP_OPEN 5
+#define DNA_SEARCH_GAP_EXTEND 2
+
+#define DNA_SEARCH_NONE (PG_INT32_MIN / 2)
+
+/* Seeds: the positions of each k-mer of the query */
+typedef struct SeedEntry
+{
+	uint64 bits;
+	int first;				  // last position seen in the query, chained by next[]
+	int count;
+	char status;
+} SeedEntry;
+
+#define SH_PREFIX seedtab
+#define SH_ELEMENT_TYPE SeedEntry
+#define SH_KEY_TYPE uint64
+#define SH_KEY bits
+#define SH_HASH_KEY(tb, key) ((uint32)kmer_hash_bits(key, 0))
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* Hits by bin of diagonals */
+typedef struct BinEntry
+{
+	int32 bin;
+	int32 hits;
+	char status;
+} BinEntry;
+
+#define SH_PREFIX bintab
+#define SH_ELEMENT_TYPE BinEntry
+#define SH_KEY_TYPE int32
+#define SH_KEY bin
+#define SH_HASH_KEY(tb, key) ((uint32)kmer_hash_bits((uint64)(uint32)(key), 0))
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+// A bin to extend, with the hits of it and of its neighbours
+typedef struct SearchCandidate
+{
+	int32 bin;
+	int32 hits;
+} SearchCandidate;
+
+// Best local alignment found so far
+typedef struct SearchHit
+{
+	int score;
+	int start;				  // 0-based start in the subject
+} SearchHit;
+
+/*****************************************************************************/
+
+/* Search helper functions */
+
+// Hashes the k-mers of the query, chaining the positions of each k-mer
+// through next[]. Returns the length of the query.
+static int
+dna_search_seeds(Datum query, int k, seedtab_hash **seeds, int **next)
+{
+	DnaKmerIterator iter;
+	uint64 bits;
+	int start;
+
+	dna_kmers_init(&iter, query, k);
+	*seeds = seedtab_create(CurrentMemoryContext, Max(iter.reader.length, 16), NULL);
+	*next = (int *)palloc(sizeof(int) * Max(iter.reader.length, 1));
+
+	while (dna_kmers_next(&iter, &bits, &start))
+	{
+		bool found;
+		SeedEntry *entry = seedtab_insert(*seeds, bits, &found);
+
+		if (!found)
+		{
+			entry->first = -1;
+			entry->count = 0;
+		}
+
+		(*next)[start] = entry->first;
+		entry->first = start;
+		entry->count++;
+	}
+
+	return iter.reader.length;
+}
+
+// Bins holding the most hits with their neighbours, at least min_hits, best
+// first. Bins next to a better one are left out, as their bands overlap.
+static int
+dna_search_candidates(bintab_hash *bins, int min_hits, SearchCandidate *candidates)
+{
+	bintab_iterator iter;
+	BinEntry *entry;
+	int n = 0;
+	int i, j;
+
+	bintab_start_iterate(bins, &iter);
+	while ((entry = bintab_iterate(bins, &iter)) != NULL)
+	{
+		BinEntry *left = bintab_lookup(bins, entry->bin - 1);
+		BinEntry *right = bintab_lookup(bins, entry->bin + 1);
+		SearchCandidate candidate;
+
+		candidate.bin = entry->bin;
+		candidate.hits = entry->hits + (left ? left->hits : 0) + (right ? right->hits : 0);
+		if (candidate.hits < min_hits)
+			continue;
+
+		/* Insert by hits, then by bin, so that the choice is stable */
+		for (i = 0; i < n; i++)
+		{
+			if (candidate.hits > candidates[i].hits ||
+				(candidate.hits == candidates[i].hits && candidate.bin < candidates[i].bin))
+				break;
+		}
+		if (i == DNA_SEARCH_CANDIDATES)
+			continue;
+
+		for (j = Min(n, DNA_SEARCH_CANDIDATES - 1); j > i; j--)
+			candidates[j] = candidates[j - 1];
+		candidates[i] = candidate;
+		n = Min(n + 1, DNA_SEARCH_CANDIDATES);
+	}
+
+	/* Drop the candidates next to a better one */
+	for (i = 0, j = 0; i < n; i++)
+	{
+		int l;
+
+		for (l = 0; l < j; l++)
+		{
+			if (Abs(candidates[l].bin - candidates[i].bin) <= 1)
+				break;
+		}
+		if (l == j)
+			candidates[j++] = candidates[i];
+	}
+
+	return j;
+}
+
+// Local alignment of the query against the subject, limited to the
+// diagonals within DNA_SEARCH_BAND of diagonal. Row i holds query base i,
+// and column t of a row the subject base at i + diagonal + t - BAND. Each
+// cell carries the subject start of the alignment it ends, so that no
+// traceback is needed.
+static void
+dna_search_extend(const char *query, int m, DnaReader *subject, int diagonal, SearchHit *best)
+{
+	int width = 2 * DNA_SEARCH_BAND + 1;
+	int from = Max(diagonal - DNA_SEARCH_BAND, 0);
+	int to = Min(diagonal + m + DNA_SEARCH_BAND, subject->length);
+	char *bases;
+	int *h, *hstart, *f, *fstart;
+	int *newh, *newhstart;
+	int i, t;
+
+	if (from >= to)
+		return;
+
+	bases = (char *)palloc(to - from);
+	dna_reader_read(subject, from, to - from, bases);
+
+	/* Previous row of H and F, with room for column width */
+	h = (int *)palloc(sizeof(int) * (width + 1));
+	hstart = (int *)palloc(sizeof(int) * (width + 1));
+	f = (int *)palloc(sizeof(int) * (width + 1));
+	fstart = (int *)palloc(sizeof(int) * (width + 1));
+	newh = (int *)palloc(sizeof(int) * (width + 1));
+	newhstart = (int *)palloc(sizeof(int) * (width + 1));
+
+	for (t = 0; t <= width; t++)
+	{
+		h[t] = 0;
+		hstart[t] = 0;
+		f[t] = DNA_SEARCH_NONE;
+		fstart[t] = 0;
+	}
+
+	for (i = 0; i < m; i++)
+	{
+		int e = DNA_SEARCH_NONE;
+		int estart = 0;
+		int *swap;
+
+		for (t = 0; t < width; t++)
+		{
+			int j = i + diagonal + t - DNA_SEARCH_BAND;
+			int diag, diagstart, value, start;
+
+			if (j < from || j >= to)
+			{
+				newh[t] = DNA_SEARCH_NONE;
+				newhstart[t] = 0;
+				f[t] = DNA_SEARCH_NONE;
+				e = DNA_SEARCH_NONE;
+				continue;
+			}
+
+			/* Gap in the query: from the cell to the left in this row */
+			if (t > 0 && newh[t - 1] - DNA_SEARCH_GAP_OPEN - DNA_SEARCH_GAP_EXTEND > e - DNA_SEARCH_GAP_EXTEND)
+			{
+				e = newh[t - 1] - DNA_SEARCH_GAP_OPEN - DNA_SEARCH_GAP_EXTEND;
+				estart = newhstart[t - 1];
+			}
+			else
+				e -= DNA_SEARCH_GAP_EXTEND;
+
+			/* Gap in the subject: from the cell above, column t + 1 */
+			if (h[t + 1] - DNA_SEARCH_GAP_OPEN - DNA_SEARCH_GAP_EXTEND > f[t + 1] - DNA_SEARCH_GAP_EXTEND)
+			{
+				f[t] = h[t + 1] - DNA_SEARCH_GAP_OPEN - DNA_SEARCH_GAP_EXTEND;
+				fstart[t] = hstart[t + 1];
+			}
+			else
+			{
+				f[t] = f[t + 1] - DNA_SEARCH_GAP_EXTEND;
+				fstart[t] = fstart[t + 1];
+			}
+
+			/* Match or mismatch, starting a new alignment after a 0 */
+			diag = h[t] <= 0 ? 0 : h[t];
+			diagstart = h[t] <= 0 ? j : hstart[t];
+			diag += (query[i] == bases[j - from] && query[i] != 'n') ? DNA_SEARCH_MATCH : DNA_SEARCH_MISMATCH;
+
+			value = diag;
+			start = diagstart;
+			if (e > value)
+			{
+				value = e;
+				start = estart;
+			}
+			if (f[t] > value)
+			{
+				value = f[t];
+				start = fstart[t];
+			}
+			if (value < 0)
+				value = 0;
+
+			newh[t] = value;
+			newhstart[t] = start;
+
+			if (value > best->score || (value == best->score && value > 0 && start < best->start))
+			{
+				best->score = value;
+				best->start = start;
+			}
+		}
+
+		newh[width] = DNA_SEARCH_NONE;
+		swap = h;
+		h = newh;
+		newh = swap;
+		swap = hstart;
+		hstart = newhstart;
+		newhstart = swap;
+	}
+
+	pfree(bases);
+	pfree(h);
+	pfree(hstart);
+	pfree(f);
+	pfree(fstart);
+	pfree(newh);
+	pfree(newhstart);
+}
+
+/*****************************************************************************/
+
+/* Search functions */
+
+// Best local alignment of the query in the subject around the diagonals
+// with at least min_hits seed hits, as (score, position); no row when there
+// is none
+PG_FUNCTION_INFO_V1(dna_seed_and_extend);
+Datum dna_seed_and_extend(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	int k = PG_GETARG_INT32(2);
+	int min_hits = PG_GETARG_INT32(3);
+	seedtab_hash *seeds;
+	bintab_hash *bins;
+	int *next;
+	int m;
+	DnaKmerIterator iter;
+	DnaReader queryReader;
+	SearchCandidate candidates[DNA_SEARCH_CANDIDATES];
+	int ncandidates;
+	SearchHit best = {0, 0};
+	char *query;
+	uint64 bits;
+	int start;
+	int i;
+
+	if (k <= 0 || k > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid KMER Length")));
+	if (min_hits <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("min_hits must be positive")));
+
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+	/* Seeds of the query */
+	m = dna_search_seeds(PG_GETARG_DATUM(1), k, &seeds, &next);
+
+	/* Hits of the subject by bin of diagonals */
+	bins = bintab_create(CurrentMemoryContext, 256, NULL);
+	dna_kmers_init(&iter, PG_GETARG_DATUM(0), k);
+	while (dna_kmers_next(&iter, &bits, &start))
+	{
+		SeedEntry *seed = seedtab_lookup(seeds, bits);
+		int position;
+
+		if (seed == NULL || seed->count > DNA_SEARCH_MAX_REPEATS)
+			continue;
+
+		for (position = seed->first; position >= 0; position = next[position])
+		{
+			int diagonal = start - position;
+			int32 key = diagonal >= 0 ? diagonal / DNA_SEARCH_BIN
+									  : -((DNA_SEARCH_BIN - 1 - diagonal) / DNA_SEARCH_BIN);
+			bool found;
+			BinEntry *bin = bintab_insert(bins, key, &found);
+
+			bin->hits = found ? bin->hits + 1 : 1;
+		}
+	}
+
+	ncandidates = dna_search_candidates(bins, min_hits, candidates);
+	if (ncandidates == 0)
+		return (Datum)0;
+
+	/* Extend the candidates */
+	query = (char *)palloc(Max(m, 1));
+	dna_reader_init(&queryReader, PG_GETARG_DATUM(1));
+	dna_reader_read(&queryReader, 0, m, query);
+
+	for (i = 0; i < ncandidates; i++)
+		dna_search_extend(query, m, &iter.reader,
+						  candidates[i].bin * DNA_SEARCH_BIN + DNA_SEARCH_BIN / 2, &best);
+
+	if (best.score > 0)
+	{
+		Datum values[2];
+		bool nulls[2] = {false, false};
+
+		values[0] = Int32GetDatum(best.score);
+		values[1] = Int32GetDatum(best.start + 1);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum)0;
+}
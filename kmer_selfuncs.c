@@ -0,0 +1,644 @@
+/*
+ * kmer_selfuncs.c
+ *
+ * Planner support for kmer operators: selectivity estimators and support
+ * functions that let the planner use a btree index for ^@ prefix searches.
+ *
+ * A prefix selects one contiguous range in k-mer order, from the prefix
+ * itself up to (but excluding) the least k-mer that sorts after every k-mer
+ * starting with it, so ^@ can become a btree range scan, and its selectivity
+ * is that range's share of the column histogram.
+ *
+ * Patterns have no such range. They are estimated from the per-position base
+ * frequencies and length frequencies collected by kmer_typanalyze, treating
+ * the bases at different positions as independent; the most common values
+ * are always tested exactly.
+ *
+ * References:
+ * Function Optimization Information: https://www.postgresql.org/docs/current/xfunc-optimization.html
+ * Operator Optimization Information: https://www.postgresql.org/docs/current/xoper-optimization.html
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include <math.h>
+#include "access/htup_details.h"
+#include "access/stratnum.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_statistic.h"
+#include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "port/pg_bitutils.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+
+/*****************************************************************************/
+
+/* Column statistics helper functions */
+
+// Statistics of a kmer variable, see kmer_typanalyze
+typedef struct KmerColumnStats
+{
+	double nullfrac;
+	double positions[MAX_KMER_LENGTH][4];	// base frequencies by position
+	double longer[MAX_KMER_LENGTH + 1];		// fraction with at least i bases
+	double lengths[MAX_KMER_LENGTH + 1];	// length frequencies
+} KmerColumnStats;
+
+// Loads the statistics of a kmer variable; false if they were not collected
+static bool
+kmer_column_stats(VariableStatData *vardata, KmerColumnStats *cs)
+{
+	AttStatsSlot sslot;
+	bool valid;
+
+	if (!HeapTupleIsValid(vardata->statsTuple))
+		return false;
+
+	cs->nullfrac = ((Form_pg_statistic)GETSTRUCT(vardata->statsTuple))->stanullfrac;
+
+	if (!get_attstatsslot(&sslot, vardata->statsTuple, KMER_STATISTIC_KIND_POSITIONS,
+						  InvalidOid, ATTSTATSSLOT_NUMBERS))
+		return false;
+
+	valid = sslot.nnumbers == MAX_KMER_LENGTH * 4;
+	if (valid)
+	{
+		cs->longer[0] = 1.0;
+		for (int i = 0; i < MAX_KMER_LENGTH; i++)
+		{
+			cs->longer[i + 1] = 0.0;
+			for (int c = 0; c < 4; c++)
+			{
+				cs->positions[i][c] = sslot.numbers[4 * i + c];
+				cs->longer[i + 1] += cs->positions[i][c];
+			}
+		}
+	}
+	free_attstatsslot(&sslot);
+
+	if (!valid || !get_attstatsslot(&sslot, vardata->statsTuple, KMER_STATISTIC_KIND_LENGTHS,
+									InvalidOid, ATTSTATSSLOT_NUMBERS))
+		return false;
+
+	valid = sslot.nnumbers == MAX_KMER_LENGTH + 1;
+	if (valid)
+	{
+		for (int i = 0; i <= MAX_KMER_LENGTH; i++)
+			cs->lengths[i] = sslot.numbers[i];
+	}
+	free_attstatsslot(&sslot);
+
+	return valid;
+}
+
+// Probability that a non-null k-mer has base c at position i, given that
+// it has at least i bases
+static inline double
+kmer_base_probability(const KmerColumnStats *cs, int i, int c)
+{
+	return cs->longer[i] > 0 ? cs->positions[i][c] / cs->longer[i] : 0.0;
+}
+
+// Fraction of non-null k-mers starting with the given prefix
+static double
+kmer_prefix_model(const KmerColumnStats *cs, uint64 bits, int len)
+{
+	double selec = 1.0;
+
+	for (int i = 0; i < len; i++)
+		selec *= kmer_base_probability(cs, i, KMER_CODE_AT(bits, i));
+
+	return selec;
+}
+
+// Fraction of non-null k-mers matching the given pattern
+static double
+kmer_pattern_model(const KmerColumnStats *cs, const uint64 mask[2], int len)
+{
+	double selec = cs->lengths[len];
+
+	for (int i = 0; i < len && selec > 0; i++)
+	{
+		int m = qkmer_mask_at(mask, i);
+		double hit = 0.0;
+
+		// Base frequencies given that the k-mer is longer than i
+		if (cs->longer[i + 1] <= 0)
+			return 0.0;
+		for (int c = 0; c < 4; c++)
+		{
+			if ((m >> c) & 1)
+				hit += cs->positions[i][c];
+		}
+		selec *= hit / cs->longer[i + 1];
+	}
+
+	return selec;
+}
+
+/*****************************************************************************/
+
+/* Selectivity helper functions */
+
+// Selectivity of a prefix of len bases without statistics, assuming
+// independent, uniformly distributed bases
+static inline double
+kmer_prefix_default_selectivity(int len)
+{
+	return pow(0.25, len);
+}
+
+// Fraction of the histogram population sorting below value, interpolating
+// linearly within the bucket containing it
+static double
+kmer_histogram_fraction(const double *bounds, int nbounds, double value)
+{
+	int lo = 0;
+	int hi = nbounds - 1;
+	double width;
+
+	if (value <= bounds[0])
+		return 0.0;
+	if (value >= bounds[nbounds - 1])
+		return 1.0;
+
+	/* bounds[lo] < value < bounds[hi] */
+	while (hi - lo > 1)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (bounds[mid] <= value)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	width = bounds[hi] - bounds[lo];
+	return (lo + (width > 0 ? (value - bounds[lo]) / width : 0.0)) / (nbounds - 1);
+}
+
+// Fraction of the rows of a kmer variable that start with the given prefix
+static Selectivity
+kmer_prefix_selectivity(VariableStatData *vardata, uint64 bits, int len)
+{
+	Form_pg_statistic stats;
+	AttStatsSlot sslot;
+	KmerColumnStats cs;
+	double nullfrac, sumcommon = 0.0, mcvsel = 0.0, histsel;
+	Selectivity selec;
+
+	if (!HeapTupleIsValid(vardata->statsTuple))
+		return len == 0 ? 1.0 : kmer_prefix_default_selectivity(len);
+
+	stats = (Form_pg_statistic) GETSTRUCT(vardata->statsTuple);
+	nullfrac = stats->stanullfrac;
+
+	// Every k-mer starts with the empty prefix
+	if (len == 0)
+		return 1.0 - nullfrac;
+
+	/* Most common values are tested exactly */
+	if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV, InvalidOid,
+						 ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS))
+	{
+		for (int i = 0; i < sslot.nvalues; i++)
+		{
+			KMER *kmer = (KMER *)DatumGetPointer(sslot.values[i]);
+
+			if (kmer_get_length(kmer) >= len &&
+				((kmer_get_bits(kmer) ^ bits) & kmer_prefix_mask(len)) == 0)
+				mcvsel += sslot.numbers[i];
+			sumcommon += sslot.numbers[i];
+		}
+		free_attstatsslot(&sslot);
+	}
+
+	/* The rest is the prefix range's share of the histogram */
+	if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_HISTOGRAM, InvalidOid,
+						 ATTSTATSSLOT_VALUES) && sslot.nvalues >= 2)
+	{
+		double *bounds = (double *)palloc(sizeof(double) * sslot.nvalues);
+		double lower = (double)(bits & kmer_prefix_mask(len));
+		double upper = lower + ldexp(1.0, 64 - 2 * len);
+
+		for (int i = 0; i < sslot.nvalues; i++)
+			bounds[i] = (double)kmer_get_bits((KMER *)DatumGetPointer(sslot.values[i]));
+
+		histsel = kmer_histogram_fraction(bounds, sslot.nvalues, upper) -
+			kmer_histogram_fraction(bounds, sslot.nvalues, lower);
+
+		pfree(bounds);
+		free_attstatsslot(&sslot);
+	}
+	else if (kmer_column_stats(vardata, &cs))
+		histsel = kmer_prefix_model(&cs, bits, len);
+	else
+		histsel = kmer_prefix_default_selectivity(len);
+
+	selec = mcvsel + histsel * Max(1.0 - nullfrac - sumcommon, 0.0);
+	CLAMP_PROBABILITY(selec);
+
+	return selec;
+}
+
+// Selectivity of a prefix test whose prefix is argument prefixArg of args
+static Selectivity
+kmer_prefix_clause_selectivity(PlannerInfo *root, List *args, int varRelid, int prefixArg)
+{
+	VariableStatData vardata;
+	Node *other;
+	bool varonleft;
+	Selectivity selec;
+	KMER *prefix;
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+		return DEFAULT_MATCH_SEL;
+
+	// The k-mer has to be the variable and the prefix a constant
+	if (varonleft != (prefixArg == 1) || !IsA(other, Const))
+	{
+		ReleaseVariableStats(vardata);
+		return DEFAULT_MATCH_SEL;
+	}
+
+	if (((Const *)other)->constisnull)
+	{
+		ReleaseVariableStats(vardata);
+		return 0.0;
+	}
+
+	prefix = (KMER *)PG_DETOAST_DATUM_PACKED(((Const *)other)->constvalue);
+	selec = kmer_prefix_selectivity(&vardata, kmer_get_bits(prefix), kmer_get_length(prefix));
+
+	ReleaseVariableStats(vardata);
+
+	return selec;
+}
+
+// Fraction of the rows of a kmer variable matching the given pattern
+static Selectivity
+kmer_pattern_selectivity(VariableStatData *vardata, const uint64 mask[2], int len)
+{
+	AttStatsSlot sslot;
+	KmerColumnStats cs;
+	double sumcommon = 0.0, mcvsel = 0.0, patternsel;
+	Selectivity selec;
+
+	if (!kmer_column_stats(vardata, &cs))
+	{
+		// Without statistics, assume uniformly distributed bases and take
+		// the default estimate for the share of k-mers of the right length
+		selec = DEFAULT_MATCHING_SEL;
+		for (int i = 0; i < len; i++)
+			selec *= pg_popcount32(qkmer_mask_at(mask, i)) / 4.0;
+		return selec;
+	}
+
+	/* Most common values are tested exactly */
+	if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV, InvalidOid,
+						 ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS))
+	{
+		for (int i = 0; i < sslot.nvalues; i++)
+		{
+			KMER *kmer = (KMER *)DatumGetPointer(sslot.values[i]);
+
+			if (kmer_get_length(kmer) == len &&
+				qkmer_match_prefix(mask, kmer_get_bits(kmer), len))
+				mcvsel += sslot.numbers[i];
+			sumcommon += sslot.numbers[i];
+		}
+		free_attstatsslot(&sslot);
+	}
+
+	/* The rest follows the per-position model */
+	patternsel = kmer_pattern_model(&cs, mask, len);
+
+	selec = mcvsel + patternsel * Max(1.0 - cs.nullfrac - sumcommon, 0.0);
+	CLAMP_PROBABILITY(selec);
+
+	return selec;
+}
+
+// Selectivity of a pattern match whose k-mer is argument kmerArg of args
+static Selectivity
+kmer_pattern_clause_selectivity(PlannerInfo *root, List *args, int varRelid, int kmerArg)
+{
+	VariableStatData vardata;
+	Node *other;
+	bool varonleft;
+	Selectivity selec;
+	QKMER *pattern;
+	uint64 mask[2];
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+		return DEFAULT_MATCHING_SEL;
+
+	// The k-mer has to be the variable and the pattern a constant
+	if (varonleft != (kmerArg == 0) || !IsA(other, Const))
+	{
+		ReleaseVariableStats(vardata);
+		return DEFAULT_MATCHING_SEL;
+	}
+
+	if (((Const *)other)->constisnull)
+	{
+		ReleaseVariableStats(vardata);
+		return 0.0;
+	}
+
+	pattern = (QKMER *)PG_DETOAST_DATUM_PACKED(((Const *)other)->constvalue);
+	qkmer_get_mask(pattern, mask);
+	selec = kmer_pattern_selectivity(&vardata, mask, qkmer_get_length(pattern));
+
+	ReleaseVariableStats(vardata);
+
+	return selec;
+}
+
+// Upper bound on the fraction of rows equal to a k-mer that is not one of
+// the most common values: no more rows than have its length, or its base at
+// any position
+static double
+kmer_equal_bound(const KmerColumnStats *cs, uint64 bits, int len)
+{
+	double bound = cs->lengths[len];
+
+	for (int i = 0; i < len; i++)
+		bound = Min(bound, cs->positions[i][KMER_CODE_AT(bits, i)]);
+
+	return bound * (1.0 - cs->nullfrac);
+}
+
+// Fraction of pairs of non-null rows where the k-mer starts with the prefix
+static double
+kmer_prefix_join_model(const KmerColumnStats *kmers, const KmerColumnStats *prefixes)
+{
+	double selec = 0.0;
+	double agree = 1.0;
+
+	for (int len = 0; len <= MAX_KMER_LENGTH && agree > 0; len++)
+	{
+		selec += prefixes->lengths[len] * agree;
+
+		if (len < MAX_KMER_LENGTH && prefixes->longer[len + 1] > 0)
+		{
+			double p = 0.0;
+
+			// Base of a prefix longer than len, against any k-mer base
+			for (int c = 0; c < 4; c++)
+				p += prefixes->positions[len][c] / prefixes->longer[len + 1] *
+					 kmer_base_probability(kmers, len, c);
+			agree *= p;
+		}
+		else
+			agree = 0.0;
+	}
+
+	return selec;
+}
+
+/*****************************************************************************/
+
+/* Index condition helper functions */
+
+// Builds "kmerop >= prefix AND kmerop < upper" for a btree or BRIN minmax
+// index on kmerop, which share the strategy numbers of the range operators
+static List *
+kmer_prefix_index_quals(Node *kmerop, Node *prefixop, IndexOptInfo *index, int indexcol)
+{
+	Oid kmertype = exprType(kmerop);
+	Oid geop, ltop;
+	KMER *prefix;
+	uint64 bits;
+	int len;
+	List *result;
+
+	if ((index->relam != BTREE_AM_OID && index->relam != BRIN_AM_OID) ||
+		kmertype != index->opcintype[indexcol])
+		return NIL;
+
+	if (!IsA(prefixop, Const) || ((Const *)prefixop)->constisnull)
+		return NIL;
+
+	geop = get_opfamily_member(index->opfamily[indexcol], kmertype, kmertype,
+							   BTGreaterEqualStrategyNumber);
+	ltop = get_opfamily_member(index->opfamily[indexcol], kmertype, kmertype,
+							   BTLessStrategyNumber);
+	if (!OidIsValid(geop) || !OidIsValid(ltop))
+		return NIL;
+
+	prefix = (KMER *)PG_DETOAST_DATUM_PACKED(((Const *)prefixop)->constvalue);
+	bits = kmer_get_bits(prefix);
+	len = kmer_get_length(prefix);
+
+	// The empty prefix matches everything
+	if (len == 0)
+		return NIL;
+
+	result = list_make1(make_opclause(geop, BOOLOID, false, (Expr *)kmerop,
+									  (Expr *)makeConst(kmertype, -1, InvalidOid, -1,
+														PointerGetDatum(kmer_from_bits(bits, len)),
+														false, false),
+									  InvalidOid, InvalidOid));
+
+	/*
+	 * Drop trailing T's and step the last remaining base to the next
+	 * nucleotide: the result is the least k-mer sorting after the range. A
+	 * prefix of only T's has no upper bound.
+	 */
+	while (len > 0 && KMER_CODE_AT(bits, len - 1) == 3)
+		len--;
+
+	if (len > 0)
+	{
+		bits = (bits & kmer_prefix_mask(len)) + (UINT64CONST(1) << (64 - 2 * len));
+		result = lappend(result,
+						 make_opclause(ltop, BOOLOID, false, (Expr *)kmerop,
+									   (Expr *)makeConst(kmertype, -1, InvalidOid, -1,
+														 PointerGetDatum(kmer_from_bits(bits, len)),
+														 false, false),
+									   InvalidOid, InvalidOid));
+	}
+
+	return result;
+}
+
+// Planner support for a prefix test whose prefix is argument prefixArg
+static Node *
+kmer_prefix_support(Node *rawreq, int prefixArg)
+{
+	if (IsA(rawreq, SupportRequestSelectivity))
+	{
+		SupportRequestSelectivity *req = (SupportRequestSelectivity *)rawreq;
+
+		if (req->is_join)
+			return NULL;
+
+		req->selectivity = kmer_prefix_clause_selectivity(req->root, req->args,
+														  req->varRelid, prefixArg);
+		return (Node *)req;
+	}
+
+	if (IsA(rawreq, SupportRequestIndexCondition))
+	{
+		SupportRequestIndexCondition *req = (SupportRequestIndexCondition *)rawreq;
+		List *args;
+		List *quals;
+
+		if (is_opclause(req->node))
+			args = ((OpExpr *)req->node)->args;
+		else if (is_funcclause(req->node))
+			args = ((FuncExpr *)req->node)->args;
+		else
+			return NULL;
+
+		// Only the k-mer side can be matched to the index
+		if (list_length(args) != 2 || req->indexarg != 1 - prefixArg)
+			return NULL;
+
+		quals = kmer_prefix_index_quals((Node *)list_nth(args, 1 - prefixArg),
+										(Node *)list_nth(args, prefixArg),
+										req->index, req->indexcol);
+		if (quals == NIL)
+			return NULL;
+
+		// The range is rechecked with the original clause
+		req->lossy = true;
+		return (Node *)quals;
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+
+/* Restriction estimator for ^@ */
+PG_FUNCTION_INFO_V1(kmer_prefixsel);
+Datum kmer_prefixsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	List *args = (List *)PG_GETARG_POINTER(2);
+	int varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(kmer_prefix_clause_selectivity(root, args, varRelid, 1));
+}
+
+/* Join estimator for ^@ */
+PG_FUNCTION_INFO_V1(kmer_prefixjoinsel);
+Datum kmer_prefixjoinsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	List *args = (List *)PG_GETARG_POINTER(2);
+	SpecialJoinInfo *sjinfo = (SpecialJoinInfo *)PG_GETARG_POINTER(4);
+	VariableStatData vardata1, vardata2;
+	KmerColumnStats kmers, prefixes;
+	bool join_is_reversed;
+	Selectivity selec = DEFAULT_MATCH_SEL;
+
+	get_join_variables(root, args, sjinfo, &vardata1, &vardata2, &join_is_reversed);
+
+	if (kmer_column_stats(&vardata1, &kmers) && kmer_column_stats(&vardata2, &prefixes))
+	{
+		// Without reversal, the left argument holds the k-mers
+		if (join_is_reversed)
+			selec = kmer_prefix_join_model(&prefixes, &kmers);
+		else
+			selec = kmer_prefix_join_model(&kmers, &prefixes);
+
+		selec *= (1.0 - kmers.nullfrac) * (1.0 - prefixes.nullfrac);
+		CLAMP_PROBABILITY(selec);
+	}
+
+	ReleaseVariableStats(vardata1);
+	ReleaseVariableStats(vardata2);
+
+	PG_RETURN_FLOAT8(selec);
+}
+
+/* Restriction estimator for = */
+PG_FUNCTION_INFO_V1(kmer_eqsel);
+Datum kmer_eqsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	List *args = (List *)PG_GETARG_POINTER(2);
+	int varRelid = PG_GETARG_INT32(3);
+	VariableStatData vardata;
+	KmerColumnStats cs;
+	Node *other;
+	bool varonleft;
+	Selectivity selec;
+
+	// The generic estimate uses the most common values and distinct count
+	selec = DatumGetFloat8(DirectFunctionCall4(eqsel, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1),
+											   PG_GETARG_DATUM(2), PG_GETARG_DATUM(3)));
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+		PG_RETURN_FLOAT8(selec);
+
+	if (IsA(other, Const) && !((Const *)other)->constisnull &&
+		kmer_column_stats(&vardata, &cs))
+	{
+		KMER *kmer = (KMER *)PG_DETOAST_DATUM_PACKED(((Const *)other)->constvalue);
+		AttStatsSlot sslot;
+		bool common = false;
+
+		// Estimates for the most common values are exact already
+		if (get_attstatsslot(&sslot, vardata.statsTuple, STATISTIC_KIND_MCV, InvalidOid,
+							 ATTSTATSSLOT_VALUES))
+		{
+			for (int i = 0; i < sslot.nvalues && !common; i++)
+				common = kmer_compare(kmer_get_bits((KMER *)DatumGetPointer(sslot.values[i])),
+									  kmer_get_length((KMER *)DatumGetPointer(sslot.values[i])),
+									  kmer_get_bits(kmer), kmer_get_length(kmer)) == 0;
+			free_attstatsslot(&sslot);
+		}
+
+		if (!common)
+			selec = Min(selec, kmer_equal_bound(&cs, kmer_get_bits(kmer), kmer_get_length(kmer)));
+	}
+
+	ReleaseVariableStats(vardata);
+
+	CLAMP_PROBABILITY(selec);
+	PG_RETURN_FLOAT8(selec);
+}
+
+/* Restriction estimator for qkmer @> kmer */
+PG_FUNCTION_INFO_V1(kmer_containssel);
+Datum kmer_containssel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	List *args = (List *)PG_GETARG_POINTER(2);
+	int varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(kmer_pattern_clause_selectivity(root, args, varRelid, 1));
+}
+
+/* Restriction estimator for kmer <@ qkmer */
+PG_FUNCTION_INFO_V1(kmer_containedsel);
+Datum kmer_containedsel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	List *args = (List *)PG_GETARG_POINTER(2);
+	int varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(kmer_pattern_clause_selectivity(root, args, varRelid, 0));
+}
+
+/* Support function for starts_with(prefix, kmer) */
+PG_FUNCTION_INFO_V1(kmer_starts_with_support);
+Datum kmer_starts_with_support(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(kmer_prefix_support((Node *)PG_GETARG_POINTER(0), 0));
+}
+
+/* Support function for starts_with_op(kmer, prefix), used by ^@ */
+PG_FUNCTION_INFO_V1(kmer_starts_with_op_support);
+Datum kmer_starts_with_op_support(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(kmer_prefix_support((Node *)PG_GETARG_POINTER(0), 1));
+}
@@ -0,0 +1,497 @@
+/*
+ * kmer_sketch.c
+ *
+ * MinHash sketches of DNA sequences. sketch(dna, k, s) keeps the s least
+ * hashes of the canonical k-mers of a sequence (a bottom-s sketch), read in
+ * one pass over the sequence. Two sketches estimate the Jaccard index and
+ * the containment of the k-mer sets of their sequences from their hashes
+ * alone, whatever the length of the sequences. Canonical k-mers make a
+ * sequence and its reverse complement sketch the same.
+ *
+ * dna_sketch_gin_ops indexes the hashes of the sketches, so that the
+ * sketches sharing a hash with a given one (a && b) are found without
+ * comparing all pairs; the candidates are then ranked by a <-> b, which is
+ * 1 - jaccard(a, b).
+ *
+ * References:
+ * Mash: fast genome and metagenome distance estimation using MinHash:
+ * https://doi.org/10.1186/s13059-016-0997-x
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include <ctype.h>
+#include "access/gin.h"
+#include "access/stratnum.h"
+#include "libpq/pqformat.h"
+#include "utils/builtins.h"
+
+/*****************************************************************************/
+
+// A bottom-s sketch: the least count hashes of the canonical k-mers of a
+// sequence, in ascending order. count is below size only when the sequence
+// has fewer than size distinct k-mers, and then the sketch holds them all.
+typedef struct DnaSketch
+{
+	int32 vl_len_; // varlena header (do not touch directly!)
+	int32 k;
+	int32 size;
+	int32 count;
+	uint64 hashes[FLEXIBLE_ARRAY_MEMBER];
+} DnaSketch;
+
+#define DNA_SKETCH_SIZE(count) (offsetof(DnaSketch, hashes) + sizeof(uint64) * (count))
+#define DNA_SKETCH_MAX_SIZE (1024 * 1024)
+
+#define DatumGetDnaSketchP(X) ((DnaSketch *)PG_DETOAST_DATUM(X))
+#define PG_GETARG_DNA_SKETCH_P(n) DatumGetDnaSketchP(PG_GETARG_DATUM(n))
+
+// Strategy of dna_sketch && dna_sketch
+#define DnaSketchOverlapStrategyNumber RTOverlapStrategyNumber
+
+/*****************************************************************************/
+
+/* Sketch helper functions */
+
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64 x = *(const uint64 *)a;
+	uint64 y = *(const uint64 *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Checks the k-mer length and the size of a sketch
+static void
+dna_sketch_check(int k, int size)
+{
+	if (k <= 0 || k > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid KMER Length")));
+
+	if (size <= 0 || size > DNA_SKETCH_MAX_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid sketch size %d", size),
+				 errdetail("The size of a sketch must be between 1 and %d.", DNA_SKETCH_MAX_SIZE)));
+}
+
+// Allocates a sketch for count hashes
+static DnaSketch *
+dna_sketch_alloc(int k, int size, int count)
+{
+	DnaSketch *sketch = (DnaSketch *)palloc(DNA_SKETCH_SIZE(count));
+
+	SET_VARSIZE(sketch, DNA_SKETCH_SIZE(count));
+	sketch->k = k;
+	sketch->size = size;
+	sketch->count = count;
+
+	return sketch;
+}
+
+// Sorts hashes, removes duplicates and keeps the least size of them. Once
+// size hashes are kept, the greatest of them is the threshold that further
+// hashes must not exceed.
+static int
+dna_sketch_compact(uint64 *hashes, int n, int size, uint64 *threshold)
+{
+	int kept = 0;
+	int i;
+
+	qsort(hashes, n, sizeof(uint64), uint64_cmp);
+
+	for (i = 0; i < n && kept < size; i++)
+	{
+		if (kept == 0 || hashes[i] != hashes[kept - 1])
+			hashes[kept++] = hashes[i];
+	}
+
+	if (kept == size)
+		*threshold = hashes[size - 1];
+
+	return kept;
+}
+
+// Counts the hashes shared by the least s hashes of the union of two
+// sketches of the same k, s being the lesser of their sizes
+static void
+dna_sketch_union_counts(const DnaSketch *a, const DnaSketch *b, int *shared, int *total)
+{
+	int s = Min(a->size, b->size);
+	int i = 0, j = 0;
+
+	*shared = 0;
+	*total = 0;
+
+	while (*total < s && (i < a->count || j < b->count))
+	{
+		if (j == b->count || (i < a->count && a->hashes[i] < b->hashes[j]))
+			i++;
+		else if (i == a->count || b->hashes[j] < a->hashes[i])
+			j++;
+		else
+		{
+			(*shared)++;
+			i++;
+			j++;
+		}
+		(*total)++;
+	}
+}
+
+// Checks that two sketches can be compared
+static void
+dna_sketch_check_pair(const DnaSketch *a, const DnaSketch *b)
+{
+	if (a->k != b->k)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Sketches of %d-mers and %d-mers cannot be compared", a->k, b->k)));
+}
+
+// Estimated Jaccard index of the k-mer sets of two sketches; 0 when both
+// are empty
+static double
+dna_sketch_jaccard(const DnaSketch *a, const DnaSketch *b)
+{
+	int shared, total;
+
+	dna_sketch_check_pair(a, b);
+	dna_sketch_union_counts(a, b, &shared, &total);
+
+	return total == 0 ? 0.0 : (double)shared / total;
+}
+
+/*****************************************************************************/
+
+/* Input and Output Functions */
+
+// Text form: k=<k>,s=<size>: then the hashes in hexadecimal, separated by
+// commas
+PG_FUNCTION_INFO_V1(dna_sketch_in);
+Datum dna_sketch_in(PG_FUNCTION_ARGS)
+{
+	char *input = PG_GETARG_CSTRING(0);
+	char *p;
+	int k, size, n = 0;
+	int offset = -1;
+	DnaSketch *sketch;
+
+	if (sscanf(input, "k=%d,s=%d:%n", &k, &size, &offset) != 2 || offset < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("Invalid DNA Sketch"),
+				 errdetail("A sketch starts with \"k=<k>,s=<size>:\".")));
+
+	dna_sketch_check(k, size);
+
+	sketch = dna_sketch_alloc(k, size, size);
+	p = input + offset;
+
+	while (*p != '\0')
+	{
+		char *end;
+		uint64 hash;
+
+		if (n > 0)
+		{
+			if (*p != ',' || !isxdigit((unsigned char)p[1]))
+				break;
+			p++;
+		}
+		else if (!isxdigit((unsigned char)*p))
+			break;
+
+		errno = 0;
+		hash = strtou64(p, &end, 16);
+		if (errno != 0 || end - p > 16 || n == size ||
+			(n > 0 && hash <= sketch->hashes[n - 1]))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("Invalid DNA Sketch"),
+					 errdetail("A sketch holds at most %d distinct 64-bit hashes in ascending order.", size)));
+
+		sketch->hashes[n++] = hash;
+		p = end;
+	}
+
+	if (*p != '\0')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("Invalid DNA Sketch"),
+				 errdetail("Invalid character at position %d.", (int)(p - input) + 1)));
+
+	sketch->count = n;
+	SET_VARSIZE(sketch, DNA_SKETCH_SIZE(n));
+
+	PG_RETURN_POINTER(sketch);
+}
+
+PG_FUNCTION_INFO_V1(dna_sketch_out);
+Datum dna_sketch_out(PG_FUNCTION_ARGS)
+{
+	DnaSketch *sketch = PG_GETARG_DNA_SKETCH_P(0);
+	StringInfoData buf;
+	int i;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "k=%d,s=%d:", sketch->k, sketch->size);
+	for (i = 0; i < sketch->count; i++)
+		appendStringInfo(&buf, i > 0 ? ",%08x%08x" : "%08x%08x",
+						 (uint32)(sketch->hashes[i] >> 32), (uint32)sketch->hashes[i]);
+
+	PG_RETURN_CSTRING(buf.data);
+}
+
+// Binary form: k, size and count as 4-byte integers, then the hashes
+PG_FUNCTION_INFO_V1(dna_sketch_recv);
+Datum dna_sketch_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	int k = pq_getmsgint(buf, 4);
+	int size = pq_getmsgint(buf, 4);
+	int count = pq_getmsgint(buf, 4);
+	DnaSketch *sketch;
+	int i;
+
+	dna_sketch_check(k, size);
+	if (count < 0 || count > size || buf->len - buf->cursor != count * (int)sizeof(uint64))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("Invalid binary DNA Sketch")));
+
+	sketch = dna_sketch_alloc(k, size, count);
+	for (i = 0; i < count; i++)
+	{
+		sketch->hashes[i] = pq_getmsgint64(buf);
+		if (i > 0 && sketch->hashes[i] <= sketch->hashes[i - 1])
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("Invalid binary DNA Sketch")));
+	}
+	pq_getmsgend(buf);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+PG_FUNCTION_INFO_V1(dna_sketch_send);
+Datum dna_sketch_send(PG_FUNCTION_ARGS)
+{
+	DnaSketch *sketch = PG_GETARG_DNA_SKETCH_P(0);
+	StringInfoData buf;
+	int i;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, sketch->k);
+	pq_sendint32(&buf, sketch->size);
+	pq_sendint32(&buf, sketch->count);
+	for (i = 0; i < sketch->count; i++)
+		pq_sendint64(&buf, sketch->hashes[i]);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*****************************************************************************/
+
+/* Sketch functions */
+
+// Bottom-s sketch of the canonical k-mers of a DNA value. Hashes below the
+// current threshold are collected in a buffer of 2s, which is compacted
+// back to the least s whenever it fills, so a long sequence costs one hash
+// per k-mer and a few sorts of 2s hashes.
+PG_FUNCTION_INFO_V1(dna_sketch);
+Datum dna_sketch(PG_FUNCTION_ARGS)
+{
+	int k = PG_GETARG_INT32(1);
+	int size = PG_GETARG_INT32(2);
+	DnaKmerIterator iter;
+	DnaSketch *sketch;
+	uint64 *hashes;
+	uint64 threshold = PG_UINT64_MAX;
+	uint64 bits;
+	int start;
+	int n = 0;
+
+	dna_sketch_check(k, size);
+
+	dna_kmers_init(&iter, PG_GETARG_DATUM(0), k);
+	iter.canonical = true;
+
+	hashes = (uint64 *)palloc(sizeof(uint64) * 2 * size);
+	while (dna_kmers_next(&iter, &bits, &start))
+	{
+		uint64 hash = kmer_hash_bits(bits, k);
+
+		if (hash > threshold)
+			continue;
+
+		hashes[n++] = hash;
+		if (n == 2 * size)
+			n = dna_sketch_compact(hashes, n, size, &threshold);
+	}
+	n = dna_sketch_compact(hashes, n, size, &threshold);
+
+	sketch = dna_sketch_alloc(k, size, n);
+	memcpy(sketch->hashes, hashes, sizeof(uint64) * n);
+	pfree(hashes);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+// Estimated fraction of the k-mers of either sequence that are in both
+PG_FUNCTION_INFO_V1(dna_sketch_jaccard_index);
+Datum dna_sketch_jaccard_index(PG_FUNCTION_ARGS)
+{
+	DnaSketch *a = PG_GETARG_DNA_SKETCH_P(0);
+	DnaSketch *b = PG_GETARG_DNA_SKETCH_P(1);
+
+	PG_RETURN_FLOAT8(dna_sketch_jaccard(a, b));
+}
+
+// Estimated fraction of the k-mers of the first sequence that are in the
+// second. Only the hashes of a that b would hold if they were in the second
+// sequence are compared; 0 when there are none.
+PG_FUNCTION_INFO_V1(dna_sketch_containment);
+Datum dna_sketch_containment(PG_FUNCTION_ARGS)
+{
+	DnaSketch *a = PG_GETARG_DNA_SKETCH_P(0);
+	DnaSketch *b = PG_GETARG_DNA_SKETCH_P(1);
+	uint64 limit;
+	int shared = 0, total = 0;
+	int i, j = 0;
+
+	dna_sketch_check_pair(a, b);
+
+	/* A sketch that is not full holds every hash of its sequence */
+	limit = b->count == b->size ? b->hashes[b->count - 1] : PG_UINT64_MAX;
+
+	for (i = 0; i < a->count && a->hashes[i] <= limit; i++)
+	{
+		while (j < b->count && b->hashes[j] < a->hashes[i])
+			j++;
+		if (j < b->count && b->hashes[j] == a->hashes[i])
+			shared++;
+		total++;
+	}
+
+	PG_RETURN_FLOAT8(total == 0 ? 0.0 : (double)shared / total);
+}
+
+// Jaccard distance, 1 - jaccard(a, b), for ORDER BY
+PG_FUNCTION_INFO_V1(dna_sketch_distance);
+Datum dna_sketch_distance(PG_FUNCTION_ARGS)
+{
+	DnaSketch *a = PG_GETARG_DNA_SKETCH_P(0);
+	DnaSketch *b = PG_GETARG_DNA_SKETCH_P(1);
+
+	PG_RETURN_FLOAT8(1.0 - dna_sketch_jaccard(a, b));
+}
+
+// Whether two sketches share a hash, so that their Jaccard index is not 0.
+// Sketches of another k share no k-mer, so they do not overlap rather than
+// raise an error, which keeps && usable on a column of mixed k.
+PG_FUNCTION_INFO_V1(dna_sketch_overlaps);
+Datum dna_sketch_overlaps(PG_FUNCTION_ARGS)
+{
+	DnaSketch *a = PG_GETARG_DNA_SKETCH_P(0);
+	DnaSketch *b = PG_GETARG_DNA_SKETCH_P(1);
+	int i = 0, j = 0;
+
+	if (a->k != b->k)
+		PG_RETURN_BOOL(false);
+
+	while (i < a->count && j < b->count)
+	{
+		if (a->hashes[i] < b->hashes[j])
+			i++;
+		else if (b->hashes[j] < a->hashes[i])
+			j++;
+		else
+			PG_RETURN_BOOL(true);
+	}
+
+	PG_RETURN_BOOL(false);
+}
+
+/*****************************************************************************/
+
+/* GIN support functions */
+
+// Keys of a sketch: its hashes as int8
+static Datum *
+dna_sketch_gin_keys(DnaSketch *sketch, int32 *nentries)
+{
+	Datum *entries = (Datum *)palloc(sizeof(Datum) * Max(sketch->count, 1));
+	int i;
+
+	for (i = 0; i < sketch->count; i++)
+		entries[i] = Int64GetDatum((int64)sketch->hashes[i]);
+	*nentries = sketch->count;
+
+	return entries;
+}
+
+PG_FUNCTION_INFO_V1(dna_sketch_gin_extract_value);
+Datum dna_sketch_gin_extract_value(PG_FUNCTION_ARGS)
+{
+	DnaSketch *sketch = PG_GETARG_DNA_SKETCH_P(0);
+	int32 *nentries = (int32 *)PG_GETARG_POINTER(1);
+
+	PG_RETURN_POINTER(dna_sketch_gin_keys(sketch, nentries));
+}
+
+// Keys of a search: the hashes of the query sketch, any of which matches.
+// The k of the indexed sketches is not known here, so the matches are
+// rechecked to drop sketches of another k sharing a hash by chance.
+PG_FUNCTION_INFO_V1(dna_sketch_gin_extract_query);
+Datum dna_sketch_gin_extract_query(PG_FUNCTION_ARGS)
+{
+	DnaSketch *sketch = PG_GETARG_DNA_SKETCH_P(0);
+	int32 *nentries = (int32 *)PG_GETARG_POINTER(1);
+	StrategyNumber strategy = PG_GETARG_UINT16(2);
+
+	if (strategy != DnaSketchOverlapStrategyNumber)
+		elog(ERROR, "unrecognized strategy number: %d", strategy);
+
+	PG_RETURN_POINTER(dna_sketch_gin_keys(sketch, nentries));
+}
+
+// A sketch may overlap the query when it has one of its keys, and does so
+// when the recheck finds the same k
+PG_FUNCTION_INFO_V1(dna_sketch_gin_consistent);
+Datum dna_sketch_gin_consistent(PG_FUNCTION_ARGS)
+{
+	bool *check = (bool *)PG_GETARG_POINTER(0);
+	int32 nkeys = PG_GETARG_INT32(3);
+	bool *recheck = (bool *)PG_GETARG_POINTER(5);
+	int i;
+
+	*recheck = true;
+	for (i = 0; i < nkeys; i++)
+	{
+		if (check[i])
+			PG_RETURN_BOOL(true);
+	}
+
+	PG_RETURN_BOOL(false);
+}
+
+PG_FUNCTION_INFO_V1(dna_sketch_gin_triconsistent);
+Datum dna_sketch_gin_triconsistent(PG_FUNCTION_ARGS)
+{
+	GinTernaryValue *check = (GinTernaryValue *)PG_GETARG_POINTER(0);
+	int32 nkeys = PG_GETARG_INT32(3);
+	GinTernaryValue result = GIN_FALSE;
+	int i;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		if (check[i] != GIN_FALSE)
+			result = GIN_MAYBE;
+	}
+
+	PG_RETURN_GIN_TERNARY_VALUE(result);
+}
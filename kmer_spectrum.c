@@ -0,0 +1,981 @@
+/*
+ * kmer_spectrum.c
+ *
+ * K-mer counting. The k-mers of a sequence are counted in an open-addressing
+ * hash table keyed on their packed bases (all k-mers counted together have
+ * the same length, so the bases alone identify them), instead of emitting
+ * one row per position and grouping the rows afterwards.
+ *
+ * kmer_spectrum(dna, k) returns the counts of one sequence as (kmer, count)
+ * rows; the aggregate kmer_spectrum_agg(dna, k) counts over many rows and
+ * returns a kmer_spectrum value, which unnest() turns back into rows. The
+ * aggregate is parallel safe: each worker counts its share of the rows and
+ * sends it to the leader as a kmer_spectrum, which the leader merges into
+ * its own table.
+ *
+ * A kmer_spectrum holds the counts sorted by k-mer, each k-mer as its
+ * difference from the previous one and each count as a variable-length
+ * integer, so that a spectrum of hundreds of millions of distinct k-mers
+ * takes a few bytes per k-mer.
+ *
+ * The count tables of kmer_spectrum and of the aggregate are bounded by
+ * work_mem: when a table would grow past it, its entries are sorted and
+ * written to a temporary file as a run, and the table starts over. The runs
+ * and the last table are merged in k-mer order when the result is built, so
+ * kmer_spectrum returns its rows in k-mer order.
+ *
+ * References:
+ * User-Defined Aggregates: https://www.postgresql.org/docs/current/xaggr.html
+ */
+
+#include "kmer.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "common/int.h"
+#include "lib/binaryheap.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "storage/buffile.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+/*****************************************************************************/
+
+/* Count table */
+typedef struct KmerCountEntry
+{
+	uint64 bits;
+	int64 count;
+	char status;
+} KmerCountEntry;
+
+#define SH_PREFIX kmercount
+#define SH_ELEMENT_TYPE KmerCountEntry
+#define SH_KEY_TYPE uint64
+#define SH_KEY bits
+#define SH_HASH_KEY(tb, key) ((uint32)kmer_hash_bits(key, 0))
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+// Initial size of a count table, grown as needed
+#define KMER_COUNTS_INITIAL_SIZE 1024
+
+// Counts sorted by k-mer and delta encoded, as returned by the aggregate
+typedef struct KmerSpectrum
+{
+	int32 vl_len_; // varlena header (do not touch directly!)
+	int32 k;
+	int32 count;   // distinct k-mers
+	uint8 data[FLEXIBLE_ARRAY_MEMBER];
+} KmerSpectrum;
+
+#define DatumGetKmerSpectrumP(X) ((KmerSpectrum *)PG_DETOAST_DATUM(X))
+#define PG_GETARG_KMER_SPECTRUM_P(n) DatumGetKmerSpectrumP(PG_GETARG_DATUM(n))
+
+// Entry of a run on disk
+typedef struct KmerCountPair
+{
+	uint64 bits;
+	int64 count;
+} KmerCountPair;
+
+// Sorted run of spilled entries
+typedef struct KmerCountRun
+{
+	int fileno;
+	off_t offset;
+	int64 nentries;
+} KmerCountRun;
+
+// Counts of the k-mers of length k seen so far
+typedef struct KmerCounts
+{
+	int k;
+	kmercount_hash *table;
+	MemoryContext context;
+	Size limit;				  // bytes the table may take, or 0 for no limit
+	BufFile *file;			  // runs spilled so far, or NULL
+	KmerCountRun *runs;
+	int nruns;
+	int maxruns;
+	KmerSpectrum *spectrum;	  // counts of a worker, instead of the table
+} KmerCounts;
+
+// Position in a sorted run: the sorted table, or a run on disk read a
+// buffer at a time
+typedef struct KmerCountCursor
+{
+	uint64 bits;			  // current entry
+	int64 count;
+	const KmerCountEntry *entries;
+	KmerCountPair *buffer;
+	int64 nentries;			  // entries of the table, or in the buffer
+	int64 position;			  // next entry of the table or the buffer
+	int maxbuffer;
+	int fileno;				  // next entry of the run on disk
+	off_t offset;
+	int64 remaining;		  // entries of the run still on disk
+} KmerCountCursor;
+
+// Merge of the runs and the table of a count, in k-mer order
+typedef struct KmerCountsMerge
+{
+	KmerCounts *counts;
+	KmerCountCursor *cursors;
+	binaryheap *heap;
+} KmerCountsMerge;
+
+// Bytes of an entry at most: two 10-byte variable-length integers
+#define KMER_SPECTRUM_MAX_ENTRY 20
+
+// Spectrum under construction
+typedef struct KmerSpectrumBuilder
+{
+	KmerSpectrum *spectrum;
+	Size size;
+	Size maxsize;
+	uint64 last;			  // right aligned bases of the last k-mer
+} KmerSpectrumBuilder;
+
+// Position in the entries of a spectrum
+typedef struct KmerSpectrumReader
+{
+	const uint8 *position;
+	const uint8 *end;
+	int k;
+	int32 read;				  // entries read so far
+	int32 count;
+	uint64 value;			  // right aligned bases of the last k-mer
+	int sqlerrcode;			  // raised on a malformed value
+} KmerSpectrumReader;
+
+/*****************************************************************************/
+
+/* Spectrum helper functions */
+
+// Checks that k is a valid k-mer length
+static inline void
+kmer_counts_check_length(int k)
+{
+	if (k <= 0 || k > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid KMER Length")));
+}
+
+// Greatest right aligned k-mer of length k
+static inline uint64
+kmer_spectrum_max_value(int k)
+{
+	return k == MAX_KMER_LENGTH ? PG_UINT64_MAX : (UINT64CONST(1) << (2 * k)) - 1;
+}
+
+// Writes an unsigned integer 7 bits a byte, low bits first
+static inline uint8 *
+kmer_spectrum_put_varint(uint8 *p, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (uint8)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (uint8)value;
+
+	return p;
+}
+
+static inline bool
+kmer_spectrum_get_varint(const uint8 **p, const uint8 *end, uint64 *value)
+{
+	uint64 result = 0;
+
+	for (int shift = 0; shift < 64 && *p < end; shift += 7)
+	{
+		uint8 byte = *(*p)++;
+
+		result |= (uint64)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+		{
+			*value = result;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+kmer_spectrum_begin(KmerSpectrumBuilder *builder, int k)
+{
+	builder->maxsize = offsetof(KmerSpectrum, data) + 1024;
+	builder->spectrum = (KmerSpectrum *)palloc(builder->maxsize);
+	builder->spectrum->k = k;
+	builder->spectrum->count = 0;
+	builder->size = offsetof(KmerSpectrum, data);
+	builder->last = 0;
+}
+
+// Appends the count of a k-mer greater than the previous one
+static void
+kmer_spectrum_add(KmerSpectrumBuilder *builder, uint64 bits, int64 count)
+{
+	KmerSpectrum *spectrum = builder->spectrum;
+	uint64 value = bits >> (64 - 2 * spectrum->k);
+	uint8 *p;
+
+	if (builder->size + KMER_SPECTRUM_MAX_ENTRY > builder->maxsize)
+	{
+		Size maxsize = Min(builder->maxsize * 2, MaxAllocSize);
+
+		if (builder->size + KMER_SPECTRUM_MAX_ENTRY > maxsize)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("KMer spectrum too large"),
+					 errdetail("The counts of more than %d distinct %d-mers exceed the maximum size of a value.",
+							   spectrum->count, spectrum->k)));
+
+		builder->spectrum = spectrum = (KmerSpectrum *)repalloc(spectrum, maxsize);
+		builder->maxsize = maxsize;
+	}
+
+	p = kmer_spectrum_put_varint((uint8 *)spectrum + builder->size,
+								 spectrum->count == 0 ? value : value - builder->last);
+	p = kmer_spectrum_put_varint(p, (uint64)count);
+
+	builder->size = p - (uint8 *)spectrum;
+	builder->last = value;
+	spectrum->count++;
+}
+
+static KmerSpectrum *
+kmer_spectrum_finish(KmerSpectrumBuilder *builder)
+{
+	SET_VARSIZE(builder->spectrum, builder->size);
+
+	return builder->spectrum;
+}
+
+static void
+kmer_spectrum_reader_init(KmerSpectrumReader *reader, const KmerSpectrum *spectrum, int sqlerrcode)
+{
+	reader->position = spectrum->data;
+	reader->end = (const uint8 *)spectrum + VARSIZE(spectrum);
+	reader->k = spectrum->k;
+	reader->read = 0;
+	reader->count = spectrum->count;
+	reader->value = 0;
+	reader->sqlerrcode = sqlerrcode;
+
+	if (VARSIZE(spectrum) < offsetof(KmerSpectrum, data) ||
+		reader->k <= 0 || reader->k > MAX_KMER_LENGTH || reader->count < 0)
+		ereport(ERROR,
+				(errcode(sqlerrcode),
+				 errmsg("Invalid KMer spectrum")));
+}
+
+// Next entry of a spectrum, checking that the k-mers increase and the
+// counts are positive
+static bool
+kmer_spectrum_read(KmerSpectrumReader *reader, uint64 *bits, int64 *count)
+{
+	uint64 delta, n;
+
+	if (reader->read == reader->count)
+	{
+		if (reader->position != reader->end)
+			ereport(ERROR,
+					(errcode(reader->sqlerrcode),
+					 errmsg("Invalid KMer spectrum")));
+		return false;
+	}
+
+	if (!kmer_spectrum_get_varint(&reader->position, reader->end, &delta) ||
+		!kmer_spectrum_get_varint(&reader->position, reader->end, &n) ||
+		n == 0 || n > (uint64)PG_INT64_MAX ||
+		(reader->read > 0 && delta == 0) ||
+		delta > kmer_spectrum_max_value(reader->k) - reader->value)
+		ereport(ERROR,
+				(errcode(reader->sqlerrcode),
+				 errmsg("Invalid KMer spectrum")));
+
+	reader->value += delta;
+	reader->read++;
+	*bits = reader->value << (64 - 2 * reader->k);
+	*count = (int64)n;
+
+	return true;
+}
+
+// Checks a spectrum read from outside
+static void
+kmer_spectrum_check(const KmerSpectrum *spectrum, int sqlerrcode)
+{
+	KmerSpectrumReader reader;
+	uint64 bits;
+	int64 count;
+
+	kmer_spectrum_reader_init(&reader, spectrum, sqlerrcode);
+	while (kmer_spectrum_read(&reader, &bits, &count))
+		;
+}
+
+/*****************************************************************************/
+
+/* Count table helper functions */
+
+// Creates an empty count table in the given memory context, spilled to disk
+// when it would take more than limit bytes
+static KmerCounts *
+kmer_counts_create(int k, MemoryContext context, uint32 size, Size limit)
+{
+	KmerCounts *counts = (KmerCounts *)MemoryContextAllocZero(context, sizeof(KmerCounts));
+
+	counts->k = k;
+	counts->table = kmercount_create(context, size, NULL);
+	counts->context = context;
+	counts->limit = limit;
+
+	return counts;
+}
+
+static int
+kmer_count_entry_cmp(const void *a, const void *b)
+{
+	uint64 bitsa = ((const KmerCountEntry *)a)->bits;
+	uint64 bitsb = ((const KmerCountEntry *)b)->bits;
+
+	return bitsa < bitsb ? -1 : bitsa > bitsb;
+}
+
+// Moves the entries of the table to the front of its array and sorts them.
+// The table can only be reset afterwards.
+static int64
+kmer_counts_sort_table(KmerCounts *counts)
+{
+	kmercount_hash *table = counts->table;
+	int64 n = 0;
+
+	for (uint64 i = 0; i < table->size; i++)
+	{
+		if (table->data[i].status == kmercount_SH_IN_USE)
+			table->data[n++] = table->data[i];
+	}
+
+	qsort(table->data, n, sizeof(KmerCountEntry), kmer_count_entry_cmp);
+
+	return n;
+}
+
+// Writes the entries of the table as a sorted run and empties the table
+static void
+kmer_counts_spill(KmerCounts *counts)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(counts->context);
+	int64 n = kmer_counts_sort_table(counts);
+	KmerCountRun *run;
+
+	if (counts->file == NULL)
+		counts->file = BufFileCreateTemp(false);
+
+	if (counts->nruns == counts->maxruns)
+	{
+		counts->maxruns = Max(counts->maxruns * 2, 8);
+		counts->runs = counts->runs == NULL
+						   ? (KmerCountRun *)palloc(sizeof(KmerCountRun) * counts->maxruns)
+						   : (KmerCountRun *)repalloc(counts->runs, sizeof(KmerCountRun) * counts->maxruns);
+	}
+
+	run = &counts->runs[counts->nruns++];
+	BufFileTell(counts->file, &run->fileno, &run->offset);
+	run->nentries = n;
+
+	for (int64 i = 0; i < n; i++)
+	{
+		KmerCountPair pair;
+
+		pair.bits = counts->table->data[i].bits;
+		pair.count = counts->table->data[i].count;
+		BufFileWrite(counts->file, &pair, sizeof(pair));
+	}
+
+	kmercount_reset(counts->table);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+// Adds count to the count of a k-mer. A table that has to grow past the
+// limit is spilled instead.
+static inline void
+kmer_counts_insert(KmerCounts *counts, uint64 bits, int64 count)
+{
+	kmercount_hash *table = counts->table;
+	KmerCountEntry *entry;
+	bool found;
+
+	if (counts->limit > 0 && table->members >= table->grow_threshold &&
+		table->size * 2 * sizeof(KmerCountEntry) > counts->limit)
+		kmer_counts_spill(counts);
+
+	entry = kmercount_insert(table, bits, &found);
+	if (found)
+		entry->count += count;
+	else
+		entry->count = count;
+}
+
+// Counts the k-mers of a DNA value, from an iterator prepared for counts->k
+static void
+kmer_counts_add(KmerCounts *counts, DnaKmerIterator *iter)
+{
+	uint64 bits;
+	int start;
+
+	while (dna_kmers_next(iter, &bits, &start))
+		kmer_counts_insert(counts, bits, 1);
+}
+
+// Loads the next entry of a cursor, reading the next buffer of a run on
+// disk when needed; false at the end of the run
+static bool
+kmer_count_cursor_next(KmerCounts *counts, KmerCountCursor *cursor)
+{
+	if (cursor->entries != NULL)
+	{
+		if (cursor->position == cursor->nentries)
+			return false;
+		cursor->bits = cursor->entries[cursor->position].bits;
+		cursor->count = cursor->entries[cursor->position].count;
+		cursor->position++;
+		return true;
+	}
+
+	if (cursor->position == cursor->nentries)
+	{
+		size_t bytes;
+
+		if (cursor->remaining == 0)
+			return false;
+
+		cursor->nentries = Min(cursor->remaining, cursor->maxbuffer);
+		bytes = sizeof(KmerCountPair) * cursor->nentries;
+		if (BufFileSeek(counts->file, cursor->fileno, cursor->offset, SEEK_SET) != 0 ||
+			BufFileRead(counts->file, cursor->buffer, bytes) != bytes)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read KMer counts from temporary file")));
+		BufFileTell(counts->file, &cursor->fileno, &cursor->offset);
+		cursor->remaining -= cursor->nentries;
+		cursor->position = 0;
+	}
+
+	cursor->bits = cursor->buffer[cursor->position].bits;
+	cursor->count = cursor->buffer[cursor->position].count;
+	cursor->position++;
+
+	return true;
+}
+
+// Min-heap order of the cursors by their current k-mer
+static int
+kmer_count_cursor_cmp(Datum a, Datum b, void *arg)
+{
+	KmerCountCursor *cursors = (KmerCountCursor *)arg;
+	uint64 bitsa = cursors[DatumGetInt32(a)].bits;
+	uint64 bitsb = cursors[DatumGetInt32(b)].bits;
+
+	return bitsa < bitsb ? 1 : -(bitsa > bitsb);
+}
+
+// Starts a merge of the runs and the table. The table is sorted in place,
+// so nothing can be counted afterwards. The runs share work_mem for their
+// buffers.
+static void
+kmer_counts_merge_begin(KmerCounts *counts, KmerCountsMerge *merge)
+{
+	int ncursors = counts->nruns + 1;
+	int maxbuffer = Max((int)Min(counts->limit / ncursors / sizeof(KmerCountPair), BLCKSZ), 64);
+	KmerCountCursor *cursor;
+
+	merge->counts = counts;
+	merge->cursors = (KmerCountCursor *)palloc0(sizeof(KmerCountCursor) * ncursors);
+	merge->heap = binaryheap_allocate(ncursors, kmer_count_cursor_cmp, merge->cursors);
+
+	for (int i = 0; i < counts->nruns; i++)
+	{
+		cursor = &merge->cursors[i];
+		cursor->buffer = (KmerCountPair *)palloc(sizeof(KmerCountPair) * maxbuffer);
+		cursor->maxbuffer = maxbuffer;
+		cursor->fileno = counts->runs[i].fileno;
+		cursor->offset = counts->runs[i].offset;
+		cursor->remaining = counts->runs[i].nentries;
+		if (kmer_count_cursor_next(counts, cursor))
+			binaryheap_add_unordered(merge->heap, Int32GetDatum(i));
+	}
+
+	cursor = &merge->cursors[counts->nruns];
+	cursor->entries = counts->table->data;
+	cursor->nentries = kmer_counts_sort_table(counts);
+	if (kmer_count_cursor_next(counts, cursor))
+		binaryheap_add_unordered(merge->heap, Int32GetDatum(counts->nruns));
+
+	binaryheap_build(merge->heap);
+}
+
+// Next k-mer in order, with its counts summed over the runs
+static bool
+kmer_counts_merge_next(KmerCountsMerge *merge, uint64 *bits, int64 *count)
+{
+	if (binaryheap_empty(merge->heap))
+		return false;
+
+	*bits = merge->cursors[DatumGetInt32(binaryheap_first(merge->heap))].bits;
+	*count = 0;
+
+	while (!binaryheap_empty(merge->heap))
+	{
+		int i = DatumGetInt32(binaryheap_first(merge->heap));
+		KmerCountCursor *cursor = &merge->cursors[i];
+
+		if (cursor->bits != *bits)
+			break;
+
+		*count += cursor->count;
+		if (kmer_count_cursor_next(merge->counts, cursor))
+			binaryheap_replace_first(merge->heap, Int32GetDatum(i));
+		else
+			binaryheap_remove_first(merge->heap);
+	}
+
+	return true;
+}
+
+// Releases the buffers of a merge and the runs on disk
+static void
+kmer_counts_merge_end(KmerCountsMerge *merge)
+{
+	KmerCounts *counts = merge->counts;
+
+	for (int i = 0; i < counts->nruns; i++)
+		pfree(merge->cursors[i].buffer);
+	pfree(merge->cursors);
+	binaryheap_free(merge->heap);
+
+	if (counts->file != NULL)
+	{
+		BufFileClose(counts->file);
+		counts->file = NULL;
+	}
+	counts->nruns = 0;
+}
+
+// Spectrum of all the counts. Consumes the counts.
+static KmerSpectrum *
+kmer_counts_get_spectrum(KmerCounts *counts)
+{
+	KmerSpectrumBuilder builder;
+	KmerCountsMerge merge;
+	uint64 bits;
+	int64 count;
+
+	kmer_spectrum_begin(&builder, counts->k);
+	kmer_counts_merge_begin(counts, &merge);
+	while (kmer_counts_merge_next(&merge, &bits, &count))
+		kmer_spectrum_add(&builder, bits, count);
+	kmer_counts_merge_end(&merge);
+
+	return kmer_spectrum_finish(&builder);
+}
+
+// Adds all counts of another table with the same k, or of the spectrum of
+// a worker. Consumes the other.
+static void
+kmer_counts_merge(KmerCounts *counts, KmerCounts *other)
+{
+	uint64 bits;
+	int64 count;
+
+	if (counts->k != other->k)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("KMER Length must be the same for all rows")));
+
+	if (other->spectrum != NULL)
+	{
+		KmerSpectrumReader reader;
+
+		kmer_spectrum_reader_init(&reader, other->spectrum, ERRCODE_DATA_CORRUPTED);
+		while (kmer_spectrum_read(&reader, &bits, &count))
+			kmer_counts_insert(counts, bits, count);
+	}
+	else
+	{
+		KmerCountsMerge merge;
+
+		kmer_counts_merge_begin(other, &merge);
+		while (kmer_counts_merge_next(&merge, &bits, &count))
+			kmer_counts_insert(counts, bits, count);
+		kmer_counts_merge_end(&merge);
+	}
+}
+
+/*****************************************************************************/
+
+/* Input and Output Functions */
+
+// Text form: k=<k>: then kmer=count pairs in k-mer order, separated by
+// commas. The input accepts the pairs in any order and sums repeated k-mers.
+PG_FUNCTION_INFO_V1(kmer_spectrum_in);
+Datum kmer_spectrum_in(PG_FUNCTION_ARGS)
+{
+	char *input = PG_GETARG_CSTRING(0);
+	KmerSpectrumBuilder builder;
+	KmerCountEntry *entries;
+	int nentries = 0;
+	int maxentries = 64;
+	int k;
+	int offset = -1;
+	char *p;
+	int i;
+
+	if (sscanf(input, "k=%d:%n", &k, &offset) != 1 || offset < 0 || k <= 0 || k > MAX_KMER_LENGTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("Invalid KMer spectrum"),
+				 errdetail("A spectrum is \"k=<k>:\" followed by <kmer>=<count> pairs separated by commas.")));
+
+	entries = (KmerCountEntry *)palloc(sizeof(KmerCountEntry) * maxentries);
+
+	for (p = input + offset; *p != '\0';)
+	{
+		char bases[MAX_KMER_LENGTH];
+		char *end;
+		int64 count;
+
+		for (i = 0; i < k && p[i] != '\0'; i++)
+		{
+			bases[i] = pg_ascii_tolower((unsigned char)p[i]);
+			if (bases[i] != 'a' && bases[i] != 'c' && bases[i] != 'g' && bases[i] != 't')
+				break;
+		}
+		if (i != k || p[k] != '=')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("Invalid KMer spectrum"),
+					 errdetail("Expected a %d-mer at \"%s\".", k, p)));
+		p += k + 1;
+
+		errno = 0;
+		count = strtoi64(p, &end, 10);
+		if (end == p || errno != 0 || count <= 0 || (*end != ',' && *end != '\0') ||
+			(*end == ',' && end[1] == '\0'))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("Invalid KMer spectrum"),
+					 errdetail("Expected a positive count at \"%s\".", p)));
+		p = *end == ',' ? end + 1 : end;
+
+		if (nentries == maxentries)
+		{
+			maxentries *= 2;
+			entries = (KmerCountEntry *)repalloc_huge(entries, sizeof(KmerCountEntry) * maxentries);
+		}
+		entries[nentries].bits = kmer_pack_chars(bases, k);
+		entries[nentries].count = count;
+		nentries++;
+	}
+
+	qsort(entries, nentries, sizeof(KmerCountEntry), kmer_count_entry_cmp);
+
+	kmer_spectrum_begin(&builder, k);
+	for (i = 0; i < nentries; i++)
+	{
+		int64 count = entries[i].count;
+
+		while (i + 1 < nentries && entries[i + 1].bits == entries[i].bits)
+		{
+			if (pg_add_s64_overflow(count, entries[++i].count, &count))
+				ereport(ERROR,
+						(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+						 errmsg("KMer count out of range")));
+		}
+		kmer_spectrum_add(&builder, entries[i].bits, count);
+	}
+
+	PG_RETURN_POINTER(kmer_spectrum_finish(&builder));
+}
+
+PG_FUNCTION_INFO_V1(kmer_spectrum_out);
+Datum kmer_spectrum_out(PG_FUNCTION_ARGS)
+{
+	KmerSpectrum *spectrum = PG_GETARG_KMER_SPECTRUM_P(0);
+	KmerSpectrumReader reader;
+	StringInfoData buf;
+	char bases[MAX_KMER_LENGTH];
+	uint64 bits;
+	int64 count;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "k=%d:", spectrum->k);
+
+	kmer_spectrum_reader_init(&reader, spectrum, ERRCODE_DATA_CORRUPTED);
+	while (kmer_spectrum_read(&reader, &bits, &count))
+	{
+		if (reader.read > 1)
+			appendStringInfoChar(&buf, ',');
+		kmer_unpack_chars(bits, spectrum->k, bases);
+		appendBinaryStringInfo(&buf, bases, spectrum->k);
+		appendStringInfo(&buf, "=%lld", (long long)count);
+	}
+
+	PG_RETURN_CSTRING(buf.data);
+}
+
+// Binary form: k and the number of k-mers as 4-byte integers, then the
+// entries as stored
+PG_FUNCTION_INFO_V1(kmer_spectrum_recv);
+Datum kmer_spectrum_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo buf = (StringInfo)PG_GETARG_POINTER(0);
+	int k = pq_getmsgint(buf, 4);
+	int count = pq_getmsgint(buf, 4);
+	int nbytes = buf->len - buf->cursor;
+	KmerSpectrum *spectrum = (KmerSpectrum *)palloc(offsetof(KmerSpectrum, data) + nbytes);
+
+	SET_VARSIZE(spectrum, offsetof(KmerSpectrum, data) + nbytes);
+	spectrum->k = k;
+	spectrum->count = count;
+	pq_copymsgbytes(buf, (char *)spectrum->data, nbytes);
+	pq_getmsgend(buf);
+
+	kmer_spectrum_check(spectrum, ERRCODE_INVALID_BINARY_REPRESENTATION);
+
+	PG_RETURN_POINTER(spectrum);
+}
+
+PG_FUNCTION_INFO_V1(kmer_spectrum_send);
+Datum kmer_spectrum_send(PG_FUNCTION_ARGS)
+{
+	KmerSpectrum *spectrum = PG_GETARG_KMER_SPECTRUM_P(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, spectrum->k);
+	pq_sendint32(&buf, spectrum->count);
+	pq_sendbytes(&buf, (const char *)spectrum->data, VARSIZE(spectrum) - offsetof(KmerSpectrum, data));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*****************************************************************************/
+
+/* Spectrum functions */
+
+// Number of distinct k-mers of a spectrum
+PG_FUNCTION_INFO_V1(kmer_spectrum_cardinality);
+Datum kmer_spectrum_cardinality(PG_FUNCTION_ARGS)
+{
+	KmerSpectrum *spectrum = PG_GETARG_KMER_SPECTRUM_P(0);
+
+	PG_RETURN_INT32(spectrum->count);
+}
+
+// Counts of a spectrum as (kmer, count) rows, in k-mer order
+PG_FUNCTION_INFO_V1(kmer_spectrum_unnest);
+Datum kmer_spectrum_unnest(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	KmerSpectrum *spectrum = PG_GETARG_KMER_SPECTRUM_P(0);
+	KmerSpectrumReader reader;
+	char buffer[KMER_PACKED_SIZE(MAX_KMER_LENGTH)];
+	KMER *kmer = (KMER *)buffer;
+	Datum values[2];
+	bool nulls[2] = {false, false};
+	uint64 bits;
+	int64 count;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	values[0] = PointerGetDatum(kmer);
+	kmer_spectrum_reader_init(&reader, spectrum, ERRCODE_DATA_CORRUPTED);
+	while (kmer_spectrum_read(&reader, &bits, &count))
+	{
+		kmer_set_bits(kmer, bits, spectrum->k);
+		values[1] = Int64GetDatum(count);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum)0;
+}
+
+/*****************************************************************************/
+
+/* K-mer spectrum of one sequence */
+PG_FUNCTION_INFO_V1(kmer_spectrum);
+Datum kmer_spectrum(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	int k = PG_GETARG_INT32(1);
+	char buffer[KMER_PACKED_SIZE(MAX_KMER_LENGTH)];
+	KMER *kmer = (KMER *)buffer;
+	Datum values[2];
+	bool nulls[2] = {false, false};
+	KmerCounts *counts;
+	KmerCountsMerge merge;
+	DnaKmerIterator kmers;
+	uint64 bits;
+	int64 count;
+	uint32 size;
+
+	kmer_counts_check_length(k);
+
+	// Same error as generate_kmers for sequences shorter than k
+	dna_kmers_init(&kmers, PG_GETARG_DATUM(0), k);
+	if (kmers.reader.length < k)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("Invalid KMER Length")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	/* There are no more distinct k-mers than windows, or 4^k */
+	size = Min(kmers.reader.length - k + 1, KMER_COUNTS_INITIAL_SIZE);
+	if (k < 16)
+		size = Min(size, (uint32)1 << (2 * k));
+
+	counts = kmer_counts_create(k, CurrentMemoryContext, size, (Size)work_mem * 1024);
+	kmer_counts_add(counts, &kmers);
+
+	values[0] = PointerGetDatum(kmer);
+	kmer_counts_merge_begin(counts, &merge);
+	while (kmer_counts_merge_next(&merge, &bits, &count))
+	{
+		kmer_set_bits(kmer, bits, k);
+		values[1] = Int64GetDatum(count);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	kmer_counts_merge_end(&merge);
+
+	kmercount_destroy(counts->table);
+
+	return (Datum)0;
+}
+
+/*****************************************************************************/
+
+/* Aggregate functions */
+
+// Transition function of kmer_spectrum_agg
+PG_FUNCTION_INFO_V1(kmer_spectrum_transfn);
+Datum kmer_spectrum_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	KmerCounts *counts = PG_ARGISNULL(0) ? NULL : (KmerCounts *)PG_GETARG_POINTER(0);
+	DnaKmerIterator kmers;
+	int k;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "kmer_spectrum_transfn called in non-aggregate context");
+
+	// Rows with a null sequence or length are ignored
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		if (counts == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(counts);
+	}
+
+	k = PG_GETARG_INT32(2);
+	kmer_counts_check_length(k);
+
+	if (counts == NULL)
+		counts = kmer_counts_create(k, aggcontext, KMER_COUNTS_INITIAL_SIZE, (Size)work_mem * 1024);
+	else if (counts->k != k)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("KMER Length must be the same for all rows")));
+
+	dna_kmers_init(&kmers, PG_GETARG_DATUM(1), k);
+	kmer_counts_add(counts, &kmers);
+
+	PG_RETURN_POINTER(counts);
+}
+
+// Combine function of kmer_spectrum_agg, merging the counts of two workers
+PG_FUNCTION_INFO_V1(kmer_spectrum_combinefn);
+Datum kmer_spectrum_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	KmerCounts *counts1 = PG_ARGISNULL(0) ? NULL : (KmerCounts *)PG_GETARG_POINTER(0);
+	KmerCounts *counts2 = PG_ARGISNULL(1) ? NULL : (KmerCounts *)PG_GETARG_POINTER(1);
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "kmer_spectrum_combinefn called in non-aggregate context");
+
+	if (counts2 == NULL)
+	{
+		if (counts1 == NULL)
+			PG_RETURN_NULL();
+		PG_RETURN_POINTER(counts1);
+	}
+
+	// The state has to live in the aggregate context, so merge the first one
+	// into a new table there
+	if (counts1 == NULL)
+		counts1 = kmer_counts_create(counts2->k, aggcontext, KMER_COUNTS_INITIAL_SIZE,
+									 (Size)work_mem * 1024);
+
+	kmer_counts_merge(counts1, counts2);
+
+	PG_RETURN_POINTER(counts1);
+}
+
+// Serialize function of kmer_spectrum_agg: the kmer_spectrum of the counts,
+// a few bytes per k-mer. Counts too large for one value raise the same
+// error as the final function.
+PG_FUNCTION_INFO_V1(kmer_spectrum_serialfn);
+Datum kmer_spectrum_serialfn(PG_FUNCTION_ARGS)
+{
+	KmerCounts *counts = (KmerCounts *)PG_GETARG_POINTER(0);
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "kmer_spectrum_serialfn called in non-aggregate context");
+
+	PG_RETURN_BYTEA_P(kmer_counts_get_spectrum(counts));
+}
+
+// Deserialize function of kmer_spectrum_agg. The spectrum is kept as it is
+// and read by the combine function, rather than expanded into a table.
+PG_FUNCTION_INFO_V1(kmer_spectrum_deserialfn);
+Datum kmer_spectrum_deserialfn(PG_FUNCTION_ARGS)
+{
+	KmerSpectrum *spectrum = (KmerSpectrum *)PG_GETARG_BYTEA_P_COPY(0);
+	KmerCounts *counts;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "kmer_spectrum_deserialfn called in non-aggregate context");
+
+	if (VARSIZE(spectrum) < offsetof(KmerSpectrum, data))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("Invalid KMer spectrum")));
+
+	counts = (KmerCounts *)palloc0(sizeof(KmerCounts));
+	counts->k = spectrum->k;
+	counts->context = CurrentMemoryContext;
+	counts->spectrum = spectrum;
+
+	PG_RETURN_POINTER(counts);
+}
+
+// Final function of kmer_spectrum_agg, returning the kmer_spectrum of all
+// rows. The counts are merged in place, hence FINALFUNC_MODIFY = READ_WRITE.
+PG_FUNCTION_INFO_V1(kmer_spectrum_finalfn);
+Datum kmer_spectrum_finalfn(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(kmer_counts_get_spectrum((KmerCounts *)PG_GETARG_POINTER(0)));
+}
@@ -21,36 +21,29 @@
 /*****************************************************************************/
 
 /*SP-Gist index helper functions*/
-// Create a new KMER
+// Create a new KMER from left aligned packed bases
 static inline Datum
-formKmerDatum(const char *data, int datalen)
+formKmerDatum(uint64 bits, int datalen)
 {
-    char *kmer;
-
-    // Ensure that the data length fits within a short header
-    Assert(datalen + VARHDRSZ_SHORT <= VARATT_SHORT_MAX);
-
-    kmer = (char *)palloc(datalen + VARHDRSZ_SHORT);
-    SET_VARSIZE_SHORT(kmer, datalen + VARHDRSZ_SHORT);
-    if (datalen)
-        memcpy(VARDATA_ANY(kmer), data, datalen);
+    // Ensure that the packed k-mer fits within a short header
+    Assert(KMER_PACKED_SIZE(datalen) <= VARATT_SHORT_MAX);
 
     // Return the KMER structure as a Datum
-    return PointerGetDatum(kmer);
+    return PointerGetDatum(kmer_from_bits(bits, datalen));
 }
 
-// Checks if two kmers have the same prefix
-static inline int
-commonPrefix(const char *a, const char *b, int lena, int lenb)
+// Node label for the base at position i of a packed k-mer
+static inline int16
+nodeCharAt(uint64 bits, int i)
 {
-    int i = 0;
-    while (i < lena && i < lenb && *a == *b)
-    {
-        a++;
-        b++;
-        i++;
-    }
-    return i;
+    return (int16) kmer_nucleotides[KMER_CODE_AT(bits, i)];
+}
+
+// Left aligned 2-bit code for a node label
+static inline uint64
+nodeCharCode(int16 c)
+{
+    return nucleotide_code((char) c) << 62;
 }
 
 // Qsort comparator to sort spgNodePtr structs by "c"
@@ -95,6 +88,92 @@ searchChar(Datum *nodeLabels, int nNodes, int16 c, int *i)
     return false;
 }
 
+// Compiles the scan and ordering keys into packed form. The root inner
+// tuple compiles them once per index scan into the traversal memory, which
+// lives until the next rescan, and every child gets the result through its
+// traversal value.
+const KmerScanQuery *
+kmerScanQuery(ScanKey scankeys, int nkeys, ScanKey orderbys, int norderbys,
+              void *traversalValue, MemoryContext traversalCxt)
+{
+    KmerScanQuery *query;
+    int j;
+
+    if (traversalValue)
+        return ((KmerTraversal *)traversalValue)->query;
+
+    query = (KmerScanQuery *)MemoryContextAlloc(traversalCxt,
+                                                offsetof(KmerScanQuery, keys) +
+                                                (nkeys + norderbys) * sizeof(KmerScanKey));
+    query->nkeys = nkeys;
+    query->norderbys = norderbys;
+
+    for (j = 0; j < nkeys + norderbys; j++)
+    {
+        KmerScanKey *key = &query->keys[j];
+        ScanKey scankey = j < nkeys ? &scankeys[j] : &orderbys[j - nkeys];
+        Datum arg = scankey->sk_argument;
+
+        key->strategy = scankey->sk_strategy;
+        switch (key->strategy)
+        {
+        case BTEqualStrategyNumber:
+        case RTPrefixStrategyNumber:
+        case RTKNNSearchStrategyNumber:
+            key->length = kmer_get_length((KMER *)DatumGetPointer(arg));
+            key->bits = kmer_get_bits((KMER *)DatumGetPointer(arg));
+            break;
+        case RTContainsStrategyNumber:
+        case RTContainedByStrategyNumber:
+            key->length = qkmer_get_length((QKMER *)DatumGetPointer(arg));
+            qkmer_get_mask((QKMER *)DatumGetPointer(arg), key->mask);
+            break;
+        case KmerWithinStrategyNumber:
+            if (!hamming_ball_get(arg, &key->bits, &key->length, &key->radius))
+                key->radius = -1;
+            break;
+        default:
+            elog(ERROR, "unrecognized strategy number: %d", key->strategy);
+            break;
+        }
+    }
+
+    return query;
+}
+
+// Least distances from the ordering keys of any k-mer starting with the
+// given prefix, or of the k-mer itself when exact
+double *
+kmerOrderByDistances(const KmerScanQuery *query, uint64 bits, int length, bool exact)
+{
+    double *distances = (double *)palloc(sizeof(double) * query->norderbys);
+    int j;
+
+    for (j = 0; j < query->norderbys; j++)
+    {
+        const KmerScanKey *key = &query->keys[query->nkeys + j];
+
+        distances[j] = exact ? kmer_hamming_bits(bits, length, key->bits, key->length)
+                             : kmer_hamming_bound(bits, length, key->bits, key->length);
+    }
+
+    return distances;
+}
+
+// Traversal value for a child of an inner tuple. Core frees each traversal
+// value on its own, so this is the one allocation made per visited child.
+void *
+kmerTraversalValue(const KmerScanQuery *query, uint64 bits, int length,
+                   MemoryContext traversalCxt)
+{
+    KmerTraversal *traversal = (KmerTraversal *)MemoryContextAlloc(traversalCxt, sizeof(KmerTraversal));
+
+    traversal->query = query;
+    traversal->bits = bits;
+    traversal->length = length;
+    return traversal;
+}
+
 /*****************************************************************************/
 
 /*SP-Gist index functions implementation*/
@@ -122,9 +201,10 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 	spgChooseOut *out = (spgChooseOut *)PG_GETARG_POINTER(1);
 
 	KMER *inKmer = (KMER *)DatumGetPointer(in->datum);
-	char *inStr = VARDATA_ANY(inKmer);
-	int inSize = VARSIZE_ANY_EXHDR(inKmer);
-	char *prefixStr = NULL;
+	uint64 inBits = kmer_get_bits(inKmer);
+	int inSize = kmer_get_length(inKmer);
+	uint64 restBits = kmer_suffix_bits(inBits, in->level);
+	uint64 prefixBits = 0;
 	int prefixSize = 0;
 	int commonLen = 0;
 	int16 nodeChar = 0;
@@ -134,18 +214,18 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 	if (in->hasPrefix)
 	{
 		KMER *prefixKmer = (KMER *)DatumGetPointer(in->prefixDatum);
-		prefixStr = VARDATA_ANY(prefixKmer);
-		prefixSize = VARSIZE_ANY_EXHDR(prefixKmer);
+		prefixBits = kmer_get_bits(prefixKmer);
+		prefixSize = kmer_get_length(prefixKmer);
 
-		commonLen = commonPrefix(inStr + in->level,
-								 prefixStr,
-								 inSize - in->level,
-								 prefixSize);
+		commonLen = kmer_common_prefix(restBits,
+									   inSize - in->level,
+									   prefixBits,
+									   prefixSize);
 
 		if (commonLen == prefixSize)
 		{
 			if (inSize - in->level > commonLen)
-				nodeChar = *(unsigned char *)(inStr + in->level + commonLen);
+				nodeChar = nodeCharAt(restBits, commonLen);
 			else
 				nodeChar = -1;
 		}
@@ -162,13 +242,13 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 			{
 				out->result.splitTuple.prefixHasPrefix = true;
 				out->result.splitTuple.prefixPrefixDatum =
-					formKmerDatum(prefixStr, commonLen);
+					formKmerDatum(prefixBits, commonLen);
 			}
 			out->result.splitTuple.prefixNNodes = 1;
 			out->result.splitTuple.prefixNodeLabels =
 				(Datum *)palloc(sizeof(Datum));
 			out->result.splitTuple.prefixNodeLabels[0] =
-				Int16GetDatum(*(unsigned char *)(prefixStr + commonLen));
+				Int16GetDatum(nodeCharAt(prefixBits, commonLen));
 
 			out->result.splitTuple.childNodeN = 0;
 
@@ -180,7 +260,7 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 			{
 				out->result.splitTuple.postfixHasPrefix = true;
 				out->result.splitTuple.postfixPrefixDatum =
-					formKmerDatum(prefixStr + commonLen + 1,
+					formKmerDatum(kmer_suffix_bits(prefixBits, commonLen + 1),
 								  prefixSize - commonLen - 1);
 			}
 
@@ -189,7 +269,7 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 	}
 	else if (inSize > in->level)
 	{
-		nodeChar = *(unsigned char *)(inStr + in->level);
+		nodeChar = nodeCharAt(restBits, 0);
 	}
 	else
 	{
@@ -215,11 +295,11 @@ Datum kmer_choose(PG_FUNCTION_ARGS)
 		out->result.matchNode.levelAdd = levelAdd;
 		if (inSize - in->level - levelAdd > 0)
 			out->result.matchNode.restDatum =
-				formKmerDatum(inStr + in->level + levelAdd,
+				formKmerDatum(kmer_suffix_bits(restBits, levelAdd),
 							  inSize - in->level - levelAdd);
 		else
 			out->result.matchNode.restDatum =
-				formKmerDatum(NULL, 0);
+				formKmerDatum(0, 0);
 	}
 	else if (in->allTheSame)
 	{
@@ -257,17 +337,18 @@ Datum kmer_picksplit(PG_FUNCTION_ARGS)
 	spgPickSplitOut *out = (spgPickSplitOut *)PG_GETARG_POINTER(1);
 
 	KMER *kmer0 = (KMER *)DatumGetPointer(in->datums[0]);
+	uint64 bits0 = kmer_get_bits(kmer0);
 	int i, commonLen;
 	spgNodePtr *nodes;
 
 	/* Identify longest common prefix length among k-mers */
-	commonLen = VARSIZE_ANY_EXHDR(kmer0);
+	commonLen = kmer_get_length(kmer0);
 
 	for (i = 1; i < in->nTuples && commonLen > 0; i++)
 	{
 		KMER *kmeri = (KMER *)DatumGetPointer(in->datums[i]);
-		int tmp = commonPrefix(VARDATA_ANY(kmer0), VARDATA_ANY(kmeri),
-							   VARSIZE_ANY_EXHDR(kmer0), VARSIZE_ANY_EXHDR(kmeri));
+		int tmp = kmer_common_prefix(bits0, kmer_get_length(kmer0),
+									 kmer_get_bits(kmeri), kmer_get_length(kmeri));
 		if (tmp < commonLen)
 			commonLen = tmp;
 	}
@@ -280,7 +361,7 @@ Datum kmer_picksplit(PG_FUNCTION_ARGS)
 	else
 	{
 		out->hasPrefix = true;
-		out->prefixDatum = formKmerDatum(VARDATA_ANY(kmer0), commonLen);
+		out->prefixDatum = formKmerDatum(bits0, commonLen);
 	}
 
 	/* Initialize node pointers based on first non-common byte */
@@ -290,8 +371,8 @@ Datum kmer_picksplit(PG_FUNCTION_ARGS)
 	{
 		KMER *kmeri = (KMER *)DatumGetPointer(in->datums[i]);
 
-		if (commonLen < VARSIZE_ANY_EXHDR(kmeri))
-			nodes[i].c = *(unsigned char *)(VARDATA_ANY(kmeri) + commonLen);
+		if (commonLen < kmer_get_length(kmeri))
+			nodes[i].c = nodeCharAt(kmer_get_bits(kmeri), commonLen);
 		else
 			nodes[i].c = -1; /* all characters are common */
 		nodes[i].i = i;
@@ -318,14 +399,14 @@ Datum kmer_picksplit(PG_FUNCTION_ARGS)
 			out->nNodes++;
 		}
 
-		if (commonLen < VARSIZE_ANY_EXHDR(kmeri))
+		if (commonLen < kmer_get_length(kmeri))
 		{
-			leafD = formKmerDatum(VARDATA_ANY(kmeri) + commonLen + 1,
-								  VARSIZE_ANY_EXHDR(kmeri) - commonLen - 1);
+			leafD = formKmerDatum(kmer_suffix_bits(kmer_get_bits(kmeri), commonLen + 1),
+								  kmer_get_length(kmeri) - commonLen - 1);
 		}
 		else
 		{
-			leafD = formKmerDatum(NULL, 0);
+			leafD = formKmerDatum(0, 0);
 		}
 
 		out->leafTupleDatums[nodes[i].i] = leafD;
@@ -342,43 +423,45 @@ Datum kmer_inner_consistent(PG_FUNCTION_ARGS)
 	spgInnerConsistentIn *in = (spgInnerConsistentIn *)PG_GETARG_POINTER(0);
 	spgInnerConsistentOut *out = (spgInnerConsistentOut *)PG_GETARG_POINTER(1);
 
-	KMER *reconstructedValue;
-	KMER *reconstrKmer;
+	const KmerScanQuery *query;
+	KmerTraversal *traversal = (KmerTraversal *)in->traversalValue;
+	uint64 reconstrBits = 0;
 	int maxReconstrLen;
-	KMER *prefixKmer = NULL;
-	int prefixSize = 0;
 	int i;
 
-	/* Initialize the reconstructed value */
-	reconstructedValue = (KMER *)DatumGetPointer(in->reconstructedValue);
-	Assert(reconstructedValue == NULL ? in->level == 0 : VARSIZE_ANY_EXHDR(reconstructedValue) == in->level);
+	query = kmerScanQuery(in->scankeys, in->nkeys, in->orderbys, in->norderbys,
+						  in->traversalValue, in->traversalMemoryContext);
+
+	/* Initialize the reconstructed value from the traversal value */
+	Assert(traversal == NULL ? in->level == 0 : traversal->length == in->level);
+
+	if (in->level)
+		reconstrBits = traversal->bits;
 
 	maxReconstrLen = in->level + 1; /* Start with current level length */
 	if (in->hasPrefix)
 	{
-		prefixKmer = (KMER *)DatumGetPointer(in->prefixDatum);
-		prefixSize = VARSIZE_ANY_EXHDR(prefixKmer);
+		KMER *prefixKmer = (KMER *)DatumGetPointer(in->prefixDatum);
+		int prefixSize = kmer_get_length(prefixKmer);
+
+		/* Append the prefix to the reconstructed k-mer */
+		reconstrBits = kmer_append_bits(reconstrBits, in->level, kmer_get_bits(prefixKmer));
 		maxReconstrLen += prefixSize;
 	}
 
-	/* Allocate and construct the new reconstructed k-mer */
-	reconstrKmer = (KMER *)palloc(VARHDRSZ_SHORT + maxReconstrLen);
-	SET_VARSIZE_SHORT(reconstrKmer, VARHDRSZ_SHORT + maxReconstrLen);
-
-	if (in->level)
-		memcpy(VARDATA_ANY(reconstrKmer), VARDATA_ANY(reconstructedValue), in->level);
-	if (prefixSize)
-		memcpy(((char *)VARDATA_ANY(reconstrKmer)) + in->level, VARDATA_ANY(prefixKmer), prefixSize);
-
 	/* Initialize output arrays */
 	out->nodeNumbers = (int *)palloc(sizeof(int) * in->nNodes);
 	out->levelAdds = (int *)palloc(sizeof(int) * in->nNodes);
-	out->reconstructedValues = (Datum *)palloc(sizeof(Datum) * in->nNodes);
+	out->reconstructedValues = NULL;
+	out->traversalValues = (void **)palloc(sizeof(void *) * in->nNodes);
+	if (query->norderbys > 0)
+		out->distances = (double **)palloc(sizeof(double *) * in->nNodes);
 	out->nNodes = 0;
 
 	for (i = 0; i < in->nNodes; i++)
 	{
 		int16 nodeChar = DatumGetInt16(in->nodeLabels[i]);
+		uint64 thisBits = reconstrBits;
 		int thisLen;
 		bool res = true;
 		int j;
@@ -388,54 +471,37 @@ Datum kmer_inner_consistent(PG_FUNCTION_ARGS)
 			thisLen = maxReconstrLen - 1;
 		else
 		{
-			((unsigned char *)VARDATA_ANY(reconstrKmer))[maxReconstrLen - 1] = nodeChar;
+			thisBits = kmer_append_bits(reconstrBits, maxReconstrLen - 1, nodeCharCode(nodeChar));
 			thisLen = maxReconstrLen;
 		}
 
-		for (j = 0; j < in->nkeys; j++)
+		/*
+		 * The bases before in->level were checked on the way down, so only
+		 * the ones added by this tuple's prefix and node label are tested.
+		 */
+		for (j = 0; j < query->nkeys; j++)
 		{
-			StrategyNumber strategy = in->scankeys[j].sk_strategy;
-			Datum arg = in->scankeys[j].sk_argument;
-			int r;
-			int inSize;
-			KMER *inKmer;
-			QKMER *inQkmer;
+			const KmerScanKey *key = &query->keys[j];
 
 			/* Apply the strategy for comparisons */
-			switch (strategy)
+			switch (key->strategy)
 			{
 			case BTEqualStrategyNumber:
-				inKmer = (KMER *)DatumGetPointer(arg);
-				inSize = VARSIZE_ANY_EXHDR(inKmer);
-				r = memcmp(VARDATA_ANY(reconstrKmer), VARDATA_ANY(inKmer), Min(inSize, thisLen));
-				if (r != 0 || inSize < thisLen)
-					res = false;
+				res = (key->length >= thisLen) &&
+					((thisBits ^ key->bits) & kmer_range_mask(in->level, thisLen)) == 0;
 				break;
 			case RTContainsStrategyNumber:
 			case RTContainedByStrategyNumber:
-				inQkmer = (QKMER *)DatumGetPointer(arg);
-				inSize = VARSIZE_ANY_EXHDR(inQkmer);
-				res = (inSize >= thisLen);
-                if (res) {
-                    char *qkmer_str = VARDATA_ANY(inQkmer);
-                    char *kmer_str = VARDATA_ANY(reconstrKmer);
-                    for (int i = 0; i < thisLen; i++) {
-                    	if (!match(qkmer_str[i], kmer_str[i])) {
-                    		res = false;
-                    		break;
-                    	}
-                    }
-                }
+				res = (key->length >= thisLen) &&
+					qkmer_match_range(key->mask, thisBits, in->level, thisLen);
 				break;
 			case RTPrefixStrategyNumber:
-				inKmer = (KMER *)DatumGetPointer(arg);
-				inSize = VARSIZE_ANY_EXHDR(inKmer);
-				r = memcmp(VARDATA_ANY(reconstrKmer), VARDATA_ANY(inKmer), Min(inSize, thisLen));
-				if (r != 0)
-					res = false;
+				res = ((thisBits ^ key->bits) &
+					   kmer_range_mask(in->level, Min(key->length, thisLen))) == 0;
 				break;
-			default:
-				elog(ERROR, "unrecognized strategy number: %d", in->scankeys[j].sk_strategy);
+			case KmerWithinStrategyNumber:
+				/* Prune once the prefix alone exceeds the mismatch budget */
+				res = kmer_hamming_bound(thisBits, thisLen, key->bits, key->length) <= key->radius;
 				break;
 			}
 
@@ -449,9 +515,11 @@ Datum kmer_inner_consistent(PG_FUNCTION_ARGS)
 			out->nodeNumbers[out->nNodes] = i;
 			out->levelAdds[out->nNodes] = thisLen - in->level;
 
-			/* Store reconstructed k-mer as a Datum */
-			SET_VARSIZE_SHORT(reconstrKmer, VARHDRSZ_SHORT + thisLen);
-			out->reconstructedValues[out->nNodes] = datumCopy(PointerGetDatum(reconstrKmer), false, -1);
+			/* Pass the reconstructed k-mer down in the traversal value */
+			out->traversalValues[out->nNodes] = kmerTraversalValue(query, thisBits, thisLen,
+																   in->traversalMemoryContext);
+			if (query->norderbys > 0)
+				out->distances[out->nNodes] = kmerOrderByDistances(query, thisBits, thisLen, false);
 			out->nNodes++;
 		}
 	}
@@ -466,94 +534,60 @@ Datum kmer_leaf_consistent(PG_FUNCTION_ARGS)
 	spgLeafConsistentIn *in = (spgLeafConsistentIn *)PG_GETARG_POINTER(0);
 	spgLeafConsistentOut *out = (spgLeafConsistentOut *)PG_GETARG_POINTER(1);
 
+	const KmerScanQuery *query;
+	KmerTraversal *traversal = (KmerTraversal *)in->traversalValue;
 	int level = in->level;
-	KMER *leafValue, *reconstrValue = NULL;
-	char *fullValue;
+	KMER *leafValue;
+	uint64 fullValue = 0;
+	int leafLen;
 	int fullLen;
 	bool res;
 	int j;
 
+	/* A leaf on the root page has no traversal value, compile locally */
+	query = kmerScanQuery(in->scankeys, in->nkeys, in->orderbys, in->norderbys,
+						  in->traversalValue, CurrentMemoryContext);
+
 	/* All tests are exact, so recheck is not required */
 	out->recheck = false;
 
 	leafValue = (KMER *)DatumGetPointer(in->leafDatum);
+	leafLen = kmer_get_length(leafValue);
 
 	/* Get the reconstructed value from the previous level, if any */
-	if (DatumGetPointer(in->reconstructedValue))
-		reconstrValue = (KMER *)DatumGetPointer(in->reconstructedValue);
+	Assert(traversal == NULL ? level == 0 : traversal->length == level);
 
-	Assert(reconstrValue == NULL ? level == 0 : VARSIZE_ANY_EXHDR(reconstrValue) == level);
+	/* Append the leaf bases to the previous reconstruction */
+	fullLen = level + leafLen;
+	if (level)
+		fullValue = traversal->bits;
+	fullValue = kmer_append_bits(fullValue, level, kmer_get_bits(leafValue));
 
-	/* Calculate the full length for reconstructed k-mer */
-	fullLen = level + VARSIZE_ANY_EXHDR(leafValue);
-	if (VARSIZE_ANY_EXHDR(leafValue) == 0 && level > 0)
-	{
-		fullValue = VARDATA_ANY(reconstrValue);
-		out->leafValue = PointerGetDatum(reconstrValue);
-	}
-	else
-	{
-		/* Allocate and build the full k-mer sequence */
-		KMER *fullKmer = palloc(VARHDRSZ_SHORT + fullLen);
-		SET_VARSIZE_SHORT(fullKmer, VARHDRSZ_SHORT + fullLen);
-		fullValue = VARDATA_ANY(fullKmer);
-
-		/* Copy previous reconstruction and leafValue sequences */
-		if (level)
-			memcpy(fullValue, VARDATA_ANY(reconstrValue), level);
-		if (VARSIZE_ANY_EXHDR(leafValue) > 0)
-			memcpy(fullValue + level, VARDATA_ANY(leafValue), VARSIZE_ANY_EXHDR(leafValue));
-
-		out->leafValue = PointerGetDatum(fullKmer);
-	}
-
-	/* Perform the required comparisons based on strategy */
+	/* Perform the required comparisons based on strategy, on the leaf bases */
 	res = true;
-	for (j = 0; j < in->nkeys; j++)
+	for (j = 0; j < query->nkeys; j++)
 	{
-		StrategyNumber strategy = in->scankeys[j].sk_strategy;
-		Datum arg = in->scankeys[j].sk_argument;
-		int r;
-		int queryLen;
-		KMER *query;
-		QKMER *patternQuery;
-		char *queryValue;
+		const KmerScanKey *key = &query->keys[j];
 
 		/* Apply the comparison strategy */
-		switch (strategy)
+		switch (key->strategy)
 		{
 		case BTEqualStrategyNumber:
-			query = (KMER *)DatumGetPointer(arg);
-			queryLen = VARSIZE_ANY_EXHDR(query);
-			r = memcmp(fullValue, VARDATA_ANY(query), Min(queryLen, fullLen));
-			res = (queryLen == fullLen) && (r == 0);
+			res = (key->length == fullLen) &&
+				((fullValue ^ key->bits) & kmer_range_mask(level, fullLen)) == 0;
 			break;
 		case RTPrefixStrategyNumber:
-			query = (KMER *)DatumGetPointer(arg);
-			queryLen = VARSIZE_ANY_EXHDR(query);
-			r = memcmp(fullValue, VARDATA_ANY(query), Min(queryLen, fullLen));
-			res = (level >= queryLen) || ((queryLen <= fullLen) && (r == 0));
+			res = (level >= key->length) ||
+				((key->length <= fullLen) &&
+				 ((fullValue ^ key->bits) & kmer_range_mask(level, key->length)) == 0);
 			break;
 		case RTContainsStrategyNumber:
 		case RTContainedByStrategyNumber:
-			patternQuery = (QKMER *)DatumGetPointer(arg);
-			queryLen = VARSIZE_ANY_EXHDR(patternQuery);
-			queryValue = VARDATA_ANY(patternQuery);
-
-            res = (queryLen == fullLen);
-            if (res) {
-                for (int i = 0; i < fullLen; i++) {
-                    if (!match(queryValue[i], fullValue[i])) {
-                        res = false;
-                        break;
-                    }
-                }
-            }
-
+			res = (key->length == fullLen) &&
+				qkmer_match_range(key->mask, fullValue, level, fullLen);
 			break;
-		default:
-			elog(ERROR, "unrecognized strategy number: %d", in->scankeys[j].sk_strategy);
-			res = false;
+		case KmerWithinStrategyNumber:
+			res = kmer_hamming_bits(fullValue, fullLen, key->bits, key->length) <= key->radius;
 			break;
 		}
 
@@ -562,5 +596,16 @@ Datum kmer_leaf_consistent(PG_FUNCTION_ARGS)
 			break;
 	}
 
+	/* The full k-mer is only formed for matches that are returned */
+	if (res && in->returnData)
+		out->leafValue = formKmerDatum(fullValue, fullLen);
+
+	/* Distances to the leaf are exact */
+	if (res && query->norderbys > 0)
+	{
+		out->distances = kmerOrderByDistances(query, fullValue, fullLen, true);
+		out->recheckDistances = false;
+	}
+
 	PG_RETURN_BOOL(res);
 }
@@ -4,6 +4,7 @@
 
 #include "postgres.h"
 #include "utils/varlena.h"
+#include "access/skey.h"
 //#include <varatt.h>
 
 // Struct for sorting values in picksplit
@@ -14,6 +15,45 @@ typedef struct spgNodePtr
     int16 c;
 } spgNodePtr;
 
+// Strategy of kmer <@ hamming_ball, which has no standard number
+#define KmerWithinStrategyNumber 31
+
+// Scan key compiled once per index scan
+typedef struct KmerScanKey
+{
+    StrategyNumber strategy;
+    int length;
+    uint64 bits;    // packed k-mer for =, ^@, <@ hamming_ball and <->
+    uint64 mask[2]; // pattern masks for @> and <@ qkmer
+    int radius;     // mismatch budget for <@ hamming_ball, -1 matches nothing
+} KmerScanKey;
+
+// Compiled scan keys, followed by the compiled ordering keys
+typedef struct KmerScanQuery
+{
+    int nkeys;
+    int norderbys;
+    KmerScanKey keys[FLEXIBLE_ARRAY_MEMBER];
+} KmerScanQuery;
+
+// Traversal value handed from an inner tuple to each child it descends into.
+// It carries the k-mer reconstructed so far, so no reconstructed values are
+// formed on the way down.
+typedef struct KmerTraversal
+{
+    const KmerScanQuery *query;
+    uint64 bits; // bases of the reconstructed prefix, left aligned
+    int length;  // length of the reconstructed prefix
+} KmerTraversal;
+
+extern const KmerScanQuery *kmerScanQuery(ScanKey scankeys, int nkeys, ScanKey orderbys,
+                                          int norderbys, void *traversalValue,
+                                          MemoryContext traversalCxt);
+extern double *kmerOrderByDistances(const KmerScanQuery *query, uint64 bits, int length,
+                                    bool exact);
+extern void *kmerTraversalValue(const KmerScanQuery *query, uint64 bits, int length,
+                                MemoryContext traversalCxt);
+
 // Define value for VARATT_SHORT_MAX if not already defined
 #ifndef VARATT_SHORT_MAX
 #define VARATT_SHORT_MAX 127
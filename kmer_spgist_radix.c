@@ -0,0 +1,300 @@
+/*
+ * kmer_spgist_radix.c
+ *
+ * Fixed-fanout radix trie variant of the SP-GiST index for kmer. Every inner
+ * tuple has exactly four positional children, one per nucleotide code, plus
+ * an end-of-key child, so nodes need no labels and a child is found by
+ * indexing with the 2-bit code of the next base. Prefixes and leaves are
+ * packed kmers.
+ *
+ * The node only routes on the base that follows the prefix; it does not
+ * consume it. The base stays at the start of the child's prefix or leaf, so
+ * allTheSame inner tuples, whose nodes carry no meaning, reconstruct the
+ * same values as any other tuple.
+ */
+
+#include "kmer_spgist.h"
+#include "kmer.h"
+#include "fmgr.h"
+#include "access/spgist.h"
+#include "catalog/pg_type.h"
+#include "utils/builtins.h"
+
+/*****************************************************************************/
+
+/*Radix SP-Gist index helper functions*/
+// Number of children of a radix inner tuple and the end-of-key child
+#define RADIX_NODES 5
+#define RADIX_END_NODE 4
+
+// Child for a k-mer of length len at the given position
+static inline int
+radixNode(uint64 bits, int len, int position)
+{
+    return position < len ? KMER_CODE_AT(bits, position) : RADIX_END_NODE;
+}
+
+// Checks the bases position..len-1 of a reconstructed prefix against all keys
+static inline bool
+radixPrefixConsistent(const KmerScanQuery *query, uint64 bits, int level, int len)
+{
+    int j;
+
+    for (j = 0; j < query->nkeys; j++)
+    {
+        const KmerScanKey *key = &query->keys[j];
+        bool res = true;
+
+        switch (key->strategy)
+        {
+        case BTEqualStrategyNumber:
+            res = (key->length >= len) &&
+                ((bits ^ key->bits) & kmer_range_mask(level, len)) == 0;
+            break;
+        case RTContainsStrategyNumber:
+        case RTContainedByStrategyNumber:
+            res = (key->length >= len) &&
+                qkmer_match_range(key->mask, bits, level, len);
+            break;
+        case RTPrefixStrategyNumber:
+            res = ((bits ^ key->bits) & kmer_range_mask(level, Min(key->length, len))) == 0;
+            break;
+        case KmerWithinStrategyNumber:
+            res = kmer_hamming_bound(bits, len, key->bits, key->length) <= key->radius;
+            break;
+        }
+
+        if (!res)
+            return false;
+    }
+
+    return true;
+}
+
+// Checks the child for the base at position len (or the end of the key)
+static inline bool
+radixNodeConsistent(const KmerScanQuery *query, int node, int len)
+{
+    int j;
+
+    for (j = 0; j < query->nkeys; j++)
+    {
+        const KmerScanKey *key = &query->keys[j];
+        bool res = true;
+
+        switch (key->strategy)
+        {
+        case BTEqualStrategyNumber:
+            res = (node == RADIX_END_NODE) ? key->length == len :
+                key->length > len && KMER_CODE_AT(key->bits, len) == node;
+            break;
+        case RTContainsStrategyNumber:
+        case RTContainedByStrategyNumber:
+            res = (node == RADIX_END_NODE) ? key->length == len :
+                key->length > len && ((qkmer_mask_at(key->mask, len) >> node) & 1);
+            break;
+        case RTPrefixStrategyNumber:
+            res = (key->length <= len) ||
+                (node != RADIX_END_NODE && KMER_CODE_AT(key->bits, len) == node);
+            break;
+        case KmerWithinStrategyNumber:
+            /* The routed base stays in the child, which tests it */
+            break;
+        }
+
+        if (!res)
+            return false;
+    }
+
+    return true;
+}
+
+/*****************************************************************************/
+
+/*Radix SP-Gist index functions implementation*/
+// Static information about the index implementation
+PG_FUNCTION_INFO_V1(kmer_radix_config);
+Datum kmer_radix_config(PG_FUNCTION_ARGS)
+{
+	spgConfigIn *in = (spgConfigIn *)PG_GETARG_POINTER(0);
+	spgConfigOut *cfg = (spgConfigOut *)PG_GETARG_POINTER(1);
+
+	cfg->prefixType = in->attType;
+	cfg->labelType = VOIDOID;
+	cfg->leafType = in->attType;
+	cfg->canReturnData = true;
+	cfg->longValuesOK = false;
+
+	PG_RETURN_VOID();
+}
+
+// Chooses a method for inserting a new value into an inner tuple
+PG_FUNCTION_INFO_V1(kmer_radix_choose);
+Datum kmer_radix_choose(PG_FUNCTION_ARGS)
+{
+	spgChooseIn *in = (spgChooseIn *)PG_GETARG_POINTER(0);
+	spgChooseOut *out = (spgChooseOut *)PG_GETARG_POINTER(1);
+
+	KMER *inKmer = (KMER *)DatumGetPointer(in->datum);
+	uint64 restBits = kmer_suffix_bits(kmer_get_bits(inKmer), in->level);
+	int restSize = kmer_get_length(inKmer) - in->level;
+	uint64 prefixBits = 0;
+	int prefixSize = 0;
+
+	if (in->hasPrefix)
+	{
+		KMER *prefixKmer = (KMER *)DatumGetPointer(in->prefixDatum);
+		int commonLen;
+
+		prefixBits = kmer_get_bits(prefixKmer);
+		prefixSize = kmer_get_length(prefixKmer);
+		commonLen = kmer_common_prefix(restBits, restSize, prefixBits, prefixSize);
+
+		if (commonLen < prefixSize)
+		{
+			/*
+			 * Must split tuple because incoming value doesn't match prefix.
+			 * The upper tuple keeps the common part of the prefix and the
+			 * old tuple moves below the child for the first differing base,
+			 * keeping that base at the start of its prefix.
+			 */
+			out->resultType = spgSplitTuple;
+
+			out->result.splitTuple.prefixHasPrefix = commonLen > 0;
+			if (commonLen > 0)
+				out->result.splitTuple.prefixPrefixDatum =
+					PointerGetDatum(kmer_from_bits(prefixBits, commonLen));
+			out->result.splitTuple.prefixNNodes = RADIX_NODES;
+			out->result.splitTuple.prefixNodeLabels = NULL;
+			out->result.splitTuple.childNodeN = KMER_CODE_AT(prefixBits, commonLen);
+
+			out->result.splitTuple.postfixHasPrefix = true;
+			out->result.splitTuple.postfixPrefixDatum =
+				PointerGetDatum(kmer_from_bits(kmer_suffix_bits(prefixBits, commonLen),
+											   prefixSize - commonLen));
+
+			PG_RETURN_VOID();
+		}
+	}
+
+	/*
+	 * Descend to the child for the base after the prefix. If in->allTheSame
+	 * the core code picks the node itself, which is fine as the child keeps
+	 * that base anyway.
+	 */
+	out->resultType = spgMatchNode;
+	out->result.matchNode.nodeN = radixNode(restBits, restSize, prefixSize);
+	out->result.matchNode.levelAdd = prefixSize;
+	out->result.matchNode.restDatum =
+		PointerGetDatum(kmer_from_bits(kmer_suffix_bits(restBits, prefixSize),
+									   restSize - prefixSize));
+
+	PG_RETURN_VOID();
+}
+
+// Decides how to create a new inner tuple over a set of leaf tuples
+PG_FUNCTION_INFO_V1(kmer_radix_picksplit);
+Datum kmer_radix_picksplit(PG_FUNCTION_ARGS)
+{
+	spgPickSplitIn *in = (spgPickSplitIn *)PG_GETARG_POINTER(0);
+	spgPickSplitOut *out = (spgPickSplitOut *)PG_GETARG_POINTER(1);
+
+	KMER *kmer0 = (KMER *)DatumGetPointer(in->datums[0]);
+	uint64 bits0 = kmer_get_bits(kmer0);
+	int i, commonLen;
+
+	/* Identify longest common prefix length among k-mers */
+	commonLen = kmer_get_length(kmer0);
+
+	for (i = 1; i < in->nTuples && commonLen > 0; i++)
+	{
+		KMER *kmeri = (KMER *)DatumGetPointer(in->datums[i]);
+		int tmp = kmer_common_prefix(bits0, kmer_get_length(kmer0),
+									 kmer_get_bits(kmeri), kmer_get_length(kmeri));
+		if (tmp < commonLen)
+			commonLen = tmp;
+	}
+
+	out->hasPrefix = commonLen > 0;
+	if (out->hasPrefix)
+		out->prefixDatum = PointerGetDatum(kmer_from_bits(bits0, commonLen));
+
+	/* Four positional children and the end-of-key child, without labels */
+	out->nNodes = RADIX_NODES;
+	out->nodeLabels = NULL;
+	out->mapTuplesToNodes = (int *)palloc(sizeof(int) * in->nTuples);
+	out->leafTupleDatums = (Datum *)palloc(sizeof(Datum) * in->nTuples);
+
+	for (i = 0; i < in->nTuples; i++)
+	{
+		KMER *kmeri = (KMER *)DatumGetPointer(in->datums[i]);
+		uint64 bits = kmer_get_bits(kmeri);
+		int len = kmer_get_length(kmeri);
+
+		out->mapTuplesToNodes[i] = radixNode(bits, len, commonLen);
+		out->leafTupleDatums[i] =
+			PointerGetDatum(kmer_from_bits(kmer_suffix_bits(bits, commonLen), len - commonLen));
+	}
+
+	PG_RETURN_VOID();
+}
+
+// Returns set of nodes (branches) to follow during tree search
+PG_FUNCTION_INFO_V1(kmer_radix_inner_consistent);
+Datum kmer_radix_inner_consistent(PG_FUNCTION_ARGS)
+{
+	spgInnerConsistentIn *in = (spgInnerConsistentIn *)PG_GETARG_POINTER(0);
+	spgInnerConsistentOut *out = (spgInnerConsistentOut *)PG_GETARG_POINTER(1);
+
+	const KmerScanQuery *query;
+	KmerTraversal *traversal = (KmerTraversal *)in->traversalValue;
+	uint64 reconstrBits = 0;
+	int reconstrLen = in->level;
+	int i;
+
+	query = kmerScanQuery(in->scankeys, in->nkeys, in->orderbys, in->norderbys,
+						  in->traversalValue, in->traversalMemoryContext);
+
+	Assert(traversal == NULL ? in->level == 0 : traversal->length == in->level);
+
+	if (in->level)
+		reconstrBits = traversal->bits;
+
+	if (in->hasPrefix)
+	{
+		KMER *prefixKmer = (KMER *)DatumGetPointer(in->prefixDatum);
+
+		reconstrBits = kmer_append_bits(reconstrBits, in->level, kmer_get_bits(prefixKmer));
+		reconstrLen += kmer_get_length(prefixKmer);
+	}
+
+	out->nodeNumbers = (int *)palloc(sizeof(int) * in->nNodes);
+	out->levelAdds = (int *)palloc(sizeof(int) * in->nNodes);
+	out->reconstructedValues = NULL;
+	out->traversalValues = (void **)palloc(sizeof(void *) * in->nNodes);
+	if (query->norderbys > 0)
+		out->distances = (double **)palloc(sizeof(double *) * in->nNodes);
+	out->nNodes = 0;
+
+	/* The prefix is shared by all children */
+	if (!radixPrefixConsistent(query, reconstrBits, in->level, reconstrLen))
+		PG_RETURN_VOID();
+
+	for (i = 0; i < in->nNodes; i++)
+	{
+		/* Nodes of an allTheSame tuple carry no base and are all visited */
+		if (!in->allTheSame && !radixNodeConsistent(query, i, reconstrLen))
+			continue;
+
+		out->nodeNumbers[out->nNodes] = i;
+		out->levelAdds[out->nNodes] = reconstrLen - in->level;
+		out->traversalValues[out->nNodes] = kmerTraversalValue(query, reconstrBits, reconstrLen,
+															   in->traversalMemoryContext);
+		if (query->norderbys > 0)
+			out->distances[out->nNodes] = kmerOrderByDistances(query, reconstrBits, reconstrLen,
+																false);
+		out->nNodes++;
+	}
+
+	PG_RETURN_VOID();
+}